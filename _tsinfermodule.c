@@ -182,9 +182,14 @@ AncestorBuilder_make_ancestor(AncestorBuilder *self, PyObject *args, PyObject *k
         PyErr_SetString(PyExc_ValueError, "num_focal_sites must > 0 and <= num_sites");
         goto fail;
     }
-    ancestor_array = (PyArrayObject *) PyArray_FROM_OTF(ancestor, NPY_UINT8,
-            NPY_ARRAY_INOUT_ARRAY);
-    if (ancestor_array == NULL) {
+    /* The engine writes directly into the ancestor buffer, so we insist
+     * on a conforming array rather than silently working on a copy. */
+    ancestor_array = (PyArrayObject *) ancestor;
+    Py_INCREF(ancestor_array);
+    if (PyArray_TYPE(ancestor_array) != NPY_UINT8
+            || !PyArray_ISCARRAY(ancestor_array)) {
+        PyErr_SetString(PyExc_ValueError,
+                "ancestor must be a C contiguous, writeable uint8 array");
         goto fail;
     }
     if (PyArray_NDIM(ancestor_array) != 1) {
@@ -210,7 +215,7 @@ AncestorBuilder_make_ancestor(AncestorBuilder *self, PyObject *args, PyObject *k
     return Py_BuildValue("ii", start, end);
 fail:
     Py_XDECREF(focal_sites_array);
-    PyArray_XDECREF_ERR(ancestor_array);
+    Py_XDECREF(ancestor_array);
     return NULL;
 }
 
@@ -230,7 +235,9 @@ AncestorBuilder_ancestor_descriptors(AncestorBuilder *self)
         goto out;
     }
 
+    Py_BEGIN_ALLOW_THREADS
     err = ancestor_builder_finalise(self->builder);
+    Py_END_ALLOW_THREADS
     if (err != 0) {
         handle_library_error(err);
         goto out;
@@ -1244,7 +1251,7 @@ AncestorMatcher_init(AncestorMatcher *self, PyObject *args, PyObject *kwds)
         flags = TSI_EXTENDED_CHECKS;
     }
     err = ancestor_matcher_alloc(self->ancestor_matcher,
-            self->tree_sequence_builder->tree_sequence_builder, flags);
+            self->tree_sequence_builder->tree_sequence_builder, 0, flags);
     if (err != 0) {
         handle_library_error(err);
         goto out;
@@ -1296,9 +1303,14 @@ AncestorMatcher_find_path(AncestorMatcher *self, PyObject *args, PyObject *kwds)
         goto out;
     }
 
-    match_array = (PyArrayObject *) PyArray_FROM_OTF(match, NPY_UINT8,
-            NPY_ARRAY_INOUT_ARRAY);
-    if (match_array == NULL) {
+    /* The matched haplotype is written in place, so require a conforming
+     * array rather than silently working on a copy. */
+    match_array = (PyArrayObject *) match;
+    Py_INCREF(match_array);
+    if (PyArray_TYPE(match_array) != NPY_UINT8
+            || !PyArray_ISCARRAY(match_array)) {
+        PyErr_SetString(PyExc_ValueError,
+                "match must be a C contiguous, writeable uint8 array");
         goto out;
     }
     if (PyArray_NDIM(match_array) != 1) {
@@ -1372,7 +1384,36 @@ AncestorMatcher_get_traceback(AncestorMatcher *self, PyObject *args)
     if (dict == NULL) {
         goto out;
     }
+    /* Decode the delta encoding: apply the base list, delete the removed
+     * nodes and then apply this site's entries on top. */
     list = &self->ancestor_matcher->traceback[site];
+    if (list->base != NULL) {
+        for (j = 0; j < list->base->size; j++) {
+            key = Py_BuildValue("k", (unsigned long) list->base->node[j]);
+            value = Py_BuildValue("i", (int) list->base->recombination_required[j]);
+            if (key == NULL || value == NULL) {
+                goto out;
+            }
+            if (PyDict_SetItem(dict, key, value) != 0) {
+                goto out;
+            }
+            Py_DECREF(key);
+            key = NULL;
+            Py_DECREF(value);
+            value = NULL;
+        }
+        for (j = 0; j < list->num_removed; j++) {
+            key = Py_BuildValue("k", (unsigned long) list->removed[j]);
+            if (key == NULL) {
+                goto out;
+            }
+            if (PyDict_DelItem(dict, key) != 0) {
+                goto out;
+            }
+            Py_DECREF(key);
+            key = NULL;
+        }
+    }
     for (j = 0; j < list->size; j++) {
         key = Py_BuildValue("k", (unsigned long) list->node[j]);
         value = Py_BuildValue("i", (int) list->recombination_required[j]);
@@ -1424,6 +1465,39 @@ out:
     return ret;
 }
 
+static PyObject *
+AncestorMatcher_get_stats(AncestorMatcher *self, void *closure)
+{
+    PyObject *ret = NULL;
+    ancestor_matcher_stats_t stats;
+    int err;
+
+    if (AncestorMatcher_check_state(self) != 0) {
+        goto out;
+    }
+    err = ancestor_matcher_get_stats(self->ancestor_matcher, &stats);
+    if (err != 0) {
+        handle_library_error(err);
+        goto out;
+    }
+    ret = Py_BuildValue(
+        "{s:k,s:k,s:k,s:k,s:k,s:k,s:k,s:k,s:d,s:d}",
+        "num_matches", (unsigned long) stats.num_matches,
+        "num_tree_transitions", (unsigned long) stats.num_tree_transitions,
+        "num_likelihood_nodes_updated",
+            (unsigned long) stats.num_likelihood_nodes_updated,
+        "num_descendant_tests", (unsigned long) stats.num_descendant_tests,
+        "num_preorder_builds", (unsigned long) stats.num_preorder_builds,
+        "num_likelihood_cache_hits",
+            (unsigned long) stats.num_likelihood_cache_hits,
+        "num_likelihood_cache_misses",
+            (unsigned long) stats.num_likelihood_cache_misses,
+        "total_traceback_bytes", (unsigned long) stats.total_traceback_bytes,
+        "forwards_time", stats.forwards_time,
+        "traceback_time", stats.traceback_time);
+out:
+    return ret;
+}
 
 static PyMemberDef AncestorMatcher_members[] = {
     {NULL}  /* Sentinel */
@@ -1435,6 +1509,8 @@ static PyGetSetDef AncestorMatcher_getsetters[] = {
         NULL, "The mean size of the traceback per site."},
     {"total_memory", (getter) AncestorMatcher_get_total_memory,
         NULL, "The total amount of memory used by this matcher."},
+    {"stats", (getter) AncestorMatcher_get_stats,
+        NULL, "A dict of hot-path counters for this matcher."},
     {NULL}  /* Sentinel */
 };
 
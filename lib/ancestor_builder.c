@@ -34,11 +34,76 @@ typedef struct {
 } site_equality_t;
 
 
+/* Sorts pattern pointers by frequency, high to low, and within a
+ * frequency class by the genotypes. Because sample 0 is packed into the
+ * most significant bit, numeric comparison of the words is equivalent to
+ * lexicographic comparison of the unpacked genotypes. */
 static int
 cmp_pattern_map(const void *a, const void *b) {
-    const pattern_map_t *ia = (pattern_map_t const *) a;
-    const pattern_map_t *ib = (pattern_map_t const *) b;
-    int ret = memcmp(ia->genotypes, ib->genotypes, ia->num_samples * sizeof(allele_t));
+    const pattern_map_t *ia = *(pattern_map_t *const *) a;
+    const pattern_map_t *ib = *(pattern_map_t *const *) b;
+    const uint64_t *restrict ga = ia->genotypes;
+    const uint64_t *restrict gb = ib->genotypes;
+    size_t j;
+    int ret = (ia->frequency < ib->frequency) - (ia->frequency > ib->frequency);
+
+    for (j = 0; j < ia->num_words && ret == 0; j++) {
+        ret = (ga[j] > gb[j]) - (ga[j] < gb[j]);
+    }
+    return ret;
+}
+
+static inline size_t
+ancestor_builder_pattern_hash_bucket(ancestor_builder_t *self,
+        const uint64_t *restrict genotypes)
+{
+    size_t j;
+    uint64_t h = 0;
+
+    for (j = 0; j < self->num_genotype_words; j++) {
+        h ^= genotypes[j];
+        h *= 0x9e3779b97f4a7c15ULL;
+    }
+    h ^= h >> 32;
+    return (size_t) h & (self->pattern_hash_size - 1);
+}
+
+static int WARN_UNUSED
+ancestor_builder_pattern_hash_insert(ancestor_builder_t *self,
+        pattern_map_t *map_elem)
+{
+    int ret = 0;
+    size_t j, bucket, old_size;
+    pattern_map_t **old_hash, *elem, *next;
+
+    if (self->num_patterns == self->pattern_hash_size) {
+        old_hash = self->pattern_hash;
+        old_size = self->pattern_hash_size;
+        self->pattern_hash_size = 2 * old_size;
+        self->pattern_hash = calloc(self->pattern_hash_size,
+                sizeof(*self->pattern_hash));
+        if (self->pattern_hash == NULL) {
+            self->pattern_hash = old_hash;
+            self->pattern_hash_size = old_size;
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        for (j = 0; j < old_size; j++) {
+            for (elem = old_hash[j]; elem != NULL; elem = next) {
+                next = elem->next;
+                bucket = ancestor_builder_pattern_hash_bucket(self,
+                        elem->genotypes);
+                elem->next = self->pattern_hash[bucket];
+                self->pattern_hash[bucket] = elem;
+            }
+        }
+        free(old_hash);
+    }
+    bucket = ancestor_builder_pattern_hash_bucket(self, map_elem->genotypes);
+    map_elem->next = self->pattern_hash[bucket];
+    self->pattern_hash[bucket] = map_elem;
+    self->num_patterns++;
+out:
     return ret;
 }
 
@@ -47,7 +112,6 @@ ancestor_builder_alloc(ancestor_builder_t *self, size_t num_samples, size_t num_
         int flags)
 {
     int ret = 0;
-    size_t j;
     // TODO error checking
     //
     assert(num_samples > 1);
@@ -57,12 +121,16 @@ ancestor_builder_alloc(ancestor_builder_t *self, size_t num_samples, size_t num_
     memset(self, 0, sizeof(ancestor_builder_t));
     self->num_samples = num_samples;
     self->num_sites = num_sites;
+    self->num_genotype_words = PACKED_GENOTYPE_WORDS(num_samples);
     self->flags = flags;
     self->sites = calloc(num_sites, sizeof(site_t));
-    self->frequency_map = calloc(num_samples + 1, sizeof(avl_tree_t));
+    self->pattern_hash_size = 1024;
+    self->pattern_hash = calloc(self->pattern_hash_size,
+            sizeof(*self->pattern_hash));
     self->descriptors = calloc(num_sites, sizeof(ancestor_descriptor_t));
-    if (self->sites == NULL || self->frequency_map == NULL
-            || self->descriptors == NULL) {
+    self->genotype_scratch = malloc(self->num_genotype_words * sizeof(uint64_t));
+    if (self->sites == NULL || self->pattern_hash == NULL
+            || self->descriptors == NULL || self->genotype_scratch == NULL) {
         ret = TSI_ERR_NO_MEMORY;
         goto out;
     }
@@ -70,9 +138,6 @@ ancestor_builder_alloc(ancestor_builder_t *self, size_t num_samples, size_t num_
     if (ret != 0) {
         goto out;
     }
-    for (j = 0; j < num_samples + 1; j++) {
-        avl_init_tree(&self->frequency_map[j], cmp_pattern_map, NULL);
-    }
 out:
     return ret;
 }
@@ -81,43 +146,32 @@ int
 ancestor_builder_free(ancestor_builder_t *self)
 {
     tsi_safe_free(self->sites);
-    tsi_safe_free(self->frequency_map);
+    tsi_safe_free(self->pattern_hash);
     tsi_safe_free(self->descriptors);
+    tsi_safe_free(self->genotype_scratch);
     block_allocator_free(&self->allocator);
     return 0;
 }
 
-static inline void
-ancestor_builder_get_consistent_samples(ancestor_builder_t *self, site_id_t site,
-        node_id_t *samples, size_t *num_samples)
-{
-    node_id_t j, k;
-    allele_t *restrict genotypes = self->sites[site].genotypes;
-
-    k = 0;
-    for (j = 0; j < (node_id_t) self->num_samples; j++) {
-        if (genotypes[j] == 1) {
-            samples[k] = j;
-            k++;
-        }
-    }
-    *num_samples = (size_t) k;
-}
-
 static inline bool
 ancestor_builder_make_site(ancestor_builder_t *self, site_id_t focal_site_id,
-        site_id_t site_id, node_id_t *restrict consistent_samples,
+        site_id_t site_id, const uint64_t *restrict focal_genotypes,
         size_t num_consistent_samples, allele_t *ancestor)
 {
     size_t j, ones;
     const site_t focal_site = self->sites[focal_site_id];
-    allele_t *restrict site_genotypes = self->sites[site_id].genotypes;
+    const uint64_t *restrict site_genotypes = self->sites[site_id].genotypes;
+    const size_t num_words = self->num_genotype_words;
     bool ret = true;
 
     if (self->sites[site_id].frequency > focal_site.frequency) {
+        /* The consistent samples are exactly the carriers at the focal
+         * site, so the count of consistent carriers here is the popcount
+         * of the intersection of the two packed genotype arrays. */
         ones = 0;
-        for (j = 0; j < num_consistent_samples; j++) {
-            ones += site_genotypes[consistent_samples[j]];
+        for (j = 0; j < num_words; j++) {
+            ones += (size_t) __builtin_popcountll(
+                    site_genotypes[j] & focal_genotypes[j]);
         }
         if (ones == num_consistent_samples) {
             ancestor[site_id] = 1;
@@ -141,20 +195,28 @@ ancestor_builder_make_ancestor(ancestor_builder_t *self, size_t num_focal_sites,
     int ret = 0;
     int64_t l;
     site_id_t j, k, focal_site, start, end;
-    size_t num_consistent_samples = 0;
+    size_t num_consistent_samples;
     size_t num_sites = self->num_sites;
-    node_id_t *consistent_samples = malloc(self->num_samples * sizeof(node_id_t));
+    const uint64_t *restrict focal_genotypes;
+    node_id_t first_sample;
     bool consistent;
 
-    if (consistent_samples == NULL) {
-        goto out;
-    }
     // TODO proper error checking.
     assert(num_focal_sites > 0);
 
-    ancestor_builder_get_consistent_samples(self, focal_sites[0], consistent_samples,
-            &num_consistent_samples);
-    assert(num_consistent_samples == self->sites[focal_sites[0]].frequency);
+    /* The consistent samples are the carriers at the first focal site. We
+     * work with their packed genotypes directly; the only individual
+     * sample we need is the first carrier. */
+    focal_genotypes = self->sites[focal_sites[0]].genotypes;
+    num_consistent_samples = self->sites[focal_sites[0]].frequency;
+    first_sample = NULL_NODE;
+    for (j = 0; j < (site_id_t) self->num_genotype_words; j++) {
+        if (focal_genotypes[j] != 0) {
+            first_sample = 64 * j + __builtin_clzll(focal_genotypes[j]);
+            break;
+        }
+    }
+    assert(first_sample != NULL_NODE);
 
     /* Set any unknown values to -1 */
     memset(ancestor, 0xff, num_sites * sizeof(allele_t));
@@ -168,7 +230,8 @@ ancestor_builder_make_ancestor(ancestor_builder_t *self, size_t num_focal_sites,
         for (k = focal_sites[j - 1] + 1; k < focal_sites[j]; k++) {
             ancestor[k] = 0;
             if (self->sites[k].frequency > self->sites[focal_site].frequency) {
-                ancestor[k] = self->sites[k].genotypes[consistent_samples[0]];
+                ancestor[k] = (allele_t) PACKED_GENOTYPE_GET(
+                        self->sites[k].genotypes, first_sample);
             }
         }
         ancestor[focal_sites[j]] = 1;
@@ -178,7 +241,7 @@ ancestor_builder_make_ancestor(ancestor_builder_t *self, size_t num_focal_sites,
     consistent = true;
     for (l = ((int64_t) focal_site) - 1; l >= 0 && consistent; l--) {
         consistent = ancestor_builder_make_site(self, focal_site, l,
-                consistent_samples, num_consistent_samples, ancestor);
+                focal_genotypes, num_consistent_samples, ancestor);
     }
     start = l + 1 + (int) !consistent;
 
@@ -187,14 +250,125 @@ ancestor_builder_make_ancestor(ancestor_builder_t *self, size_t num_focal_sites,
     focal_site = focal_sites[num_focal_sites - 1];
     for (l = focal_site + 1; l < (int64_t) num_sites && consistent; l++) {
         consistent = ancestor_builder_make_site(self, focal_site, l,
-                consistent_samples, num_consistent_samples, ancestor);
+                focal_genotypes, num_consistent_samples, ancestor);
     }
     end = l - (int) !consistent;
 
     *ret_start = start;
     *ret_end = end;
+    return ret;
+}
+
+/* State for generating a range of ancestors concurrently. Threads claim
+ * the next unbuilt descriptor under the mutex; make_ancestor itself is a
+ * pure read of the site data, so no other synchronisation is needed. */
+typedef struct {
+    ancestor_builder_t *builder;
+    size_t start;
+    size_t end;
+    size_t next;
+    allele_t *ancestors;
+    site_id_t *starts;
+    site_id_t *ends;
+    int error;
+    pthread_mutex_t mutex;
+} make_ancestors_work_t;
+
+static void *
+ancestor_builder_make_ancestors_worker(void *arg)
+{
+    int ret = 0;
+    make_ancestors_work_t *work = (make_ancestors_work_t *) arg;
+    ancestor_builder_t *self = work->builder;
+    ancestor_descriptor_t *descriptor;
+    size_t k;
+    bool done = false;
+
+    while (!done) {
+        pthread_mutex_lock(&work->mutex);
+        k = work->next;
+        if (k == work->end || work->error != 0) {
+            done = true;
+        } else {
+            work->next++;
+        }
+        pthread_mutex_unlock(&work->mutex);
+        if (done) {
+            break;
+        }
+        descriptor = self->descriptors + k;
+        ret = ancestor_builder_make_ancestor(self, descriptor->num_focal_sites,
+                descriptor->focal_sites, work->starts + (k - work->start),
+                work->ends + (k - work->start),
+                work->ancestors + (k - work->start) * self->num_sites);
+        if (ret != 0) {
+            pthread_mutex_lock(&work->mutex);
+            work->error = ret;
+            pthread_mutex_unlock(&work->mutex);
+            done = true;
+        }
+    }
+    return NULL;
+}
+
+/* Build the ancestors for descriptors [start, end), using up to num_threads
+ * threads, into the supplied store. Row (k - start) of ancestors holds the
+ * ancestor for descriptor k, with its bounds in starts and ends. */
+int
+ancestor_builder_make_ancestors(ancestor_builder_t *self, size_t start, size_t end,
+        size_t num_threads, allele_t *ancestors, site_id_t *starts, site_id_t *ends)
+{
+    int ret = 0;
+    size_t j;
+    pthread_t *threads = NULL;
+    make_ancestors_work_t work;
+
+    assert(start <= end);
+    assert(end <= self->num_ancestors);
+    work.builder = self;
+    work.start = start;
+    work.end = end;
+    work.next = start;
+    work.ancestors = ancestors;
+    work.starts = starts;
+    work.ends = ends;
+    work.error = 0;
+    num_threads = TSI_MIN(TSI_MAX(num_threads, 1), end - start);
+    if (num_threads <= 1) {
+        /* Synchronous case: run everything in the calling thread. */
+        if (pthread_mutex_init(&work.mutex, NULL) != 0) {
+            ret = TSI_ERR_GENERIC;
+            goto out;
+        }
+        ancestor_builder_make_ancestors_worker(&work);
+        pthread_mutex_destroy(&work.mutex);
+    } else {
+        if (pthread_mutex_init(&work.mutex, NULL) != 0) {
+            ret = TSI_ERR_GENERIC;
+            goto out;
+        }
+        threads = malloc(num_threads * sizeof(pthread_t));
+        if (threads == NULL) {
+            pthread_mutex_destroy(&work.mutex);
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        for (j = 0; j < num_threads; j++) {
+            if (pthread_create(threads + j, NULL,
+                    ancestor_builder_make_ancestors_worker, &work) != 0) {
+                work.error = TSI_ERR_GENERIC;
+                num_threads = j;
+                break;
+            }
+        }
+        for (j = 0; j < num_threads; j++) {
+            pthread_join(threads[j], NULL);
+        }
+        pthread_mutex_destroy(&work.mutex);
+    }
+    ret = work.error;
 out:
-    tsi_safe_free(consistent_samples);
+    tsi_safe_free(threads);
     return ret;
 }
 
@@ -203,43 +377,49 @@ ancestor_builder_add_site(ancestor_builder_t *self, site_id_t l, size_t frequenc
         allele_t *genotypes)
 {
     int ret = 0;
+    size_t j, bucket;
     site_t *site;
-    avl_node_t *avl_node;
     site_list_t *list_node;
-    pattern_map_t search, *map_elem;
-    avl_tree_t *pattern_map = &self->frequency_map[frequency];
+    pattern_map_t *map_elem;
+    uint64_t *restrict packed = self->genotype_scratch;
+    const size_t num_words = self->num_genotype_words;
 
     assert(frequency <= self->num_samples);
     assert(l < (site_id_t) self->num_sites);
     site = &self->sites[l];
     site->frequency = frequency;
     if (frequency > 1) {
-        search.genotypes = genotypes;
-        search.num_samples = self->num_samples;
-        avl_node = avl_search(pattern_map, &search);
-        if (avl_node == NULL) {
-            avl_node = block_allocator_get(&self->allocator, sizeof(avl_node_t));
+        memset(packed, 0, num_words * sizeof(uint64_t));
+        for (j = 0; j < self->num_samples; j++) {
+            if (genotypes[j] == 1) {
+                packed[j >> 6] |= 1ULL << (63 - (j & 63));
+            }
+        }
+        bucket = ancestor_builder_pattern_hash_bucket(self, packed);
+        map_elem = self->pattern_hash[bucket];
+        while (map_elem != NULL && memcmp(map_elem->genotypes, packed,
+                    num_words * sizeof(uint64_t)) != 0) {
+            map_elem = map_elem->next;
+        }
+        if (map_elem == NULL) {
             map_elem = block_allocator_get(&self->allocator, sizeof(pattern_map_t));
             site->genotypes = block_allocator_get(&self->allocator,
-                    self->num_samples * sizeof(allele_t));
-            if (avl_node == NULL || map_elem == NULL || site->genotypes == NULL) {
+                    num_words * sizeof(uint64_t));
+            if (map_elem == NULL || site->genotypes == NULL) {
                 ret = TSI_ERR_NO_MEMORY;
                 goto out;
             }
-            memcpy(site->genotypes, genotypes, self->num_samples * sizeof(allele_t));
-            avl_init_node(avl_node, map_elem);
+            memcpy(site->genotypes, packed, num_words * sizeof(uint64_t));
             map_elem->genotypes = site->genotypes;
-            map_elem->num_samples = self->num_samples;
+            map_elem->num_words = num_words;
+            map_elem->frequency = frequency;
             map_elem->sites = NULL;
             map_elem->num_sites = 0;
-            avl_node = avl_insert_node(pattern_map, avl_node);
-            assert(avl_node != NULL);
-            if (site->genotypes == NULL) {
-                ret = TSI_ERR_NO_MEMORY;
+            ret = ancestor_builder_pattern_hash_insert(self, map_elem);
+            if (ret != 0) {
                 goto out;
             }
         } else {
-            map_elem = (pattern_map_t *) avl_node->item;
             site->genotypes = map_elem->genotypes;
         }
         map_elem->num_sites++;
@@ -260,35 +440,36 @@ out:
 static void
 ancestor_builder_check_state(ancestor_builder_t *self)
 {
-    size_t f, k, count;
-    avl_node_t *a;
+    size_t j, k, count, num_patterns;
     pattern_map_t *map_elem;
     site_list_t *s;
 
-    for (f = 0; f < self->num_samples + 1; f++) {
-        for (a = self->frequency_map[f].head; a != NULL; a = a->next) {
-            map_elem = (pattern_map_t *) a->item;
+    num_patterns = 0;
+    for (j = 0; j < self->pattern_hash_size; j++) {
+        for (map_elem = self->pattern_hash[j]; map_elem != NULL;
+                map_elem = map_elem->next) {
+            num_patterns++;
             count = 0;
-            for (k = 0; k < self->num_samples; k++) {
-                count += map_elem->genotypes[k] == 1;
+            for (k = 0; k < map_elem->num_words; k++) {
+                count += (size_t) __builtin_popcountll(map_elem->genotypes[k]);
             }
-            assert(count == f);
+            assert(count == map_elem->frequency);
             count = 0;
             for (s = map_elem->sites; s != NULL; s = s->next) {
-                assert(self->sites[s->site].frequency == f);
+                assert(self->sites[s->site].frequency == map_elem->frequency);
                 assert(self->sites[s->site].genotypes == map_elem->genotypes);
                 count++;
             }
             assert(map_elem->num_sites == count);
         }
     }
+    assert(num_patterns == self->num_patterns);
 }
 
 int
 ancestor_builder_print_state(ancestor_builder_t *self, FILE *out)
 {
     size_t j, k;
-    avl_node_t *a;
     pattern_map_t *map_elem;
     site_list_t *s;
 
@@ -300,17 +481,15 @@ ancestor_builder_print_state(ancestor_builder_t *self, FILE *out)
     fprintf(out, "Sites:\n");
     for (j = 0; j < self->num_sites; j++) {
         fprintf(out, "%d\t%d\t%p\n", (int) j, (int) self->sites[j].frequency,
-                self->sites[j].genotypes);
+                (void *) self->sites[j].genotypes);
     }
-    fprintf(out, "Frequency map:\n");
-    for (j = 0; j < self->num_samples + 1; j++) {
-        printf("Frequency = %d: %d ancestors\n", (int) j,
-                avl_count(&self->frequency_map[j]));
-        for (a = self->frequency_map[j].head; a != NULL; a = a->next) {
-            map_elem = (pattern_map_t *) a->item;
-            printf("\t");
+    fprintf(out, "Pattern hash: %d patterns\n", (int) self->num_patterns);
+    for (j = 0; j < self->pattern_hash_size; j++) {
+        for (map_elem = self->pattern_hash[j]; map_elem != NULL;
+                map_elem = map_elem->next) {
+            printf("\t%d\t", (int) map_elem->frequency);
             for (k = 0; k < self->num_samples; k++) {
-                printf("%d", map_elem->genotypes[k]);
+                printf("%d", (int) PACKED_GENOTYPE_GET(map_elem->genotypes, k));
             }
             printf("\t");
             for (s = map_elem->sites; s != NULL; s = s->next) {
@@ -337,17 +516,21 @@ ancestor_builder_print_state(ancestor_builder_t *self, FILE *out)
  * site a to focal site b */
 static bool
 ancestor_builder_break_ancestor(ancestor_builder_t *self, site_id_t a,
-        site_id_t b, node_id_t *restrict samples, size_t num_samples)
+        site_id_t b, const uint64_t *restrict focal_genotypes, size_t num_samples)
 {
     bool ret = false;
-    site_id_t j, k;
-    size_t ones;
+    site_id_t j;
+    size_t k, ones;
+    const size_t num_words = self->num_genotype_words;
+    const uint64_t *restrict site_genotypes;
 
     for (j = a + 1; j < b && !ret; j++) {
         if (self->sites[j].frequency > self->sites[a].frequency) {
+            site_genotypes = self->sites[j].genotypes;
             ones = 0;
-            for (k = 0; k < (site_id_t) num_samples; k++) {
-                ones += self->sites[j].genotypes[samples[k]];
+            for (k = 0; k < num_words; k++) {
+                ones += (size_t) __builtin_popcountll(
+                        site_genotypes[k] & focal_genotypes[k]);
             }
             if (ones != num_samples && ones != 0) {
                 ret = true;
@@ -361,63 +544,69 @@ int
 ancestor_builder_finalise(ancestor_builder_t *self)
 {
     int ret = 0;
-    size_t j, k, num_consistent_samples;
-    avl_node_t *a;
+    size_t j, k, num_patterns;
     pattern_map_t *map_elem;
+    pattern_map_t **patterns = NULL;
     site_list_t *s;
     ancestor_descriptor_t *descriptor;
     site_id_t *focal_sites = NULL;
     site_id_t *p;
-    site_id_t *consistent_samples = malloc(self->num_samples * sizeof(node_id_t));
 
-    if (consistent_samples == NULL) {
+    /* The hash table has no useful ordering, so we sort the patterns by
+     * frequency and genotypes to get a deterministic ancestor order. */
+    patterns = malloc(self->num_patterns * sizeof(*patterns));
+    if (self->num_patterns > 0 && patterns == NULL) {
         ret = TSI_ERR_NO_MEMORY;
         goto out;
     }
-    num_consistent_samples = 0;  /* Keep the compiler happy */
+    num_patterns = 0;
+    for (j = 0; j < self->pattern_hash_size; j++) {
+        for (map_elem = self->pattern_hash[j]; map_elem != NULL;
+                map_elem = map_elem->next) {
+            patterns[num_patterns] = map_elem;
+            num_patterns++;
+        }
+    }
+    assert(num_patterns == self->num_patterns);
+    qsort(patterns, num_patterns, sizeof(*patterns), cmp_pattern_map);
+
     self->num_ancestors = 0;
-    for (j = self->num_samples; j > 1; j--) {
-        for (a = self->frequency_map[j].head; a != NULL; a = a->next) {
-            descriptor = self->descriptors + self->num_ancestors;
-            self->num_ancestors++;
-            descriptor->frequency = j;
-            map_elem = (pattern_map_t *) a->item;
-            focal_sites = block_allocator_get(&self->allocator,
-                    map_elem->num_sites * sizeof(site_id_t));
-            if (focal_sites == NULL) {
-                ret = TSI_ERR_NO_MEMORY;
-                goto out;
-            }
-            descriptor->focal_sites = focal_sites;
-            descriptor->num_focal_sites = map_elem->num_sites;
-            k = map_elem->num_sites - 1;
-            for (s = map_elem->sites; s != NULL; s = s->next) {
-                focal_sites[k] = s->site;
-                k--;
-            }
-            /* Now check to see if we need to split this ancestor up
-             * further */
-            if (map_elem->num_sites > 1) {
-                ancestor_builder_get_consistent_samples(self, focal_sites[0],
-                        consistent_samples, &num_consistent_samples);
-                assert(num_consistent_samples == descriptor->frequency);
-            }
-            for (k = 0; k < map_elem->num_sites - 1; k++) {
-                if (ancestor_builder_break_ancestor(
-                        self, focal_sites[k], focal_sites[k + 1],
-                        consistent_samples, num_consistent_samples)) {
-                    p = focal_sites + k + 1;
-                    descriptor->num_focal_sites = p - descriptor->focal_sites;
-                    descriptor = self->descriptors + self->num_ancestors;
-                    self->num_ancestors++;
-                    descriptor->frequency = j;
-                    descriptor->num_focal_sites = map_elem->num_sites - k - 1;
-                    descriptor->focal_sites = p;
-                }
+    for (j = 0; j < num_patterns; j++) {
+        map_elem = patterns[j];
+        descriptor = self->descriptors + self->num_ancestors;
+        self->num_ancestors++;
+        descriptor->frequency = map_elem->frequency;
+        focal_sites = block_allocator_get(&self->allocator,
+                map_elem->num_sites * sizeof(site_id_t));
+        if (focal_sites == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        descriptor->focal_sites = focal_sites;
+        descriptor->num_focal_sites = map_elem->num_sites;
+        k = map_elem->num_sites - 1;
+        for (s = map_elem->sites; s != NULL; s = s->next) {
+            focal_sites[k] = s->site;
+            k--;
+        }
+        /* Now check to see if we need to split this ancestor up
+         * further. The consistent samples are the carriers of this
+         * pattern, so we use its packed genotypes directly. */
+        for (k = 0; k < map_elem->num_sites - 1; k++) {
+            if (ancestor_builder_break_ancestor(
+                    self, focal_sites[k], focal_sites[k + 1],
+                    map_elem->genotypes, map_elem->frequency)) {
+                p = focal_sites + k + 1;
+                descriptor->num_focal_sites = p - descriptor->focal_sites;
+                descriptor = self->descriptors + self->num_ancestors;
+                self->num_ancestors++;
+                descriptor->frequency = map_elem->frequency;
+                descriptor->num_focal_sites = map_elem->num_sites - k - 1;
+                descriptor->focal_sites = p;
             }
         }
     }
 out:
-    tsi_safe_free(consistent_samples);
+    tsi_safe_free(patterns);
     return ret;
 }
@@ -17,6 +17,8 @@
 ** along with tsinfer.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _POSIX_C_SOURCE 199309L
+
 #include "tsinfer.h"
 #include "err.h"
 
@@ -24,6 +26,24 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
+
+#ifdef __GNUC__
+/* Byte vectors for the likelihood transition kernel. */
+#define TSI_VECTOR_WIDTH 16
+typedef int8_t tsi_int8x16 __attribute__((vector_size(TSI_VECTOR_WIDTH)));
+#define TSI_SPLAT16(x) {x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x}
+#endif
+
+/* Wall clock time used for the per-phase counters in the stats. */
+static double
+ancestor_matcher_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec;
+}
 
 static inline bool
 is_nonzero_root(const node_id_t u, const node_id_t *restrict parent,
@@ -64,6 +84,18 @@ ancestor_matcher_print_state(ancestor_matcher_t *self, FILE *out)
     node_id_t u;
 
     fprintf(out, "Ancestor matcher state\n");
+    fprintf(out, "stats: matches=%d transitions=%d L-updates=%d "
+            "descendant-tests=%d preorder-builds=%d "
+            "L-cache-hits=%d L-cache-misses=%d "
+            "forwards-time=%f traceback-time=%f\n",
+            (int) self->stats.num_matches,
+            (int) self->stats.num_tree_transitions,
+            (int) self->stats.num_likelihood_nodes_updated,
+            (int) self->stats.num_descendant_tests,
+            (int) self->stats.num_preorder_builds,
+            (int) self->stats.num_likelihood_cache_hits,
+            (int) self->stats.num_likelihood_cache_misses,
+            self->stats.forwards_time, self->stats.traceback_time);
     fprintf(out, "tree = \n");
     fprintf(out, "id\tparent\tlchild\trchild\tlsib\trsib\tlikelihood\n");
     for (j = 0; j < (int) self->num_nodes; j++) {
@@ -79,12 +111,16 @@ ancestor_matcher_print_state(ancestor_matcher_t *self, FILE *out)
     }
     fprintf(out, "traceback\n");
     for (j = 0; j < (int) self->num_sites; j++) {
-        fprintf(out, "\t%d:%d (%d)\t", (int) j,
-                self->max_likelihood_node[j], self->traceback[j].size);
+        fprintf(out, "\t%d:%d (%d%s)\t", (int) j,
+                self->max_likelihood_node[j], self->traceback[j].size,
+                self->traceback[j].base == NULL ? "" : " delta");
         for (k = 0; k < self->traceback[j].size; k++) {
             fprintf(out, "(%d, %d)", self->traceback[j].node[k],
                     self->traceback[j].recombination_required[k]);
         }
+        for (k = 0; k < self->traceback[j].num_removed; k++) {
+            fprintf(out, "(-%d)", self->traceback[j].removed[k]);
+        }
         fprintf(out, "\n");
     }
     block_allocator_print_state(&self->traceback_allocator, out);
@@ -95,13 +131,17 @@ ancestor_matcher_print_state(ancestor_matcher_t *self, FILE *out)
 
 int
 ancestor_matcher_alloc(ancestor_matcher_t *self,
-        tree_sequence_builder_t *tree_sequence_builder, int flags)
+        tree_sequence_builder_t *tree_sequence_builder,
+        size_t traceback_block_size, int flags)
 {
     int ret = 0;
-    /* TODO make these input parameters. */
-    size_t traceback_block_size = 64 * 1024 * 1024;
 
     memset(self, 0, sizeof(ancestor_matcher_t));
+    /* Zero means the default traceback memory budget. */
+    if (traceback_block_size == 0) {
+        traceback_block_size = 64 * 1024 * 1024;
+    }
+    self->traceback_block_size = traceback_block_size;
     /* All allocs for arrays related to nodes are done in expand_nodes */
     self->flags = flags;
     self->max_nodes = 0;
@@ -119,7 +159,10 @@ ancestor_matcher_alloc(ancestor_matcher_t *self,
         ret = TSI_ERR_NO_MEMORY;
         goto out;
     }
-    ret = block_allocator_alloc(&self->traceback_allocator, traceback_block_size);
+    memset(self->max_likelihood_node, 0xff, self->num_sites * sizeof(node_id_t));
+    ret = block_allocator_alloc_flags(&self->traceback_allocator,
+            traceback_block_size,
+            flags & TSI_HUGEPAGES ? BLOCK_ALLOCATOR_HUGEPAGE : 0);
     if (ret != 0) {
         goto out;
     }
@@ -127,26 +170,46 @@ out:
     return ret;
 }
 
+/* Sets a hard budget in bytes on the traceback store; zero disables the
+ * cap. The budget is enforced at allocator granularity, so the actual
+ * memory held is bounded by the budget plus one allocator chunk, plus
+ * one paged-in segment during the traceback. */
+int
+ancestor_matcher_set_traceback_budget(ancestor_matcher_t *self,
+        size_t traceback_budget)
+{
+    self->traceback_budget = traceback_budget;
+    return 0;
+}
+
 int
 ancestor_matcher_free(ancestor_matcher_t *self)
 {
-    tsi_safe_free(self->parent);
-    tsi_safe_free(self->left_child);
-    tsi_safe_free(self->right_child);
-    tsi_safe_free(self->left_sib);
-    tsi_safe_free(self->right_sib);
+    tsi_safe_free(self->tree_arrays);
     tsi_safe_free(self->recombination_required);
     tsi_safe_free(self->likelihood);
     tsi_safe_free(self->likelihood_cache);
+    tsi_safe_free(self->likelihood_gather);
+    tsi_safe_free(self->recomb_gather);
     tsi_safe_free(self->likelihood_nodes);
     tsi_safe_free(self->likelihood_nodes_tmp);
-    tsi_safe_free(self->path_cache);
+    tsi_safe_free(self->preorder_enter);
+    tsi_safe_free(self->preorder_leave);
+    tsi_safe_free(self->preorder_stamp);
+    tsi_safe_free(self->preorder_stack);
+    tsi_safe_free(self->traceback_base_value);
+    tsi_safe_free(self->dirty_nodes);
     tsi_safe_free(self->max_likelihood_node);
     tsi_safe_free(self->traceback);
     tsi_safe_free(self->output.left);
     tsi_safe_free(self->output.right);
     tsi_safe_free(self->output.parent);
     block_allocator_free(&self->traceback_allocator);
+    if (self->traceback_file != NULL) {
+        fclose(self->traceback_file);
+    }
+    tsi_safe_free(self->traceback_segments);
+    tsi_safe_free(self->traceback_segment_buffer);
     return 0;
 }
 
@@ -171,45 +234,44 @@ ancestor_matcher_delete_likelihood(ancestor_matcher_t *self, const node_id_t nod
     return 0;
 }
 
-/* Store the recombination_required state in the traceback */
+/* Store the recombination_required state in the traceback. Lists are
+ * stored as deltas against the most recent literal list wherever the
+ * delta is smaller than half the list; otherwise a fresh literal list is
+ * stored and becomes the new base. */
 static int WARN_UNUSED
 ancestor_matcher_store_traceback(ancestor_matcher_t *self, const site_id_t site_id)
 {
     int ret = 0;
     node_id_t u;
-    int j;
+    int j, k, num_added, num_removed;
     int8_t *restrict list_R;
     node_id_t *restrict list_node;
-    node_state_list_t *restrict list;
+    node_id_t *restrict list_removed;
+    node_state_list_t *restrict prev;
     node_state_list_t *restrict T = self->traceback;
+    node_state_list_t *base = self->traceback_base;
     const node_id_t *restrict nodes = self->likelihood_nodes;
-    const int8_t *restrict R = self->recombination_required;
+    int8_t *restrict R = self->recombination_required;
+    const int8_t *restrict L = self->likelihood;
+    int8_t *restrict base_value = self->traceback_base_value;
     const int num_likelihood_nodes = self->num_likelihood_nodes;
     bool match;
 
-    /* Check to see if the previous site has the same recombination_required. If so,
-     * we can reuse the same list. */
-    match = false;
-    if (site_id > 0) {
-        list = &T[site_id - 1];
-        if (list->size == num_likelihood_nodes) {
-            list_node = list->node;
-            list_R = list->recombination_required;
-            match = true;
-            for (j = 0; j < num_likelihood_nodes; j++) {
-                if (list_node[j] != nodes[j] || list_R[j] != R[nodes[j]]) {
-                    match = false;
-                    break;
-                }
-            }
+    /* Size the delta against the current base: nodes whose value differs
+     * from (or is absent in) the base, and base nodes that have left the
+     * likelihood list. */
+    num_added = 0;
+    num_removed = 0;
+    if (base != NULL) {
+        for (j = 0; j < num_likelihood_nodes; j++) {
+            num_added += base_value[nodes[j]] != R[nodes[j]];
+        }
+        for (j = 0; j < base->size; j++) {
+            num_removed += L[base->node[j]] < 0;
         }
     }
-
-    if (match) {
-        T[site_id].size = T[site_id - 1].size;
-        T[site_id].node = T[site_id - 1].node;
-        T[site_id].recombination_required = T[site_id - 1].recombination_required;
-    } else {
+    if (base == NULL || 2 * (num_added + num_removed) >= num_likelihood_nodes) {
+        /* Store a literal list and make it the new base. */
         list_node = block_allocator_get(&self->traceback_allocator,
                 num_likelihood_nodes * sizeof(node_id_t));
         list_R = block_allocator_get(&self->traceback_allocator,
@@ -218,16 +280,239 @@ ancestor_matcher_store_traceback(ancestor_matcher_t *self, const site_id_t site_
             ret = TSI_ERR_NO_MEMORY;
             goto out;
         }
+        if (base != NULL) {
+            for (j = 0; j < base->size; j++) {
+                base_value[base->node[j]] = -1;
+            }
+        }
         T[site_id].node = list_node;
         T[site_id].recombination_required = list_R;
         T[site_id].size = num_likelihood_nodes;
+        T[site_id].base = NULL;
+        T[site_id].num_removed = 0;
+        T[site_id].removed = NULL;
         for (j = 0; j < num_likelihood_nodes; j++) {
             u = nodes[j];
             list_node[j] = u;
             list_R[j] = R[u];
+            base_value[u] = R[u];
+        }
+        self->traceback_base = &T[site_id];
+    } else {
+        /* Check to see if the previous site stores the same delta. If so,
+         * we can reuse the same lists. */
+        match = false;
+        prev = &T[site_id - 1];
+        if (prev->base == base && prev->size == num_added
+                && prev->num_removed == num_removed) {
+            match = true;
+            k = 0;
+            for (j = 0; j < num_likelihood_nodes && match; j++) {
+                u = nodes[j];
+                if (base_value[u] != R[u]) {
+                    match = prev->node[k] == u
+                            && prev->recombination_required[k] == R[u];
+                    k++;
+                }
+            }
+            k = 0;
+            for (j = 0; j < base->size && match; j++) {
+                u = base->node[j];
+                if (L[u] < 0) {
+                    match = prev->removed[k] == u;
+                    k++;
+                }
+            }
+        }
+        if (match) {
+            T[site_id] = *prev;
+        } else {
+            list_node = block_allocator_get(&self->traceback_allocator,
+                    (size_t) num_added * sizeof(node_id_t));
+            list_R = block_allocator_get(&self->traceback_allocator,
+                    (size_t) num_added * sizeof(int8_t));
+            list_removed = block_allocator_get(&self->traceback_allocator,
+                    (size_t) num_removed * sizeof(node_id_t));
+            if (list_node == NULL || list_R == NULL || list_removed == NULL) {
+                ret = TSI_ERR_NO_MEMORY;
+                goto out;
+            }
+            T[site_id].node = list_node;
+            T[site_id].recombination_required = list_R;
+            T[site_id].size = num_added;
+            T[site_id].base = base;
+            T[site_id].num_removed = num_removed;
+            T[site_id].removed = list_removed;
+            k = 0;
+            for (j = 0; j < num_likelihood_nodes; j++) {
+                u = nodes[j];
+                if (base_value[u] != R[u]) {
+                    list_node[k] = u;
+                    list_R[k] = R[u];
+                    k++;
+                }
+            }
+            k = 0;
+            for (j = 0; j < base->size; j++) {
+                u = base->node[j];
+                if (L[u] < 0) {
+                    list_removed[k] = u;
+                    k++;
+                }
+            }
         }
     }
     self->total_traceback_size += num_likelihood_nodes;
+    /* The per-node values have been captured in the stored list, so return
+     * the array to its null state. Keeping it clean between sites means it
+     * never needs an O(num_nodes) reset. */
+    for (j = 0; j < num_likelihood_nodes; j++) {
+        R[nodes[j]] = -1;
+    }
+out:
+    return ret;
+}
+
+/* Streams the traceback lists for the finished sites [lo, hi] to the
+ * spill file and resets the traceback allocator. Everything to the left
+ * of the current site is final in the forwards pass, so it can leave
+ * memory; run_traceback pages it back in strictly right-to-left.
+ * Dropping the delta base here means the next site stores a literal
+ * list, so bases never cross a segment boundary and each segment is
+ * self-contained. Lists are written in their delta form, padded so that
+ * every array in the segment stays 4-byte aligned. */
+static int WARN_UNUSED
+ancestor_matcher_spill_traceback(ancestor_matcher_t *self, const site_id_t hi)
+{
+    int ret = 0;
+    static const int8_t zeros[4] = {0, 0, 0, 0};
+    FILE *f;
+    node_state_list_t *list;
+    node_state_list_t *base = self->traceback_base;
+    traceback_segment_t *seg;
+    int32_t header[3];
+    size_t pad, num_bytes;
+    site_id_t lo, l;
+    int j;
+    void *p;
+
+    if (self->traceback_file == NULL) {
+        self->traceback_file = tmpfile();
+        if (self->traceback_file == NULL) {
+            ret = TSI_ERR_IO;
+            goto out;
+        }
+    }
+    f = self->traceback_file;
+    if (self->num_traceback_segments == self->max_traceback_segments) {
+        self->max_traceback_segments =
+            TSI_MAX(16, 2 * self->max_traceback_segments);
+        p = realloc(self->traceback_segments,
+                self->max_traceback_segments * sizeof(traceback_segment_t));
+        if (p == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        self->traceback_segments = p;
+    }
+    lo = self->num_traceback_segments == 0 ? self->last_match_start
+        : self->traceback_segments[self->num_traceback_segments - 1].hi + 1;
+    seg = self->traceback_segments + self->num_traceback_segments;
+    seg->lo = lo;
+    seg->hi = hi;
+    seg->offset = ftell(f);
+    num_bytes = 0;
+    for (l = lo; l <= hi; l++) {
+        list = &self->traceback[l];
+        pad = (4 - (size_t) list->size % 4) % 4;
+        header[0] = list->size;
+        header[1] = list->num_removed;
+        header[2] = list->base == NULL ? -1
+            : (int32_t) (list->base - self->traceback);
+        if (fwrite(header, sizeof(header), 1, f) != 1
+                || fwrite(list->node, sizeof(node_id_t),
+                        (size_t) list->size, f) != (size_t) list->size
+                || fwrite(list->recombination_required, 1,
+                        (size_t) list->size, f) != (size_t) list->size
+                || fwrite(zeros, 1, pad, f) != pad
+                || fwrite(list->removed, sizeof(node_id_t),
+                        (size_t) list->num_removed, f)
+                    != (size_t) list->num_removed) {
+            ret = TSI_ERR_IO;
+            goto out;
+        }
+        num_bytes += sizeof(header)
+            + (size_t) list->size * (sizeof(node_id_t) + 1) + pad
+            + (size_t) list->num_removed * sizeof(node_id_t);
+    }
+    seg->num_bytes = num_bytes;
+    self->num_traceback_segments++;
+    /* The spilled lists leave memory: clear the base values, drop the
+     * per-site entries and recycle the allocator's chunks. */
+    if (base != NULL) {
+        for (j = 0; j < base->size; j++) {
+            self->traceback_base_value[base->node[j]] = -1;
+        }
+        self->traceback_base = NULL;
+    }
+    memset(self->traceback + lo, 0,
+            (size_t) (hi - lo + 1) * sizeof(node_state_list_t));
+    ret = block_allocator_reset(&self->traceback_allocator);
+out:
+    return ret;
+}
+
+/* Pages the spill segment holding the given site back in, replacing the
+ * previously loaded one. The traceback consumes sites strictly
+ * right-to-left, so segments are reloaded newest-first and each is
+ * needed only once per match. */
+static int WARN_UNUSED
+ancestor_matcher_page_in_traceback(ancestor_matcher_t *self, const site_id_t site)
+{
+    int ret = 0;
+    traceback_segment_t *seg;
+    node_state_list_t *list;
+    int32_t *header;
+    char *p;
+    size_t pad;
+    site_id_t l;
+
+    assert(self->traceback_next_segment > 0);
+    self->traceback_next_segment--;
+    seg = self->traceback_segments + self->traceback_next_segment;
+    assert(seg->lo <= site && site <= seg->hi);
+    tsi_safe_free(self->traceback_segment_buffer);
+    self->traceback_segment_buffer = malloc(TSI_MAX(seg->num_bytes, 1));
+    if (self->traceback_segment_buffer == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    if (fseek(self->traceback_file, seg->offset, SEEK_SET) != 0
+            || fread(self->traceback_segment_buffer, 1, seg->num_bytes,
+                    self->traceback_file) != seg->num_bytes) {
+        ret = TSI_ERR_IO;
+        goto out;
+    }
+    /* Rebuild the per-site lists with pointers into the buffer. Delta
+     * bases always refer to an earlier site in the same segment, so they
+     * have already been rebuilt when a list refers to one. */
+    p = self->traceback_segment_buffer;
+    for (l = seg->lo; l <= seg->hi; l++) {
+        header = (int32_t *) (void *) p;
+        p += sizeof(header[0]) * 3;
+        list = &self->traceback[l];
+        list->size = header[0];
+        list->num_removed = header[1];
+        list->base = header[2] < 0 ? NULL : &self->traceback[header[2]];
+        list->node = (node_id_t *) (void *) p;
+        p += (size_t) list->size * sizeof(node_id_t);
+        list->recombination_required = (int8_t *) p;
+        pad = (4 - (size_t) list->size % 4) % 4;
+        p += (size_t) list->size + pad;
+        list->removed = (node_id_t *) (void *) p;
+        p += (size_t) list->num_removed * sizeof(node_id_t);
+    }
+    self->traceback_resident_lo = seg->lo;
 out:
     return ret;
 }
@@ -254,55 +539,185 @@ is_descendant(const node_id_t u, const node_id_t v, const node_id_t *restrict pa
     return ret;
 }
 
+/* Rebuild the preorder interval labels for the tree rooted at node 0.
+ * Only nodes reached by this traversal get the current stamp; nodes in
+ * detached subtrees keep a stale stamp and so fail every interval test,
+ * exactly as a parent-pointer climb from them would. */
+static void
+ancestor_matcher_build_preorder(ancestor_matcher_t *self)
+{
+    node_id_t u, v;
+    int64_t depth;
+    node_id_t counter = 0;
+    node_id_t *restrict stack = self->preorder_stack;
+    node_id_t *restrict enter = self->preorder_enter;
+    node_id_t *restrict leave = self->preorder_leave;
+    uint32_t *restrict stamp = self->preorder_stamp;
+    const node_id_t *restrict right_child = self->right_child;
+    const node_id_t *restrict left_sib = self->left_sib;
+    uint32_t current_stamp = self->preorder_current_stamp + 1;
+
+    /* The stamps persist across matches, so handle the (rare) wraparound
+     * by re-establishing the all-invalid state. */
+    if (current_stamp == 0) {
+        memset(stamp, 0, self->num_nodes * sizeof(uint32_t));
+        current_stamp = 1;
+    }
+    self->stats.num_preorder_builds++;
+    self->preorder_current_stamp = current_stamp;
+    depth = 0;
+    stack[0] = 0;
+    while (depth >= 0) {
+        u = stack[depth];
+        depth--;
+        if (u >= 0) {
+            enter[u] = counter;
+            stamp[u] = current_stamp;
+            counter++;
+            /* Mark the subtree exit so we can assign leave on the way out. */
+            depth++;
+            stack[depth] = ~u;
+            for (v = right_child[u]; v != NULL_NODE; v = left_sib[v]) {
+                depth++;
+                stack[depth] = v;
+            }
+        } else {
+            leave[~u] = counter;
+        }
+    }
+    self->preorder_valid = true;
+}
+
+/* Returns true if u is a descendant of v in tree's current tree; i.e. if
+ * v is present on the path from u to root. Equivalent to chasing parent
+ * pointers from u, but constant time. */
+static inline bool
+ancestor_matcher_is_descendant(const ancestor_matcher_t *restrict tree,
+        const node_id_t u, const node_id_t v)
+{
+    const uint32_t stamp = tree->preorder_current_stamp;
+    bool ret = false;
+
+    if (v != NULL_NODE) {
+        if (u == v) {
+            ret = true;
+        } else if (tree->preorder_stamp[u] == stamp
+                && tree->preorder_stamp[v] == stamp) {
+            ret = tree->preorder_enter[v] <= tree->preorder_enter[u]
+                    && tree->preorder_enter[u] < tree->preorder_leave[v];
+        }
+    }
+    return ret;
+}
+
+#ifdef __GNUC__
+/* Vectorized transition kernel for sites without a mutation, where the
+ * update is independent of the tree topology. The likelihoods for the
+ * node list are gathered into a contiguous buffer, the
+ * MISMATCH -> RECOMB transition, recombination flags and max-reduction
+ * are applied with byte vectors, and after renormalizing against the
+ * maximum the results are scattered back. The scalar loop in
+ * update_site_likelihood_values remains the general path. */
+static void
+ancestor_matcher_update_site_likelihood_values_vector(ancestor_matcher_t *self,
+        const site_id_t site, int8_t *restrict L)
+{
+    const int num_likelihood_nodes = self->num_likelihood_nodes;
+    const node_id_t *restrict L_nodes = self->likelihood_nodes;
+    int8_t *restrict recombination_required = self->recombination_required;
+    int8_t *restrict values = self->likelihood_gather;
+    int8_t *restrict recomb = self->recomb_gather;
+    const tsi_int8x16 mismatch_v = TSI_SPLAT16(MISMATCH_LIKELIHOOD);
+    const tsi_int8x16 recomb_v = TSI_SPLAT16(RECOMB_LIKELIHOOD);
+    const tsi_int8x16 match_v = TSI_SPLAT16(MATCH_LIKELIHOOD);
+    const tsi_int8x16 one_v = TSI_SPLAT16(1);
+    tsi_int8x16 v, mask, max_splat, max_v = TSI_SPLAT16(-1);
+    int j, n;
+    node_id_t u;
+    int8_t max_L;
+
+    for (j = 0; j < num_likelihood_nodes; j++) {
+        values[j] = L[L_nodes[j]];
+    }
+    /* Pad the tail with NULL_LIKELIHOOD, which is inert: it can't win the
+     * max, never equals MISMATCH and is left alone by renormalization. */
+    n = (num_likelihood_nodes + TSI_VECTOR_WIDTH - 1)
+        & ~(TSI_VECTOR_WIDTH - 1);
+    for (j = num_likelihood_nodes; j < n; j++) {
+        values[j] = NULL_LIKELIHOOD;
+    }
+    for (j = 0; j < n; j += TSI_VECTOR_WIDTH) {
+        memcpy(&v, values + j, sizeof(v));
+        mask = v == mismatch_v;
+        v = (mask & recomb_v) | (~mask & v);
+        mask = mask & one_v;
+        memcpy(recomb + j, &mask, sizeof(mask));
+        memcpy(values + j, &v, sizeof(v));
+        mask = v > max_v;
+        max_v = (mask & v) | (~mask & max_v);
+    }
+    max_L = max_v[0];
+    for (j = 1; j < TSI_VECTOR_WIDTH; j++) {
+        max_L = TSI_MAX(max_L, max_v[j]);
+    }
+    assert(max_L >= 0);
+    /* The scalar loop reports the first node attaining the maximum. */
+    for (j = 0; values[j] != max_L; j++)
+        ;
+    self->max_likelihood_node[site] = L_nodes[j];
+
+    /* Renormalise against the maximum and scatter back. */
+    memset(&max_splat, max_L, sizeof(max_splat));
+    for (j = 0; j < n; j += TSI_VECTOR_WIDTH) {
+        memcpy(&v, values + j, sizeof(v));
+        mask = v == max_splat;
+        v = (mask & match_v) | (~mask & v);
+        memcpy(values + j, &v, sizeof(v));
+    }
+    for (j = 0; j < num_likelihood_nodes; j++) {
+        u = L_nodes[j];
+        recombination_required[u] = recomb[j];
+        L[u] = values[j];
+    }
+}
+#endif
+
 static int WARN_UNUSED
 ancestor_matcher_update_site_likelihood_values(ancestor_matcher_t *self,
-        const site_id_t site, const node_id_t mutation_node, const char state,
-        const node_id_t *restrict parent, int8_t *restrict L)
+        ancestor_matcher_t *tree, const site_id_t site,
+        const node_id_t mutation_node, const char state, int8_t *restrict L)
 {
     int ret = 0;
     const int num_likelihood_nodes = self->num_likelihood_nodes;
     const node_id_t *restrict L_nodes = self->likelihood_nodes;
-    int8_t *restrict path_cache = self->path_cache;
     int8_t *restrict recombination_required = self->recombination_required;
     int j, descendant;
-    node_id_t u, v, max_L_node;
+    node_id_t u, max_L_node;
     int8_t max_L;
 
+    self->stats.num_likelihood_nodes_updated += (size_t) num_likelihood_nodes;
+    assert(num_likelihood_nodes > 0);
+#ifdef __GNUC__
+    if (mutation_node == NULL_NODE) {
+        ancestor_matcher_update_site_likelihood_values_vector(self, site, L);
+        return ret;
+    }
+#endif
+    if (mutation_node != NULL_NODE) {
+        self->stats.num_descendant_tests += (size_t) num_likelihood_nodes;
+        if (!tree->preorder_valid) {
+            ancestor_matcher_build_preorder(tree);
+        }
+    }
     max_L = -1;
     max_L_node = NULL_NODE;
-    assert(num_likelihood_nodes > 0);
     /* printf("likelihoods for node=%d, n=%d\n", mutation_node, self->num_likelihood_nodes); */
     for (j = 0; j < num_likelihood_nodes; j++) {
         u = L_nodes[j];
-        /* Determine if the node this likelihood is associated with is a descendant
-         * of the mutation node. To avoid the cost of repeatedly traversing up the
-         * tree, we keep a cache of the paths that we have already traversed. When
-         * we meet one of these paths we can immediately finish.
-         */
         descendant = 0;
         if (mutation_node != NULL_NODE) {
-            v = u;
-            while (likely(v != NULL_NODE)
-                    && likely(v != mutation_node)
-                    && likely(path_cache[v] == CACHE_UNSET)) {
-                v = parent[v];
-            }
-            if (likely(v != NULL_NODE) && likely(path_cache[v] != CACHE_UNSET)) {
-                descendant = path_cache[v];
-            } else {
-                descendant = v == mutation_node;
-            }
-            /* Insert this path into the cache */
-            v = u;
-            while (likely(v != NULL_NODE)
-                    && likely(v != mutation_node)
-                    && likely(path_cache[v] == CACHE_UNSET)) {
-                path_cache[v] = descendant;
-                v = parent[v];
-            }
+            descendant = ancestor_matcher_is_descendant(tree, u, mutation_node);
         }
-
-        /* assert(descendant == is_descendant(u, mutation_node, parent)); */
         recombination_required[u] = false;
         if (L[u] == MISMATCH_LIKELIHOOD) {
             recombination_required[u] = true;
@@ -321,17 +736,12 @@ ancestor_matcher_update_site_likelihood_values(ancestor_matcher_t *self,
     assert(max_L_node != NULL_NODE);
     self->max_likelihood_node[site] = max_L_node;
 
-    /* Reset the path cache and renormalise the likelihoods. */
+    /* Renormalise the likelihoods. */
     for (j = 0; j < num_likelihood_nodes; j++) {
         u = L_nodes[j];
         if (L[u] == max_L) {
             L[u] = MATCH_LIKELIHOOD;
         }
-        v = u;
-        while (likely(v != NULL_NODE) && likely(path_cache[v] != CACHE_UNSET)) {
-            path_cache[v] = CACHE_UNSET;
-            v = parent[v];
-        }
     }
     return ret;
 }
@@ -364,6 +774,9 @@ ancestor_matcher_coalesce_likelihoods(ancestor_matcher_t *self,
             L_p = L_cache[v];
             if (unlikely(L_p == CACHE_UNSET)) {
                 L_p = L[v];
+                self->stats.num_likelihood_cache_misses++;
+            } else {
+                self->stats.num_likelihood_cache_hits++;
             }
             /* Fill in the L cache */
             v = p;
@@ -398,18 +811,20 @@ ancestor_matcher_coalesce_likelihoods(ancestor_matcher_t *self,
 }
 
 static int
-ancestor_matcher_update_site_state(ancestor_matcher_t *self, const site_id_t site,
-        const allele_t state, node_id_t *restrict parent, int8_t *restrict L,
-        int8_t *restrict L_cache)
+ancestor_matcher_update_site_state(ancestor_matcher_t *self, ancestor_matcher_t *tree,
+        const site_id_t site, const allele_t state, node_id_t *restrict parent,
+        int8_t *restrict L, int8_t *restrict L_cache)
 {
     int ret = 0;
     node_id_t mutation_node = NULL_NODE;
     node_id_t u;
+    const size_t *restrict mutation_offset = self->tree_sequence_builder->mutation_offset;
 
     assert(self->num_likelihood_nodes > 0);
 
-    if (self->tree_sequence_builder->sites.mutations[site] != NULL) {
-        mutation_node = self->tree_sequence_builder->sites.mutations[site]->node;
+    if (mutation_offset[site] != mutation_offset[site + 1]) {
+        mutation_node =
+            self->tree_sequence_builder->flat_mutation_node[mutation_offset[site]];
     }
     if (self->flags & TSI_EXTENDED_CHECKS) {
         ancestor_matcher_check_state(self);
@@ -427,8 +842,8 @@ ancestor_matcher_update_site_state(ancestor_matcher_t *self, const site_id_t sit
             self->num_likelihood_nodes++;
         }
     }
-    ret = ancestor_matcher_update_site_likelihood_values(self, site,
-            mutation_node, state, parent, L);
+    ret = ancestor_matcher_update_site_likelihood_values(self, tree, site,
+            mutation_node, state, L);
     if (ret != 0) {
         goto out;
     }
@@ -436,6 +851,14 @@ ancestor_matcher_update_site_state(ancestor_matcher_t *self, const site_id_t sit
     if (ret != 0) {
         goto out;
     }
+    if (unlikely(self->traceback_budget > 0
+            && self->traceback_allocator.total_allocated
+                > self->traceback_budget)) {
+        ret = ancestor_matcher_spill_traceback(self, site);
+        if (ret != 0) {
+            goto out;
+        }
+    }
     ret = ancestor_matcher_coalesce_likelihoods(self, parent, L, L_cache);
     if (ret != 0) {
         goto out;
@@ -452,49 +875,123 @@ ancestor_matcher_reset_tree(ancestor_matcher_t *self)
     memset(self->right_child, 0xff, self->num_nodes * sizeof(node_id_t));
     memset(self->left_sib, 0xff, self->num_nodes * sizeof(node_id_t));
     memset(self->right_sib, 0xff, self->num_nodes * sizeof(node_id_t));
-    memset(self->recombination_required, 0xff, self->num_nodes * sizeof(int8_t));
 }
 
 static int WARN_UNUSED
-ancestor_matcher_expand_nodes(ancestor_matcher_t *self)
+ancestor_matcher_expand_nodes(ancestor_matcher_t *self, size_t max_nodes)
 {
-    int ret = TSI_ERR_NO_MEMORY;
-
-    tsi_safe_free(self->parent);
-    tsi_safe_free(self->left_child);
-    tsi_safe_free(self->right_child);
-    tsi_safe_free(self->left_sib);
-    tsi_safe_free(self->right_sib);
-    tsi_safe_free(self->recombination_required);
-    tsi_safe_free(self->likelihood);
-    tsi_safe_free(self->likelihood_cache);
-    tsi_safe_free(self->likelihood_nodes);
-    tsi_safe_free(self->likelihood_nodes_tmp);
-    tsi_safe_free(self->path_cache);
-
-    assert(self->max_nodes > 0);
-    self->parent = malloc(self->max_nodes * sizeof(node_id_t));
-    self->left_child = malloc(self->max_nodes * sizeof(node_id_t));
-    self->right_child = malloc(self->max_nodes * sizeof(node_id_t));
-    self->left_sib = malloc(self->max_nodes * sizeof(node_id_t));
-    self->right_sib = malloc(self->max_nodes * sizeof(node_id_t));
-    self->recombination_required = malloc(self->max_nodes * sizeof(int8_t));
-    self->likelihood = malloc(self->max_nodes * sizeof(int8_t));
-    self->likelihood_cache = malloc(self->max_nodes * sizeof(int8_t));
-    self->likelihood_nodes = malloc(self->max_nodes * sizeof(node_id_t));
-    self->likelihood_nodes_tmp = malloc(self->max_nodes * sizeof(node_id_t));
-    self->path_cache = malloc(self->max_nodes * sizeof(int8_t));
-
-    if (self->parent == NULL
-            || self->left_child == NULL || self->right_child == NULL
-            || self->left_sib == NULL || self->right_sib == NULL
-            || self->recombination_required == NULL
-            || self->likelihood == NULL || self->likelihood_cache == NULL
-            || self->likelihood_nodes == NULL
-            || self->likelihood_nodes_tmp == NULL || self->path_cache == NULL) {
+    int ret = 0;
+    void *tmp;
+    size_t j;
+    const size_t old_max = self->max_nodes;
+    node_id_t *tree_mem;
+
+    assert(max_nodes > old_max);
+    /* The five tree arrays are kept in one contiguous block. After growing
+     * it, shift the old arrays up to their new offsets (from the back, so
+     * that the overlapping moves are safe) and establish the null state
+     * over the new capacity; from here on the entries are restored
+     * incrementally after each match. */
+    tmp = realloc(self->tree_arrays, 5 * max_nodes * sizeof(node_id_t));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    tree_mem = tmp;
+    for (j = 5; j > 0; j--) {
+        memmove(tree_mem + (j - 1) * max_nodes, tree_mem + (j - 1) * old_max,
+                old_max * sizeof(node_id_t));
+        memset(tree_mem + (j - 1) * max_nodes + old_max, 0xff,
+                (max_nodes - old_max) * sizeof(node_id_t));
+    }
+    self->tree_arrays = tree_mem;
+    self->parent = tree_mem;
+    self->left_child = tree_mem + max_nodes;
+    self->right_child = tree_mem + 2 * max_nodes;
+    self->left_sib = tree_mem + 3 * max_nodes;
+    self->right_sib = tree_mem + 4 * max_nodes;
+
+    tmp = realloc(self->recombination_required, max_nodes * sizeof(int8_t));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->recombination_required = tmp;
+    memset(self->recombination_required + old_max, 0xff,
+            (max_nodes - old_max) * sizeof(int8_t));
+    tmp = realloc(self->likelihood, max_nodes * sizeof(int8_t));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->likelihood = tmp;
+    tmp = realloc(self->likelihood_cache, max_nodes * sizeof(int8_t));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
         goto out;
     }
-    ret = 0;
+    self->likelihood_cache = tmp;
+    /* Over-allocated so whole-vector loads at the tail stay in bounds. */
+    tmp = realloc(self->likelihood_gather, (max_nodes + 16) * sizeof(int8_t));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->likelihood_gather = tmp;
+    tmp = realloc(self->recomb_gather, (max_nodes + 16) * sizeof(int8_t));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->recomb_gather = tmp;
+    tmp = realloc(self->likelihood_nodes, max_nodes * sizeof(node_id_t));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->likelihood_nodes = tmp;
+    tmp = realloc(self->likelihood_nodes_tmp, max_nodes * sizeof(node_id_t));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->likelihood_nodes_tmp = tmp;
+    tmp = realloc(self->preorder_enter, max_nodes * sizeof(node_id_t));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->preorder_enter = tmp;
+    tmp = realloc(self->preorder_leave, max_nodes * sizeof(node_id_t));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->preorder_leave = tmp;
+    tmp = realloc(self->preorder_stamp, max_nodes * sizeof(uint32_t));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->preorder_stamp = tmp;
+    /* A zero stamp is never current, so the new labels are invalid. */
+    memset(self->preorder_stamp + old_max, 0,
+            (max_nodes - old_max) * sizeof(uint32_t));
+    tmp = realloc(self->preorder_stack, 2 * max_nodes * sizeof(node_id_t));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->preorder_stack = tmp;
+    tmp = realloc(self->traceback_base_value, max_nodes * sizeof(int8_t));
+    if (tmp == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->traceback_base_value = tmp;
+    memset(self->traceback_base_value + old_max, 0xff,
+            (max_nodes - old_max) * sizeof(int8_t));
+    self->max_nodes = max_nodes;
 out:
     return ret;
 }
@@ -503,11 +1000,19 @@ static int
 ancestor_matcher_reset(ancestor_matcher_t *self)
 {
     int ret = 0;
+    size_t j;
+    node_id_t u;
+    const node_state_list_t *base;
 
-    /* TODO realloc when this grows */
-    if (self->max_nodes != self->tree_sequence_builder->max_nodes) {
-        self->max_nodes = self->tree_sequence_builder->max_nodes;
-        ret = ancestor_matcher_expand_nodes(self);
+    /* Make sure the flat edge index arrays are up to date. */
+    ret = tree_sequence_builder_freeze_indexes(self->tree_sequence_builder);
+    if (ret != 0) {
+        goto out;
+    }
+    if (self->max_nodes < self->tree_sequence_builder->max_nodes) {
+        ret = ancestor_matcher_expand_nodes(self,
+                TSI_MAX(2 * self->max_nodes,
+                    self->tree_sequence_builder->max_nodes));
         if (ret != 0) {
             goto out;
         }
@@ -515,16 +1020,72 @@ ancestor_matcher_reset(ancestor_matcher_t *self)
     self->num_nodes = self->tree_sequence_builder->num_nodes;
     assert(self->num_nodes <= self->max_nodes);
 
-    memset(self->traceback, 0, self->num_sites * sizeof(node_state_list_t));
-    memset(self->max_likelihood_node, 0xff, self->num_sites * sizeof(node_id_t));
-    memset(self->path_cache, 0xff, self->num_nodes * sizeof(int8_t));
+    /* Each match touches a bounded set of state: only the per-site state
+     * in the previous match's interval, the nodes recorded in the dirty
+     * list, and the traceback base values need to be restored here. Note
+     * that the base points into the traceback array, so its entries must
+     * be cleared before the per-site lists are. */
+    base = self->traceback_base;
+    if (base != NULL) {
+        for (j = 0; j < (size_t) base->size; j++) {
+            self->traceback_base_value[base->node[j]] = -1;
+        }
+        self->traceback_base = NULL;
+    }
+    memset(self->traceback + self->last_match_start, 0,
+            (size_t) (self->last_match_end - self->last_match_start)
+                * sizeof(node_state_list_t));
+    memset(self->max_likelihood_node + self->last_match_start, 0xff,
+            (size_t) (self->last_match_end - self->last_match_start)
+                * sizeof(node_id_t));
+    self->last_match_start = 0;
+    self->last_match_end = 0;
+    self->preorder_valid = false;
     ret = block_allocator_reset(&self->traceback_allocator);
     if (ret != 0) {
         goto out;
     }
+    /* The spill file is recycled between matches; its segments only have
+     * meaning within the match that wrote them. */
+    self->num_traceback_segments = 0;
+    if (self->traceback_file != NULL) {
+        rewind(self->traceback_file);
+    }
+    tsi_safe_free(self->traceback_segment_buffer);
+    self->traceback_segment_buffer = NULL;
+    if (self->tree_fully_dirty) {
+        /* The tree was loaded from a checkpoint (or the last match
+         * failed), so the dirty set is unknown. */
+        ancestor_matcher_reset_tree(self);
+        memset(self->recombination_required, 0xff,
+                self->num_nodes * sizeof(int8_t));
+        self->tree_fully_dirty = false;
+    } else {
+        for (j = 0; j < self->num_dirty_nodes; j++) {
+            u = self->dirty_nodes[j];
+            self->parent[u] = NULL_NODE;
+            self->left_child[u] = NULL_NODE;
+            self->right_child[u] = NULL_NODE;
+            self->left_sib[u] = NULL_NODE;
+            self->right_sib[u] = NULL_NODE;
+        }
+    }
+    self->num_dirty_nodes = 0;
+    /* The dirty list holds both endpoints of every edge inserted during
+     * the forwards pass and the children assigned during the traceback. */
+    if (self->max_dirty_nodes
+            < 3 * self->tree_sequence_builder->num_index_edges + 2) {
+        tsi_safe_free(self->dirty_nodes);
+        self->max_dirty_nodes =
+            3 * self->tree_sequence_builder->num_index_edges + 2;
+        self->dirty_nodes = malloc(self->max_dirty_nodes * sizeof(node_id_t));
+        if (self->dirty_nodes == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+    }
     self->total_traceback_size = 0;
     self->num_likelihood_nodes = 0;
-    ancestor_matcher_reset_tree(self);
 out:
     return ret;
 }
@@ -536,16 +1097,25 @@ ancestor_matcher_set_recombination_required(ancestor_matcher_t *self, site_id_t
         int8_t *restrict recombination_required)
 {
     int j;
-    const int8_t *restrict R = self->traceback[site].recombination_required;
-    const node_id_t *restrict node = self->traceback[site].node;
-    const int size = self->traceback[site].size;
+    const node_state_list_t *restrict list = &self->traceback[site];
+    const node_state_list_t *restrict base = list->base;
 
     /* We always set recombination_required for node 0 to false for the cases
      * where no recombination is needed at a particular site (which are
      * encoded by a traceback of size 0) */
     recombination_required[0] = 0;
-    for (j = 0; j < size; j++) {
-        recombination_required[node[j]] = R[j];
+    /* Decode the delta: apply the base list, clear the removed nodes and
+     * then apply this site's entries on top. */
+    if (base != NULL) {
+        for (j = 0; j < base->size; j++) {
+            recombination_required[base->node[j]] = base->recombination_required[j];
+        }
+        for (j = 0; j < list->num_removed; j++) {
+            recombination_required[list->removed[j]] = -1;
+        }
+    }
+    for (j = 0; j < list->size; j++) {
+        recombination_required[list->node[j]] = list->recombination_required[j];
     }
 }
 
@@ -556,52 +1126,56 @@ ancestor_matcher_unset_recombination_required(ancestor_matcher_t *self, site_id_
         int8_t *restrict recombination_required)
 {
     int j;
-    const node_id_t *restrict node = self->traceback[site].node;
-    const int size = self->traceback[site].size;
-
-    for (j = 0; j < size; j++) {
-        recombination_required[node[j]] = -1;
+    const node_state_list_t *restrict list = &self->traceback[site];
+    const node_state_list_t *restrict base = list->base;
+
+    /* The removed nodes were set back to -1 during decode, so clearing
+     * the base and this site's entries restores the whole array. */
+    if (base != NULL) {
+        for (j = 0; j < base->size; j++) {
+            recombination_required[base->node[j]] = -1;
+        }
+    }
+    for (j = 0; j < list->size; j++) {
+        recombination_required[list->node[j]] = -1;
     }
     recombination_required[0] = -1;
 }
 
-static inline edge_t
-get_edge(const avl_node_t *restrict avl_node)
-{
-    return *((edge_t *) avl_node->item);
-}
-
-static inline site_id_t
-edge_left(const avl_node_t *restrict avl_node)
-{
-    return ((edge_t *) avl_node->item)->left;
-}
-
-static inline site_id_t
-edge_right(const avl_node_t *restrict avl_node)
-{
-    return ((edge_t *) avl_node->item)->right;
-}
-
-
 static int WARN_UNUSED
 ancestor_matcher_run_traceback(ancestor_matcher_t *self, site_id_t start,
         site_id_t end, allele_t *haplotype, allele_t *match)
 {
     int ret = 0;
     site_id_t l;
-    edge_t edge;
+    indexed_edge_t edge;
     node_id_t *restrict parent = self->parent;
     int8_t *restrict recombination_required = self->recombination_required;
+    node_id_t *restrict dirty_nodes = self->dirty_nodes;
+    size_t num_dirty;
     node_id_t u, max_likelihood_node;
     site_id_t left, right, pos;
-    mutation_list_node_t *mut_list;
-    avl_node_t *restrict in = self->tree_sequence_builder->right_index.tail;
-    avl_node_t *restrict out = self->tree_sequence_builder->left_index.tail;
+    const size_t *restrict mutation_offset = self->tree_sequence_builder->mutation_offset;
+    const node_id_t *restrict mutation_node = self->tree_sequence_builder->flat_mutation_node;
+    /* The traceback sweeps the flat edge indexes in reverse: insertions come
+     * from the right index and removals from the left index. */
+    const indexed_edge_t *restrict in_edges = self->tree_sequence_builder->right_index_edges;
+    const indexed_edge_t *restrict out_edges = self->tree_sequence_builder->left_index_edges;
+    int64_t in_index = (int64_t) self->tree_sequence_builder->num_index_edges - 1;
+    int64_t out_index = (int64_t) self->tree_sequence_builder->num_index_edges - 1;
 
     /* printf("START TRACEBACK\n"); */
     /* ancestor_matcher_print_state(self, stdout); */
 
+    /* Any spilled traceback segments are paged back in newest-first; the
+     * site loop below consumes sites strictly right-to-left. */
+    self->traceback_next_segment = (int64_t) self->num_traceback_segments;
+    self->traceback_resident_lo = start;
+    if (self->num_traceback_segments > 0) {
+        self->traceback_resident_lo =
+            self->traceback_segments[self->num_traceback_segments - 1].hi + 1;
+    }
+
     /* Prepare for the traceback and get the memory ready for recording
      * the output edges. */
     self->output.size = 0;
@@ -613,30 +1187,42 @@ ancestor_matcher_run_traceback(ancestor_matcher_t *self, site_id_t start,
     self->output.parent[self->output.size] = max_likelihood_node;
     assert(self->output.parent[self->output.size] != NULL_NODE);
 
-    /* Now go through the trees in reverse and run the traceback */
-    memset(match, 0, self->num_sites * sizeof(allele_t));
+    /* Now go through the trees in reverse and run the traceback. Every site
+     * in [start, end) is assigned in the loop below, so only the flanks of
+     * the match need to be filled in here. The parent array is returned to
+     * the null state by clearing the nodes that the forwards pass touched;
+     * the recombination_required array is already null because the
+     * set/unset calls below and the traceback store are paired. */
     memset(match, 0xff, start * sizeof(allele_t));
     memset(match + end , 0xff, (self->num_sites - end) * sizeof(allele_t));
-    memset(parent, 0xff, self->num_nodes * sizeof(node_id_t));
-    memset(recombination_required, 0xff, self->num_nodes * sizeof(int8_t));
+    if (self->tree_fully_dirty) {
+        memset(parent, 0xff, self->num_nodes * sizeof(node_id_t));
+    } else {
+        for (num_dirty = 0; num_dirty < self->num_dirty_nodes; num_dirty++) {
+            parent[dirty_nodes[num_dirty]] = NULL_NODE;
+        }
+    }
+    num_dirty = self->num_dirty_nodes;
     pos = self->num_sites;
 
     while (pos > start) {
-        while (out != NULL && (edge = get_edge(out)).left == pos) {
-            out = out->prev;
+        while (out_index >= 0 && (edge = out_edges[out_index]).left == pos) {
+            out_index--;
             parent[edge.child] = NULL_NODE;
         }
-        while (in != NULL && (edge = get_edge(in)).right == pos) {
-            in = in->prev;
+        while (in_index >= 0 && (edge = in_edges[in_index]).right == pos) {
+            in_index--;
             parent[edge.child] = edge.parent;
+            dirty_nodes[num_dirty] = edge.child;
+            num_dirty++;
         }
         right = pos;
         left = 0;
-        if (out != NULL) {
-            left = TSI_MAX(left, edge_left(out));
+        if (out_index >= 0) {
+            left = TSI_MAX(left, out_edges[out_index].left);
         }
-        if (in != NULL) {
-            left = TSI_MAX(left, edge_right(in));
+        if (in_index >= 0) {
+            left = TSI_MAX(left, in_edges[in_index].right);
         }
         pos = left;
 
@@ -644,15 +1230,20 @@ ancestor_matcher_run_traceback(ancestor_matcher_t *self, site_id_t start,
 
         for (l = TSI_MIN(right, end) - 1; l >= (int) TSI_MAX(left, start); l--) {
 
+            if (unlikely(l < self->traceback_resident_lo)) {
+                ret = ancestor_matcher_page_in_traceback(self, l);
+                if (ret != 0) {
+                    return ret;
+                }
+            }
             match[l] = 0;
             u = self->output.parent[self->output.size];
             /* printf("TB Site = %d u = %d\n", l, u); */
             /* Set the state of the matched haplotype */
-            mut_list = self->tree_sequence_builder->sites.mutations[l];
-            if (mut_list != NULL) {
-                if (is_descendant(u, mut_list->node, parent)) {
-                    match[l] = 1;
-                }
+            if (mutation_offset[l] != mutation_offset[l + 1]
+                    && is_descendant(u, mutation_node[mutation_offset[l]],
+                            parent)) {
+                match[l] = 1;
             }
             /* Mark the traceback nodes on the tree */
             ancestor_matcher_set_recombination_required(self, l, recombination_required);
@@ -686,11 +1277,12 @@ ancestor_matcher_run_traceback(ancestor_matcher_t *self, site_id_t start,
     self->output.left[self->output.size] = start;
     self->output.size++;
     assert(self->output.right[self->output.size - 1] != start);
+    self->num_dirty_nodes = num_dirty;
     return ret;
 }
 
 static inline void
-remove_edge(edge_t edge, node_id_t *restrict parent, node_id_t *restrict left_child,
+remove_edge(indexed_edge_t edge, node_id_t *restrict parent, node_id_t *restrict left_child,
         node_id_t *restrict right_child, node_id_t *restrict left_sib,
         node_id_t *restrict right_sib)
 {
@@ -716,7 +1308,7 @@ remove_edge(edge_t edge, node_id_t *restrict parent, node_id_t *restrict left_ch
 }
 
 static inline void
-insert_edge(edge_t edge, node_id_t *restrict parent, node_id_t *restrict left_child,
+insert_edge(indexed_edge_t edge, node_id_t *restrict parent, node_id_t *restrict left_child,
         node_id_t *restrict right_child, node_id_t *restrict left_sib,
         node_id_t *restrict right_sib)
 {
@@ -744,7 +1336,7 @@ ancestor_matcher_run_forwards_match(ancestor_matcher_t *self, site_id_t start,
 {
     int ret = 0;
     site_id_t site;
-    edge_t edge;
+    indexed_edge_t edge;
     node_id_t u, root, last_root;
     int8_t L_child = 0;
     /* Use the restrict keyword here to try to improve performance by avoiding
@@ -758,38 +1350,72 @@ ancestor_matcher_run_forwards_match(ancestor_matcher_t *self, site_id_t start,
     node_id_t *restrict right_child = self->right_child;
     node_id_t *restrict left_sib = self->left_sib;
     node_id_t *restrict right_sib = self->right_sib;
+    node_id_t *restrict dirty_nodes = self->dirty_nodes;
+    size_t num_dirty = self->num_dirty_nodes;
     site_id_t pos, left, right;
-    avl_node_t *avl_node, *remove_start;
-    avl_node_t *restrict in = self->tree_sequence_builder->left_index.head;
-    avl_node_t *restrict out = self->tree_sequence_builder->right_index.head;
+    size_t in_index = 0;
+    size_t out_index = 0;
+    size_t remove_start, k, cp_nodes;
+    const tree_checkpoint_t *cp;
+    const indexed_edge_t *restrict in_edges = self->tree_sequence_builder->left_index_edges;
+    const indexed_edge_t *restrict out_edges = self->tree_sequence_builder->right_index_edges;
+    const size_t num_edges = self->tree_sequence_builder->num_index_edges;
 
     /* Load the tree for start */
     left = 0;
     pos = 0;
     right = self->num_sites;
-    if (in != NULL && start < edge_left(in)) {
-        right = edge_left(in);
+    if (in_index < num_edges && start < in_edges[in_index].left) {
+        right = in_edges[in_index].left;
     }
-    /* TODO there's probably quite a big gain to made here by seeking
-     * directly to the tree that we're interested in. */
-    while (in != NULL && out != NULL && edge_left(in) <= start) {
-        while (out != NULL && (edge = get_edge(out)).right == pos) {
+    /* Seek to the last tree checkpoint that the sweep from site 0 is
+     * guaranteed to pass through on its way to start, and replay only the
+     * remaining edge events from there. The loop condition below is
+     * monotone along the sweep, so any checkpoint satisfying it lies on
+     * the path the full sweep would have taken. */
+    for (k = self->tree_sequence_builder->num_checkpoints; k > 0; k--) {
+        cp = &self->tree_sequence_builder->checkpoints[k - 1];
+        if (cp->in_index < num_edges && cp->out_index < num_edges
+                && in_edges[cp->in_index].left <= start) {
+            in_index = cp->in_index;
+            out_index = cp->out_index;
+            left = cp->left;
+            pos = cp->position;
+            right = pos;
+            cp_nodes = self->tree_sequence_builder->num_checkpoint_nodes;
+            memcpy(parent, cp->parent, cp_nodes * sizeof(node_id_t));
+            memcpy(left_child, cp->left_child, cp_nodes * sizeof(node_id_t));
+            memcpy(right_child, cp->right_child, cp_nodes * sizeof(node_id_t));
+            memcpy(left_sib, cp->left_sib, cp_nodes * sizeof(node_id_t));
+            memcpy(right_sib, cp->right_sib, cp_nodes * sizeof(node_id_t));
+            /* The dirty set for a checkpointed tree is unknown, so fall
+             * back to a full reset after this match. */
+            self->tree_fully_dirty = true;
+            break;
+        }
+    }
+    while (in_index < num_edges && out_index < num_edges
+            && in_edges[in_index].left <= start) {
+        while (out_index < num_edges && (edge = out_edges[out_index]).right == pos) {
             remove_edge(edge, parent, left_child, right_child,
                     left_sib, right_sib);
-            out = out->next;
+            out_index++;
         }
-        while (in != NULL && (edge = get_edge(in)).left == pos) {
+        while (in_index < num_edges && (edge = in_edges[in_index]).left == pos) {
             insert_edge(edge, parent, left_child, right_child,
                     left_sib, right_sib);
-            in = in->next;
+            dirty_nodes[num_dirty] = edge.parent;
+            dirty_nodes[num_dirty + 1] = edge.child;
+            num_dirty += 2;
+            in_index++;
         }
         left = pos;
         right = self->num_sites;
-        if (in != NULL) {
-            right = TSI_MIN(right, edge_left(in));
+        if (in_index < num_edges) {
+            right = TSI_MIN(right, in_edges[in_index].left);
         }
-        if (out != NULL) {
-            right = TSI_MIN(right, edge_right(out));
+        if (out_index < num_edges) {
+            right = TSI_MIN(right, out_edges[out_index].right);
         }
         pos = right;
     }
@@ -822,15 +1448,16 @@ ancestor_matcher_run_forwards_match(ancestor_matcher_t *self, site_id_t start,
     self->likelihood_nodes[0] = last_root;
     self->num_likelihood_nodes = 1;
 
-    remove_start = out;
+    remove_start = out_index;
     while (left < end) {
         assert(left < right);
+        self->stats.num_tree_transitions++;
         /* printf("NEW TREE %d-%d\n", left, right); */
 
         /* Remove the likelihoods for any nonzero roots that have just left
          * the tree */
-        for (avl_node = remove_start; avl_node != out; avl_node = avl_node->next) {
-            edge = get_edge(avl_node);
+        for (k = remove_start; k < out_index; k++) {
+            edge = out_edges[k];
             if (unlikely(is_nonzero_root(edge.child, parent, left_child))) {
                 if (L[edge.child] >= 0 ) {
                     ancestor_matcher_delete_likelihood(self, edge.child, L);
@@ -866,7 +1493,7 @@ ancestor_matcher_run_forwards_match(ancestor_matcher_t *self, site_id_t start,
         /* ancestor_matcher_print_state(self, stdout); */
         /* ancestor_matcher_check_state(self); */
         for (site = TSI_MAX(left, start); site < TSI_MIN(right, end); site++) {
-            ret = ancestor_matcher_update_site_state(self, site, haplotype[site],
+            ret = ancestor_matcher_update_site_state(self, self, site, haplotype[site],
                     parent, L, L_cache);
             if (ret != 0) {
                 goto out;
@@ -875,10 +1502,10 @@ ancestor_matcher_run_forwards_match(ancestor_matcher_t *self, site_id_t start,
 
         /* Move on to the next tree */
         /* remove_start = k; */
-        remove_start = out;
-        while (out != NULL && (edge = get_edge(out)).right == right) {
+        remove_start = out_index;
+        while (out_index < num_edges && (edge = out_edges[out_index]).right == right) {
             remove_edge(edge, parent, left_child, right_child, left_sib, right_sib);
-            out = out->next;
+            out_index++;
             assert(L[edge.child] != NONZERO_ROOT_LIKELIHOOD);
             if (L[edge.child] == NULL_LIKELIHOOD) {
                 u = edge.parent;
@@ -907,8 +1534,8 @@ ancestor_matcher_run_forwards_match(ancestor_matcher_t *self, site_id_t start,
             }
         }
         /* reset the L cache */
-        for (avl_node = remove_start; avl_node != out; avl_node = avl_node->next) {
-            edge = get_edge(avl_node);
+        for (k = remove_start; k < out_index; k++) {
+            edge = out_edges[k];
             u = edge.parent;
             while (likely(L_cache[u] != CACHE_UNSET)) {
                 L_cache[u] = CACHE_UNSET;
@@ -919,9 +1546,12 @@ ancestor_matcher_run_forwards_match(ancestor_matcher_t *self, site_id_t start,
         left = right;
         /* printf("Inserting for j = %d and left = %d (%d)\n", (int) j, (int) left, */
         /*         edges[I[j]].left); */
-        while (in != NULL && (edge = get_edge(in)).left == left) {
-            in = in->next;
+        while (in_index < num_edges && (edge = in_edges[in_index]).left == left) {
+            in_index++;
             insert_edge(edge, parent, left_child, right_child, left_sib, right_sib);
+            dirty_nodes[num_dirty] = edge.parent;
+            dirty_nodes[num_dirty + 1] = edge.child;
+            num_dirty += 2;
             /* Insert zero likelihoods for any nonzero roots that have entered
              * the tree. Note we don't bother trying to compress the tree here
              * because this will be done for the next site anyway. */
@@ -936,15 +1566,350 @@ ancestor_matcher_run_forwards_match(ancestor_matcher_t *self, site_id_t start,
                 self->num_likelihood_nodes++;
             }
         }
+        /* The tree topology has changed, so the preorder labels must be
+         * rebuilt before the next descendant test. */
+        self->preorder_valid = false;
+        right = self->num_sites;
+        if (in_index < num_edges) {
+            right = TSI_MIN(right, in_edges[in_index].left);
+        }
+        if (out_index < num_edges) {
+            right = TSI_MIN(right, out_edges[out_index].right);
+        }
+    }
+out:
+    self->num_dirty_nodes = num_dirty;
+    return ret;
+}
+
+/* Runs the forwards matching algorithm for a batch of haplotypes over a
+ * single left-to-right sweep. The quintuply linked tree is maintained once,
+ * in matchers[0], and shared by all batch members; each member keeps its
+ * own likelihood state and traceback. This amortizes all of the edge
+ * insertion/removal and index-walking costs across the batch, which is
+ * the dominant cost when matching many haplotypes against a frozen tree
+ * sequence. The per-member operations are performed in the same order as
+ * in ancestor_matcher_run_forwards_match, so the output for each member
+ * is identical to a series of single matches. */
+static int WARN_UNUSED
+ancestor_matcher_run_forwards_match_batch(ancestor_matcher_t **matchers,
+        size_t num_matchers, site_id_t start, site_id_t end, allele_t **haplotypes)
+{
+    int ret = 0;
+    site_id_t site;
+    indexed_edge_t edge;
+    node_id_t u, root, last_root;
+    int8_t L_child = 0;
+    int8_t *L, *L_cache;
+    size_t m;
+    ancestor_matcher_t *self = matchers[0];
+    node_id_t *restrict parent = self->parent;
+    node_id_t *restrict left_child = self->left_child;
+    node_id_t *restrict right_child = self->right_child;
+    node_id_t *restrict left_sib = self->left_sib;
+    node_id_t *restrict right_sib = self->right_sib;
+    node_id_t *restrict dirty_nodes = self->dirty_nodes;
+    size_t num_dirty = self->num_dirty_nodes;
+    site_id_t pos, left, right;
+    size_t in_index = 0;
+    size_t out_index = 0;
+    size_t remove_start, k, cp_nodes;
+    const tree_checkpoint_t *cp;
+    const indexed_edge_t *restrict in_edges = self->tree_sequence_builder->left_index_edges;
+    const indexed_edge_t *restrict out_edges = self->tree_sequence_builder->right_index_edges;
+    const size_t num_edges = self->tree_sequence_builder->num_index_edges;
+
+    /* Load the tree for start. This is tree maintenance only, so it is
+     * done once for the whole batch. */
+    left = 0;
+    pos = 0;
+    right = self->num_sites;
+    if (in_index < num_edges && start < in_edges[in_index].left) {
+        right = in_edges[in_index].left;
+    }
+    /* Seek from the last checkpoint that the full sweep is guaranteed to
+     * pass through, as in ancestor_matcher_run_forwards_match. */
+    for (k = self->tree_sequence_builder->num_checkpoints; k > 0; k--) {
+        cp = &self->tree_sequence_builder->checkpoints[k - 1];
+        if (cp->in_index < num_edges && cp->out_index < num_edges
+                && in_edges[cp->in_index].left <= start) {
+            in_index = cp->in_index;
+            out_index = cp->out_index;
+            left = cp->left;
+            pos = cp->position;
+            right = pos;
+            cp_nodes = self->tree_sequence_builder->num_checkpoint_nodes;
+            memcpy(parent, cp->parent, cp_nodes * sizeof(node_id_t));
+            memcpy(left_child, cp->left_child, cp_nodes * sizeof(node_id_t));
+            memcpy(right_child, cp->right_child, cp_nodes * sizeof(node_id_t));
+            memcpy(left_sib, cp->left_sib, cp_nodes * sizeof(node_id_t));
+            memcpy(right_sib, cp->right_sib, cp_nodes * sizeof(node_id_t));
+            /* The dirty set for a checkpointed tree is unknown, so fall
+             * back to a full reset after this match. */
+            self->tree_fully_dirty = true;
+            break;
+        }
+    }
+    while (in_index < num_edges && out_index < num_edges
+            && in_edges[in_index].left <= start) {
+        while (out_index < num_edges && (edge = out_edges[out_index]).right == pos) {
+            remove_edge(edge, parent, left_child, right_child,
+                    left_sib, right_sib);
+            out_index++;
+        }
+        while (in_index < num_edges && (edge = in_edges[in_index]).left == pos) {
+            insert_edge(edge, parent, left_child, right_child,
+                    left_sib, right_sib);
+            dirty_nodes[num_dirty] = edge.parent;
+            dirty_nodes[num_dirty + 1] = edge.child;
+            num_dirty += 2;
+            in_index++;
+        }
+        left = pos;
+        right = self->num_sites;
+        if (in_index < num_edges) {
+            right = TSI_MIN(right, in_edges[in_index].left);
+        }
+        if (out_index < num_edges) {
+            right = TSI_MIN(right, out_edges[out_index].right);
+        }
+        pos = right;
+    }
+
+    /* Insert the initial likelihoods for each batch member. */
+    for (m = 0; m < num_matchers; m++) {
+        L = matchers[m]->likelihood;
+        L_cache = matchers[m]->likelihood_cache;
+        for (u = 0; u < (node_id_t) self->num_nodes; u++) {
+            L_cache[u] = CACHE_UNSET;
+            if (parent[u] != NULL_NODE) {
+                L[u] = NULL_LIKELIHOOD;
+            } else {
+                L[u] = NONZERO_ROOT_LIKELIHOOD;
+            }
+        }
+    }
+    last_root = 0;
+    if (left_child[0] != NULL_NODE) {
+        last_root = left_child[0];
+        assert(right_sib[last_root] == NULL_NODE);
+    }
+    for (m = 0; m < num_matchers; m++) {
+        matchers[m]->likelihood[last_root] = 1;
+        matchers[m]->likelihood_nodes[0] = last_root;
+        matchers[m]->num_likelihood_nodes = 1;
+    }
+
+    remove_start = out_index;
+    while (left < end) {
+        assert(left < right);
+        self->stats.num_tree_transitions++;
+
+        /* Remove the likelihoods for any nonzero roots that have just left
+         * the tree */
+        for (k = remove_start; k < out_index; k++) {
+            edge = out_edges[k];
+            if (unlikely(is_nonzero_root(edge.child, parent, left_child))) {
+                for (m = 0; m < num_matchers; m++) {
+                    L = matchers[m]->likelihood;
+                    if (L[edge.child] >= 0) {
+                        ancestor_matcher_delete_likelihood(matchers[m],
+                                edge.child, L);
+                    }
+                    L[edge.child] = NONZERO_ROOT_LIKELIHOOD;
+                }
+            }
+            if (unlikely(is_nonzero_root(edge.parent, parent, left_child))) {
+                for (m = 0; m < num_matchers; m++) {
+                    L = matchers[m]->likelihood;
+                    if (L[edge.parent] >= 0) {
+                        ancestor_matcher_delete_likelihood(matchers[m],
+                                edge.parent, L);
+                    }
+                    L[edge.parent] = NONZERO_ROOT_LIKELIHOOD;
+                }
+            }
+        }
+
+        root = 0;
+        if (left_child[0] != NULL_NODE) {
+            root = left_child[0];
+            assert(right_sib[root] == NULL_NODE);
+        }
+        if (root != last_root) {
+            for (m = 0; m < num_matchers; m++) {
+                L = matchers[m]->likelihood;
+                if (last_root == 0) {
+                    ancestor_matcher_delete_likelihood(matchers[m], last_root, L);
+                    L[last_root] = NONZERO_ROOT_LIKELIHOOD;
+                }
+                if (L[root] == NONZERO_ROOT_LIKELIHOOD) {
+                    L[root] = MISMATCH_LIKELIHOOD;
+                    matchers[m]->likelihood_nodes[
+                            matchers[m]->num_likelihood_nodes] = root;
+                    matchers[m]->num_likelihood_nodes++;
+                }
+            }
+            last_root = root;
+        }
+
+        for (site = TSI_MAX(left, start); site < TSI_MIN(right, end); site++) {
+            for (m = 0; m < num_matchers; m++) {
+                ret = ancestor_matcher_update_site_state(matchers[m], self, site,
+                        haplotypes[m][site], parent, matchers[m]->likelihood,
+                        matchers[m]->likelihood_cache);
+                if (ret != 0) {
+                    goto out;
+                }
+            }
+        }
+
+        /* Move on to the next tree */
+        remove_start = out_index;
+        while (out_index < num_edges && (edge = out_edges[out_index]).right == right) {
+            remove_edge(edge, parent, left_child, right_child, left_sib, right_sib);
+            out_index++;
+            for (m = 0; m < num_matchers; m++) {
+                L = matchers[m]->likelihood;
+                L_cache = matchers[m]->likelihood_cache;
+                assert(L[edge.child] != NONZERO_ROOT_LIKELIHOOD);
+                if (L[edge.child] == NULL_LIKELIHOOD) {
+                    u = edge.parent;
+                    while (likely(L[u] == NULL_LIKELIHOOD)
+                            && likely(L_cache[u] == CACHE_UNSET)) {
+                        u = parent[u];
+                    }
+                    L_child = L_cache[u];
+                    if (unlikely(L_child == CACHE_UNSET)) {
+                        L_child = L[u];
+                    }
+                    assert(L_child >= 0);
+                    u = edge.parent;
+                    /* Fill in the cache by traversing back upwards */
+                    while (likely(L[u] == NULL_LIKELIHOOD)
+                            && likely(L_cache[u] == CACHE_UNSET)) {
+                        L_cache[u] = L_child;
+                        u = parent[u];
+                    }
+                    L[edge.child] = L_child;
+                    matchers[m]->likelihood_nodes[
+                            matchers[m]->num_likelihood_nodes] = edge.child;
+                    matchers[m]->num_likelihood_nodes++;
+                }
+            }
+        }
+        /* reset the L caches */
+        for (k = remove_start; k < out_index; k++) {
+            edge = out_edges[k];
+            for (m = 0; m < num_matchers; m++) {
+                L_cache = matchers[m]->likelihood_cache;
+                u = edge.parent;
+                while (likely(L_cache[u] != CACHE_UNSET)) {
+                    L_cache[u] = CACHE_UNSET;
+                    u = parent[u];
+                }
+            }
+        }
+
+        left = right;
+        while (in_index < num_edges && (edge = in_edges[in_index]).left == left) {
+            in_index++;
+            insert_edge(edge, parent, left_child, right_child, left_sib, right_sib);
+            dirty_nodes[num_dirty] = edge.parent;
+            dirty_nodes[num_dirty + 1] = edge.child;
+            num_dirty += 2;
+            /* Insert zero likelihoods for any nonzero roots that have entered
+             * the tree. Note we don't bother trying to compress the tree here
+             * because this will be done for the next site anyway. */
+            for (m = 0; m < num_matchers; m++) {
+                L = matchers[m]->likelihood;
+                if (unlikely(edge.parent != 0
+                        && L[edge.parent] == NONZERO_ROOT_LIKELIHOOD)) {
+                    L[edge.parent] = 0;
+                    matchers[m]->likelihood_nodes[
+                            matchers[m]->num_likelihood_nodes] = edge.parent;
+                    matchers[m]->num_likelihood_nodes++;
+                }
+                if (unlikely(L[edge.child] == NONZERO_ROOT_LIKELIHOOD)) {
+                    L[edge.child] = 0;
+                    matchers[m]->likelihood_nodes[
+                            matchers[m]->num_likelihood_nodes] = edge.child;
+                    matchers[m]->num_likelihood_nodes++;
+                }
+            }
+        }
+        /* The tree topology has changed, so the preorder labels must be
+         * rebuilt before the next descendant test. */
+        self->preorder_valid = false;
         right = self->num_sites;
-        if (in != NULL) {
-            right = TSI_MIN(right, edge_left(in));
+        if (in_index < num_edges) {
+            right = TSI_MIN(right, in_edges[in_index].left);
+        }
+        if (out_index < num_edges) {
+            right = TSI_MIN(right, out_edges[out_index].right);
+        }
+    }
+out:
+    self->num_dirty_nodes = num_dirty;
+    return ret;
+}
+
+/* Finds paths for a batch of haplotypes over the interval [start, end) in
+ * a single sweep of the tree sequence. All matchers must be distinct
+ * instances attached to the same tree_sequence_builder; one haplotype is
+ * matched per matcher. The tracebacks are run per member since they
+ * depend on each member's likelihoods. */
+int
+ancestor_matcher_find_paths_batch(ancestor_matcher_t **matchers,
+        size_t num_matchers, site_id_t start, site_id_t end,
+        allele_t **haplotypes, allele_t **matched_haplotypes,
+        size_t *num_output_edges, site_id_t **left_output,
+        site_id_t **right_output, node_id_t **parent_output)
+{
+    int ret = 0;
+    size_t m;
+    double before;
+
+    assert(num_matchers > 0);
+    for (m = 0; m < num_matchers; m++) {
+        assert(matchers[m]->tree_sequence_builder
+                == matchers[0]->tree_sequence_builder);
+        ret = ancestor_matcher_reset(matchers[m]);
+        if (ret != 0) {
+            goto out;
         }
-        if (out != NULL) {
-            right = TSI_MIN(right, edge_right(out));
+        matchers[m]->stats.num_matches++;
+        matchers[m]->last_match_start = start;
+        matchers[m]->last_match_end = end;
+    }
+    /* The shared forwards sweep is accounted to the tree-owning matcher. */
+    before = ancestor_matcher_clock();
+    ret = ancestor_matcher_run_forwards_match_batch(matchers, num_matchers,
+            start, end, haplotypes);
+    if (ret != 0) {
+        goto out;
+    }
+    matchers[0]->stats.forwards_time += ancestor_matcher_clock() - before;
+    for (m = 0; m < num_matchers; m++) {
+        before = ancestor_matcher_clock();
+        ret = ancestor_matcher_run_traceback(matchers[m], start, end,
+                haplotypes[m], matched_haplotypes[m]);
+        if (ret != 0) {
+            goto out;
         }
+        matchers[m]->stats.traceback_time += ancestor_matcher_clock() - before;
+        left_output[m] = matchers[m]->output.left;
+        right_output[m] = matchers[m]->output.right;
+        parent_output[m] = matchers[m]->output.parent;
+        num_output_edges[m] = matchers[m]->output.size;
     }
 out:
+    if (ret != 0) {
+        /* The state left behind by a failed match is unknown. */
+        for (m = 0; m < num_matchers; m++) {
+            matchers[m]->tree_fully_dirty = true;
+        }
+    }
     return ret;
 }
 
@@ -956,25 +1921,38 @@ ancestor_matcher_find_path(ancestor_matcher_t *self,
 {
     int ret = 0;
 
+    double before;
+
     /* printf("FIND PATH: start=%d end=%d\n", start, end); */
     ret = ancestor_matcher_reset(self);
     if (ret != 0) {
         goto out;
     }
+    self->stats.num_matches++;
+    self->last_match_start = start;
+    self->last_match_end = end;
+    before = ancestor_matcher_clock();
     ret = ancestor_matcher_run_forwards_match(self, start, end, haplotype);
     if (ret != 0) {
         goto out;
     }
+    self->stats.forwards_time += ancestor_matcher_clock() - before;
+    before = ancestor_matcher_clock();
     ret = ancestor_matcher_run_traceback(self, start, end, haplotype,
             matched_haplotype);
     if (ret != 0) {
         goto out;
     }
+    self->stats.traceback_time += ancestor_matcher_clock() - before;
     *left_output = self->output.left;
     *right_output = self->output.right;
     *parent_output = self->output.parent;
     *num_output_edges = self->output.size;
 out:
+    if (ret != 0) {
+        /* The state left behind by a failed match is unknown. */
+        self->tree_fully_dirty = true;
+    }
     return ret;
 }
 
@@ -992,3 +1970,11 @@ ancestor_matcher_get_total_memory(ancestor_matcher_t *self)
 
     return total;
 }
+
+int
+ancestor_matcher_get_stats(ancestor_matcher_t *self, ancestor_matcher_stats_t *stats)
+{
+    *stats = self->stats;
+    stats->total_traceback_bytes = self->traceback_allocator.total_size;
+    return 0;
+}
@@ -0,0 +1,476 @@
+/*
+** Copyright (C) 2018 University of Oxford
+**
+** This file is part of tsinfer.
+**
+** tsinfer is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** tsinfer is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with tsinfer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Benchmark harness for the low-level inference engine. Synthesizes a
+ * genotype matrix of the requested size, runs the full single-threaded
+ * inference pipeline over it, and reports the time spent in each of the
+ * three main kernels (ancestor generation, copying path matching, and
+ * path insertion) as machine readable tab separated key/value pairs. */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <regex.h>
+#include "argtable3.h"
+
+#include "tsinfer.h"
+
+#define BENCH_TIME_SCALE 1024.0
+
+static void
+fatal_error(const char *msg, ...)
+{
+    va_list argp;
+    fprintf(stderr, "bench:");
+    va_start(argp, msg);
+    vfprintf(stderr, msg, argp);
+    va_end(argp);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+static double
+current_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec;
+}
+
+static size_t
+peak_rss_kb(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        fatal_error("getrusage: %s", strerror(errno));
+    }
+    return (size_t) usage.ru_maxrss;
+}
+
+/* Fills in a sample-major haplotype matrix. Each site's derived allele
+ * frequency is drawn from a distribution skewed towards rare variants,
+ * roughly mimicking the neutral site frequency spectrum, and the carriers
+ * are drawn uniformly without replacement. */
+static void
+generate_haplotypes(allele_t *haplotypes, size_t num_samples, size_t num_sites,
+        unsigned int seed)
+{
+    size_t j, l, frequency, needed, remaining;
+    double u;
+
+    srand(seed);
+    for (l = 0; l < num_sites; l++) {
+        u = (double) rand() / ((double) RAND_MAX + 1);
+        frequency = 1 + (size_t) ((double) (num_samples - 1) * u * u * u);
+        needed = frequency;
+        remaining = num_samples;
+        for (j = 0; j < num_samples; j++) {
+            if ((size_t) rand() % remaining < needed) {
+                haplotypes[j * num_sites + l] = 1;
+                needed--;
+            } else {
+                haplotypes[j * num_sites + l] = 0;
+            }
+            remaining--;
+        }
+    }
+}
+
+static void
+run_bench(size_t num_samples, size_t num_sites, unsigned int seed, int verbose)
+{
+    size_t j, k, num_ancestors, num_edges, num_mutations, frequency;
+    size_t epoch_start, epoch_end, max_epoch_size;
+    size_t total_ancestor_sites = 0;
+    size_t total_match_sites = 0;
+    size_t total_edges = 0;
+    double t_build = 0;
+    double t_match = 0;
+    double t_add_path = 0;
+    double before, root_time;
+    site_id_t l, start, end;
+    site_id_t *left, *right;
+    node_id_t *parent;
+    allele_t *haplotypes = NULL;
+    allele_t *genotypes = NULL;
+    allele_t *a = NULL;
+    allele_t *match = NULL;
+    allele_t *derived_state = NULL;
+    site_id_t *mutation_sites = NULL;
+    size_t *epoch_num_edges = NULL;
+    site_id_t **epoch_left = NULL;
+    site_id_t **epoch_right = NULL;
+    node_id_t **epoch_parent = NULL;
+    size_t *sample_num_edges = NULL;
+    site_id_t **sample_left = NULL;
+    site_id_t **sample_right = NULL;
+    node_id_t **sample_parent = NULL;
+    allele_t *sample_mismatch = NULL;
+    node_id_t epoch_child, sample_child;
+    ancestor_builder_t ancestor_builder;
+    tree_sequence_builder_t ts_builder;
+    ancestor_matcher_t matcher;
+    ancestor_descriptor_t *descriptor;
+    node_id_t child;
+    int ret;
+
+    haplotypes = malloc(num_samples * num_sites * sizeof(allele_t));
+    genotypes = malloc(num_samples * sizeof(allele_t));
+    a = malloc(num_sites * sizeof(allele_t));
+    match = malloc(num_sites * sizeof(allele_t));
+    derived_state = malloc(num_sites * sizeof(allele_t));
+    mutation_sites = malloc(num_sites * sizeof(site_id_t));
+    if (haplotypes == NULL || genotypes == NULL || a == NULL || match == NULL
+            || derived_state == NULL || mutation_sites == NULL) {
+        fatal_error("malloc failure");
+    }
+    generate_haplotypes(haplotypes, num_samples, num_sites, seed);
+    memset(derived_state, 1, num_sites * sizeof(allele_t));
+
+    ret = ancestor_builder_alloc(&ancestor_builder, num_samples, num_sites, 0);
+    if (ret != 0) {
+        fatal_error("Builder alloc error.");
+    }
+    for (l = 0; l < (site_id_t) num_sites; l++) {
+        frequency = 0;
+        for (j = 0; j < num_samples; j++) {
+            genotypes[j] = haplotypes[j * num_sites + l];
+            frequency += genotypes[j];
+        }
+        ret = ancestor_builder_add_site(&ancestor_builder, l, frequency, genotypes);
+        if (ret != 0) {
+            fatal_error("Add site error");
+        }
+    }
+    ret = ancestor_builder_finalise(&ancestor_builder);
+    if (ret != 0) {
+        fatal_error("builder finalise");
+    }
+    num_ancestors = ancestor_builder.num_ancestors;
+    if (verbose > 0) {
+        ancestor_builder_print_state(&ancestor_builder, stdout);
+    }
+
+    /* Ancestors of equal frequency are generated and matched as an epoch,
+     * with their paths applied only once the whole epoch has been matched,
+     * exactly as the main CLI does. */
+    max_epoch_size = 0;
+    epoch_start = 0;
+    while (epoch_start < num_ancestors) {
+        frequency = ancestor_builder.descriptors[epoch_start].frequency;
+        epoch_end = epoch_start;
+        while (epoch_end < num_ancestors
+                && ancestor_builder.descriptors[epoch_end].frequency == frequency) {
+            epoch_end++;
+        }
+        max_epoch_size = TSI_MAX(max_epoch_size, epoch_end - epoch_start);
+        epoch_start = epoch_end;
+    }
+    epoch_num_edges = calloc(TSI_MAX(1, max_epoch_size), sizeof(size_t));
+    epoch_left = calloc(TSI_MAX(1, max_epoch_size), sizeof(site_id_t *));
+    epoch_right = calloc(TSI_MAX(1, max_epoch_size), sizeof(site_id_t *));
+    epoch_parent = calloc(TSI_MAX(1, max_epoch_size), sizeof(node_id_t *));
+    sample_num_edges = calloc(num_samples, sizeof(size_t));
+    sample_left = calloc(num_samples, sizeof(site_id_t *));
+    sample_right = calloc(num_samples, sizeof(site_id_t *));
+    sample_parent = calloc(num_samples, sizeof(node_id_t *));
+    sample_mismatch = malloc(num_samples * num_sites * sizeof(allele_t));
+    if (epoch_num_edges == NULL || epoch_left == NULL || epoch_right == NULL
+            || epoch_parent == NULL || sample_num_edges == NULL
+            || sample_left == NULL || sample_right == NULL
+            || sample_parent == NULL || sample_mismatch == NULL) {
+        fatal_error("malloc failure");
+    }
+
+    ret = tree_sequence_builder_alloc(&ts_builder, num_sites, 1024, 8192, 0);
+    if (ret != 0) {
+        fatal_error("alloc error");
+    }
+    ret = ancestor_matcher_alloc(&matcher, &ts_builder, 0, 0);
+    if (ret != 0) {
+        fatal_error("matcher alloc error");
+    }
+
+    /* Node 0 is the ultimate ancestor; node 1 is the all-zeros root
+     * ancestor covering the whole sequence, as in the main CLI. Node times
+     * are spaced well apart because path compression allocates synthetic
+     * node times in fixed decrements below their parents, and the dense
+     * synthetic input nests these much deeper than real data does. */
+    root_time = BENCH_TIME_SCALE * (num_ancestors == 0 ? 1 :
+            (double) ancestor_builder.descriptors[0].frequency + 1);
+    ret = tree_sequence_builder_add_node(&ts_builder,
+            root_time + BENCH_TIME_SCALE, true);
+    if (ret < 0) {
+        fatal_error("add node");
+    }
+    ret = tree_sequence_builder_add_node(&ts_builder, root_time, true);
+    if (ret < 0) {
+        fatal_error("add node");
+    }
+    start = 0;
+    end = (site_id_t) num_sites;
+    child = 0;
+    ret = tree_sequence_builder_add_path(&ts_builder, 1, 1, &start, &end,
+            &child, 0);
+    if (ret != 0) {
+        fatal_error("add_path");
+    }
+
+    /* Generate, match and insert each epoch's ancestors, with the three
+     * kernels timed separately. */
+    epoch_start = 0;
+    while (epoch_start < num_ancestors) {
+        frequency = ancestor_builder.descriptors[epoch_start].frequency;
+        epoch_end = epoch_start;
+        while (epoch_end < num_ancestors
+                && ancestor_builder.descriptors[epoch_end].frequency == frequency) {
+            epoch_end++;
+        }
+        epoch_child = NULL_NODE;
+        for (k = epoch_start; k < epoch_end; k++) {
+            child = tree_sequence_builder_add_node(&ts_builder,
+                    BENCH_TIME_SCALE * (double) frequency, true);
+            if (child < 0) {
+                fatal_error("add node");
+            }
+            if (k == epoch_start) {
+                epoch_child = child;
+            }
+        }
+        for (k = epoch_start; k < epoch_end; k++) {
+            descriptor = ancestor_builder.descriptors + k;
+            before = current_time();
+            ret = ancestor_builder_make_ancestor(&ancestor_builder,
+                    descriptor->num_focal_sites, descriptor->focal_sites,
+                    &start, &end, a);
+            if (ret != 0) {
+                fatal_error("make ancestor");
+            }
+            t_build += current_time() - before;
+            total_ancestor_sites += (size_t) (end - start);
+
+            before = current_time();
+            ret = ancestor_matcher_find_path(&matcher, start, end, a, match,
+                    &num_edges, &left, &right, &parent);
+            if (ret != 0) {
+                fatal_error("find path");
+            }
+            t_match += current_time() - before;
+            total_match_sites += (size_t) (end - start);
+
+            /* The matcher's output buffers are reused, so keep a copy of
+             * the path until the whole epoch has been matched. */
+            j = k - epoch_start;
+            epoch_num_edges[j] = num_edges;
+            epoch_left[j] = malloc(num_edges * sizeof(site_id_t));
+            epoch_right[j] = malloc(num_edges * sizeof(site_id_t));
+            epoch_parent[j] = malloc(num_edges * sizeof(node_id_t));
+            if (epoch_left[j] == NULL || epoch_right[j] == NULL
+                    || epoch_parent[j] == NULL) {
+                fatal_error("malloc failure");
+            }
+            memcpy(epoch_left[j], left, num_edges * sizeof(site_id_t));
+            memcpy(epoch_right[j], right, num_edges * sizeof(site_id_t));
+            memcpy(epoch_parent[j], parent, num_edges * sizeof(node_id_t));
+        }
+        for (k = epoch_start; k < epoch_end; k++) {
+            descriptor = ancestor_builder.descriptors + k;
+            j = k - epoch_start;
+            before = current_time();
+            ret = tree_sequence_builder_add_path(&ts_builder,
+                    epoch_child + (node_id_t) j, epoch_num_edges[j],
+                    epoch_left[j], epoch_right[j], epoch_parent[j],
+                    TSI_COMPRESS_PATH);
+            if (ret != 0) {
+                fatal_error("add path");
+            }
+            t_add_path += current_time() - before;
+            total_edges += epoch_num_edges[j];
+            free(epoch_left[j]);
+            free(epoch_right[j]);
+            free(epoch_parent[j]);
+            epoch_left[j] = NULL;
+            epoch_right[j] = NULL;
+            epoch_parent[j] = NULL;
+
+            ret = tree_sequence_builder_add_mutations(&ts_builder,
+                    epoch_child + (node_id_t) j, descriptor->num_focal_sites,
+                    descriptor->focal_sites, derived_state);
+            if (ret != 0) {
+                fatal_error("add mutations");
+            }
+        }
+        epoch_start = epoch_end;
+    }
+
+    /* Match the samples against the final tree sequence. As in the main
+     * CLI, all samples are matched before any of their paths or mutations
+     * are applied, so no sample ever copies from another sample. */
+    sample_child = NULL_NODE;
+    for (j = 0; j < num_samples; j++) {
+        child = tree_sequence_builder_add_node(&ts_builder, 0, true);
+        if (child < 0) {
+            fatal_error("add node");
+        }
+        if (j == 0) {
+            sample_child = child;
+        }
+    }
+    for (j = 0; j < num_samples; j++) {
+        before = current_time();
+        ret = ancestor_matcher_find_path(&matcher, 0, (site_id_t) num_sites,
+                haplotypes + j * num_sites, match, &num_edges, &left, &right,
+                &parent);
+        if (ret != 0) {
+            fatal_error("find path");
+        }
+        t_match += current_time() - before;
+        total_match_sites += num_sites;
+
+        sample_num_edges[j] = num_edges;
+        sample_left[j] = malloc(num_edges * sizeof(site_id_t));
+        sample_right[j] = malloc(num_edges * sizeof(site_id_t));
+        sample_parent[j] = malloc(num_edges * sizeof(node_id_t));
+        if (sample_left[j] == NULL || sample_right[j] == NULL
+                || sample_parent[j] == NULL) {
+            fatal_error("malloc failure");
+        }
+        memcpy(sample_left[j], left, num_edges * sizeof(site_id_t));
+        memcpy(sample_right[j], right, num_edges * sizeof(site_id_t));
+        memcpy(sample_parent[j], parent, num_edges * sizeof(node_id_t));
+        /* Record the mismatched sites for this sample. */
+        for (l = 0; l < (site_id_t) num_sites; l++) {
+            sample_mismatch[j * num_sites + l] = (allele_t)
+                    (haplotypes[j * num_sites + l] != match[l]);
+        }
+    }
+    for (j = 0; j < num_samples; j++) {
+        before = current_time();
+        ret = tree_sequence_builder_add_path(&ts_builder,
+                sample_child + (node_id_t) j, sample_num_edges[j],
+                sample_left[j], sample_right[j], sample_parent[j],
+                TSI_COMPRESS_PATH);
+        if (ret != 0) {
+            fatal_error("add path");
+        }
+        t_add_path += current_time() - before;
+        total_edges += sample_num_edges[j];
+        free(sample_left[j]);
+        free(sample_right[j]);
+        free(sample_parent[j]);
+
+        num_mutations = 0;
+        for (l = 0; l < (site_id_t) num_sites; l++) {
+            if (sample_mismatch[j * num_sites + l]) {
+                mutation_sites[num_mutations] = l;
+                derived_state[num_mutations] = haplotypes[j * num_sites + l];
+                num_mutations++;
+            }
+        }
+        ret = tree_sequence_builder_add_mutations(&ts_builder,
+                sample_child + (node_id_t) j, num_mutations, mutation_sites,
+                derived_state);
+        if (ret != 0) {
+            fatal_error("add mutations");
+        }
+        /* Restore the derived state buffer. */
+        memset(derived_state, 1, num_mutations * sizeof(allele_t));
+    }
+
+    printf("num_samples\t%d\n", (int) num_samples);
+    printf("num_sites\t%d\n", (int) num_sites);
+    printf("num_ancestors\t%d\n", (int) num_ancestors);
+    printf("total_edges\t%d\n", (int) total_edges);
+    printf("ancestor_build_seconds\t%.6f\n", t_build);
+    printf("ancestor_build_sites_per_sec\t%.0f\n",
+            (double) total_ancestor_sites / t_build);
+    printf("match_seconds\t%.6f\n", t_match);
+    printf("match_sites_per_sec\t%.0f\n", (double) total_match_sites / t_match);
+    printf("add_path_seconds\t%.6f\n", t_add_path);
+    printf("add_path_edges_per_sec\t%.0f\n", (double) total_edges / t_add_path);
+    printf("peak_rss_kb\t%d\n", (int) peak_rss_kb());
+
+    ancestor_builder_free(&ancestor_builder);
+    ancestor_matcher_free(&matcher);
+    tree_sequence_builder_free(&ts_builder);
+    tsi_safe_free(haplotypes);
+    tsi_safe_free(genotypes);
+    tsi_safe_free(a);
+    tsi_safe_free(match);
+    tsi_safe_free(derived_state);
+    tsi_safe_free(mutation_sites);
+    tsi_safe_free(epoch_num_edges);
+    tsi_safe_free(epoch_left);
+    tsi_safe_free(epoch_right);
+    tsi_safe_free(epoch_parent);
+    tsi_safe_free(sample_num_edges);
+    tsi_safe_free(sample_left);
+    tsi_safe_free(sample_right);
+    tsi_safe_free(sample_parent);
+    tsi_safe_free(sample_mismatch);
+}
+
+int
+main(int argc, char** argv)
+{
+    /* SYNTAX 1: bench [-v] [-n <num-samples>] [-m <num-sites>] [-s <seed>] */
+    struct arg_lit *verbose1 = arg_lit0("v", "verbose", NULL);
+    struct arg_int *num_samples1 = arg_int0("n", "num-samples", "<num-samples>", NULL);
+    struct arg_int *num_sites1 = arg_int0("m", "num-sites", "<num-sites>", NULL);
+    struct arg_int *seed1 = arg_int0("s", "seed", "<seed>", NULL);
+    struct arg_end *end1 = arg_end(20);
+    void* argtable1[] = {verbose1, num_samples1, num_sites1, seed1, end1};
+    int nerrors1;
+
+    int exitcode = EXIT_SUCCESS;
+    const char *progname = "bench";
+
+    num_samples1->ival[0] = 1000;
+    num_sites1->ival[0] = 1000;
+    seed1->ival[0] = 1;
+    nerrors1 = arg_parse(argc, argv, argtable1);
+
+    if (nerrors1 == 0) {
+        if (num_samples1->ival[0] < 2 || num_sites1->ival[0] < 1) {
+            fatal_error("bad workload dimensions");
+        }
+        run_bench((size_t) num_samples1->ival[0], (size_t) num_sites1->ival[0],
+                (unsigned int) seed1->ival[0], verbose1->count);
+    } else {
+        arg_print_errors(stdout, end1, progname);
+        printf("usage: %s ", progname);
+        arg_print_syntax(stdout, argtable1, "\n");
+        exitcode = EXIT_FAILURE;
+    }
+    arg_freetable(argtable1, sizeof(argtable1) / sizeof(argtable1[0]));
+
+    return exitcode;
+}
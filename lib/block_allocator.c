@@ -17,14 +17,53 @@
 ** along with tsinfer.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
 #include "err.h"
 #include "block_allocator.h"
 
+#define HUGEPAGE_SIZE (2UL << 20)
+
+static void *
+block_allocator_alloc_chunk(block_allocator_t *self)
+{
+    void *p;
+
+    if (self->flags & BLOCK_ALLOCATOR_HUGEPAGE) {
+        p = mmap(NULL, self->mapped_chunk_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            p = NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (p != NULL) {
+            /* Advisory only; the kernel falls back to ordinary pages when
+             * no hugepages are available. */
+            madvise(p, self->mapped_chunk_size, MADV_HUGEPAGE);
+        }
+#endif
+    } else {
+        p = malloc(self->chunk_size);
+    }
+    return p;
+}
+
+static void
+block_allocator_free_chunk(block_allocator_t *self, void *p)
+{
+    if (self->flags & BLOCK_ALLOCATOR_HUGEPAGE) {
+        munmap(p, self->mapped_chunk_size);
+    } else {
+        free(p);
+    }
+}
+
 void
 block_allocator_print_state(block_allocator_t *self, FILE *out)
 {
@@ -48,13 +87,16 @@ block_allocator_reset(block_allocator_t *self)
 }
 
 int WARN_UNUSED
-block_allocator_alloc(block_allocator_t *self, size_t chunk_size)
+block_allocator_alloc_flags(block_allocator_t *self, size_t chunk_size, int flags)
 {
     int ret = 0;
 
     assert(chunk_size > 0);
     memset(self, 0, sizeof(block_allocator_t));
+    self->flags = flags;
     self->chunk_size = chunk_size;
+    self->mapped_chunk_size =
+        (chunk_size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
     self->top = 0;
     self->current_chunk = 0;
     self->total_allocated = 0;
@@ -65,7 +107,7 @@ block_allocator_alloc(block_allocator_t *self, size_t chunk_size)
         ret = TSI_ERR_NO_MEMORY;
         goto out;
     }
-    self->mem_chunks[0] = malloc(chunk_size);
+    self->mem_chunks[0] = block_allocator_alloc_chunk(self);
     if (self->mem_chunks[0] == NULL) {
         ret = TSI_ERR_NO_MEMORY;
         goto out;
@@ -76,6 +118,12 @@ out:
     return ret;
 }
 
+int WARN_UNUSED
+block_allocator_alloc(block_allocator_t *self, size_t chunk_size)
+{
+    return block_allocator_alloc_flags(self, chunk_size, 0);
+}
+
 void * WARN_UNUSED
 block_allocator_get(block_allocator_t *self, size_t size)
 {
@@ -90,7 +138,7 @@ block_allocator_get(block_allocator_t *self, size_t size)
                 goto out;
             }
             self->mem_chunks = p;
-            p = malloc(self->chunk_size);
+            p = block_allocator_alloc_chunk(self);
             if (p == NULL) {
                 goto out;
             }
@@ -115,7 +163,7 @@ block_allocator_free(block_allocator_t *self)
 
     for (j = 0; j < self->num_chunks; j++) {
         if (self->mem_chunks[j] != NULL) {
-            free(self->mem_chunks[j]);
+            block_allocator_free_chunk(self, self->mem_chunks[j]);
         }
     }
     if (self->mem_chunks != NULL) {
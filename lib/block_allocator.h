@@ -33,8 +33,16 @@
 #include <string.h>
 #include <assert.h>
 
+/* When set, chunks are obtained with mmap and advised onto 2MB hugepages
+ * rather than malloced, reducing TLB pressure for very large allocations.
+ * Freshly mapped memory is physically placed on first touch, so chunks
+ * also end up on the NUMA node of the thread that fills them. */
+#define BLOCK_ALLOCATOR_HUGEPAGE 1
+
 typedef struct {
+    int flags;
     size_t chunk_size;        /* number of bytes per chunk */
+    size_t mapped_chunk_size; /* chunk_size rounded up to the hugepage size */
     size_t top;               /* the offset of the next available byte in the current chunk */
     size_t current_chunk;     /* the index of the chunk currently being used */
     size_t total_size;        /* the total number of bytes allocated + overhead. */
@@ -46,6 +54,8 @@ typedef struct {
 extern void block_allocator_print_state(block_allocator_t *self, FILE *out);
 extern int block_allocator_reset(block_allocator_t *self);
 extern int block_allocator_alloc(block_allocator_t *self, size_t chunk_size);
+extern int block_allocator_alloc_flags(block_allocator_t *self, size_t chunk_size,
+        int flags);
 extern void * block_allocator_get(block_allocator_t *self, size_t size);
 extern void block_allocator_free(block_allocator_t *self);
 
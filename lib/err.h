@@ -15,5 +15,7 @@
 #define TSI_ERR_NO_MEMORY                                           -2
 #define TSI_ERR_NONCONTIGUOUS_EDGES                                 -3
 #define TSI_ERR_UNSORTED_EDGES                                      -4
+#define TSI_ERR_IO                                                  -5
+#define TSI_ERR_FILE_FORMAT                                         -6
 
 #endif /*__ERR_H__*/
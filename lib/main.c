@@ -28,6 +28,12 @@
 #include <string.h>
 #include <stdbool.h>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <regex.h>
 #include "argtable3.h"
 
@@ -35,6 +41,50 @@
 
 #include "tsinfer.h"
 
+/* Native binary input format. The file is a fixed header followed by the
+ * site positions, the recombination rates and the genotype matrix in
+ * site-major order, so that the genotypes for a site are contiguous and
+ * can be handed to ancestor_builder_add_site directly from the mapping
+ * without copying. All values are in host byte order. */
+typedef struct {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t num_samples;
+    uint64_t num_sites;
+} native_header_t;
+
+#define NATIVE_MAGIC 0x005245464e495354ULL /* "TSINFER\0", little endian */
+#define NATIVE_VERSION 1
+
+/* Binary result format: a fixed header followed by the node, edge and
+ * mutation column arrays exactly as produced by the dump functions. */
+typedef struct {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t num_nodes;
+    uint64_t num_edges;
+    uint64_t num_mutations;
+} result_header_t;
+
+#define RESULT_MAGIC 0x00534552464e4954ULL /* "TINFRES\0", little endian */
+#define RESULT_VERSION 1
+
+/* Match record format: a fixed header followed by one entry per find_path
+ * call in submission order. Each entry is {epoch, node, start, end} as
+ * int32 values followed by the (end - start) haplotype bytes that were
+ * matched. The builder state that an epoch's matches ran against is
+ * snapshotted to "<prefix>.<epoch>.snap" alongside the log; the sample
+ * matching phase is recorded as the final epoch. */
+typedef struct {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t num_sites;
+    uint64_t num_epochs;
+} record_header_t;
+
+#define RECORD_MAGIC 0x00434552464e4954ULL /* "TINFREC\0", little endian */
+#define RECORD_VERSION 1
+
 static void
 fatal_error(const char *msg, ...)
 {
@@ -239,6 +289,157 @@ read_input(const char *filename, size_t *r_num_samples, size_t *r_num_sites,
     *r_recombination_rate = recombination_rate;
 }
 
+static bool
+is_native_file(const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    uint64_t magic = 0;
+    bool ret = false;
+
+    if (f == NULL) {
+        fatal_error("Cannot open '%s': %s", filename, strerror(errno));
+    }
+    if (fread(&magic, sizeof(magic), 1, f) == 1) {
+        ret = magic == NATIVE_MAGIC;
+    }
+    fclose(f);
+    return ret;
+}
+
+static void
+read_native_input(const char *filename, size_t *r_num_samples, size_t *r_num_sites,
+        allele_t **r_genotypes, double **r_position, double **r_recombination_rate,
+        void **r_mapping, size_t *r_mapping_size)
+{
+    int fd;
+    struct stat st;
+    void *mapping;
+    char *p;
+    native_header_t header;
+    size_t expected_size;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fatal_error("Cannot open '%s': %s", filename, strerror(errno));
+    }
+    if (fstat(fd, &st) != 0) {
+        fatal_error("Cannot stat '%s': %s", filename, strerror(errno));
+    }
+    if ((size_t) st.st_size < sizeof(native_header_t)) {
+        fatal_error("'%s' is not a native input file", filename);
+    }
+    mapping = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        fatal_error("Cannot mmap '%s': %s", filename, strerror(errno));
+    }
+    /* The mapping keeps the file open; the descriptor is no longer needed. */
+    close(fd);
+    memcpy(&header, mapping, sizeof(header));
+    if (header.magic != NATIVE_MAGIC) {
+        fatal_error("'%s' is not a native input file", filename);
+    }
+    if (header.version != NATIVE_VERSION) {
+        fatal_error("Unsupported native input version %d", (int) header.version);
+    }
+    expected_size = sizeof(header)
+            + 2 * header.num_sites * sizeof(double)
+            + header.num_samples * header.num_sites * sizeof(allele_t);
+    if ((size_t) st.st_size != expected_size) {
+        fatal_error("'%s' is truncated", filename);
+    }
+    p = (char *) mapping + sizeof(header);
+    *r_position = (double *) (void *) p;
+    p += header.num_sites * sizeof(double);
+    *r_recombination_rate = (double *) (void *) p;
+    p += header.num_sites * sizeof(double);
+    *r_genotypes = (allele_t *) (void *) p;
+    *r_num_samples = header.num_samples;
+    *r_num_sites = header.num_sites;
+    *r_mapping = mapping;
+    *r_mapping_size = (size_t) st.st_size;
+}
+
+static void
+output_ts_binary(tree_sequence_builder_t *ts_builder, const char *output_file)
+{
+    int ret = 0;
+    size_t num_nodes = tree_sequence_builder_get_num_nodes(ts_builder);
+    size_t num_edges = tree_sequence_builder_get_num_edges(ts_builder);
+    size_t num_mutations = tree_sequence_builder_get_num_mutations(ts_builder);
+    double *time = malloc(num_nodes * sizeof(double));
+    uint32_t *flags = malloc(num_nodes * sizeof(uint32_t));
+    site_id_t *left = malloc(num_edges * sizeof(site_id_t));
+    site_id_t *right = malloc(num_edges * sizeof(site_id_t));
+    ancestor_id_t *parent = malloc(num_edges * sizeof(ancestor_id_t));
+    ancestor_id_t *children = malloc(num_edges * sizeof(ancestor_id_t));
+    site_id_t *site = malloc(num_mutations * sizeof(site_id_t));
+    ancestor_id_t *node = malloc(num_mutations * sizeof(ancestor_id_t));
+    allele_t *derived_state = malloc(num_mutations * sizeof(allele_t));
+    mutation_id_t *mutation_parent = malloc(num_mutations * sizeof(mutation_id_t));
+    result_header_t header;
+    FILE *f;
+
+    if (time == NULL || flags == NULL
+            || left == NULL || right == NULL || parent == NULL || children == NULL
+            || site == NULL || node == NULL || derived_state == NULL
+            || mutation_parent == NULL) {
+        fatal_error("malloc error\n");
+    }
+    ret = tree_sequence_builder_dump_nodes(ts_builder, flags, time);
+    if (ret != 0) {
+        fatal_error("dump error");
+    }
+    ret = tree_sequence_builder_dump_edges(ts_builder, left, right, parent, children);
+    if (ret != 0) {
+        fatal_error("dump error");
+    }
+    ret = tree_sequence_builder_dump_mutations(ts_builder, site, node,
+            derived_state, mutation_parent);
+    if (ret != 0) {
+        fatal_error("dump error");
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = RESULT_MAGIC;
+    header.version = RESULT_VERSION;
+    header.num_nodes = num_nodes;
+    header.num_edges = num_edges;
+    header.num_mutations = num_mutations;
+    f = fopen(output_file, "wb");
+    if (f == NULL) {
+        fatal_error("Error opening '%s': %s", output_file, strerror(errno));
+    }
+    /* Each column goes out as one large buffered write, so serialization
+     * is bound by the disk rather than by formatting. */
+    if (fwrite(&header, sizeof(header), 1, f) != 1
+            || fwrite(flags, sizeof(uint32_t), num_nodes, f) != num_nodes
+            || fwrite(time, sizeof(double), num_nodes, f) != num_nodes
+            || fwrite(left, sizeof(site_id_t), num_edges, f) != num_edges
+            || fwrite(right, sizeof(site_id_t), num_edges, f) != num_edges
+            || fwrite(parent, sizeof(ancestor_id_t), num_edges, f) != num_edges
+            || fwrite(children, sizeof(ancestor_id_t), num_edges, f) != num_edges
+            || fwrite(site, sizeof(site_id_t), num_mutations, f) != num_mutations
+            || fwrite(node, sizeof(ancestor_id_t), num_mutations, f) != num_mutations
+            || fwrite(derived_state, sizeof(allele_t), num_mutations, f)
+                != num_mutations
+            || fwrite(mutation_parent, sizeof(mutation_id_t), num_mutations, f)
+                != num_mutations) {
+        fatal_error("Error writing '%s': %s", output_file, strerror(errno));
+    }
+    if (fclose(f) != 0) {
+        fatal_error("Error writing '%s': %s", output_file, strerror(errno));
+    }
+    free(time);
+    free(flags);
+    free(left);
+    free(right);
+    free(parent);
+    free(children);
+    free(site);
+    free(node);
+    free(derived_state);
+    free(mutation_parent);
+}
+
 static void
 output_ts(tree_sequence_builder_t *ts_builder)
 {
@@ -299,65 +500,154 @@ output_ts(tree_sequence_builder_t *ts_builder)
     free(mutation_parent);
 }
 
+static FILE *
+record_open(const char *record_prefix, size_t num_sites, size_t num_epochs)
+{
+    char path[1024];
+    record_header_t header;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s.log", record_prefix);
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        fatal_error("Error opening '%s': %s", path, strerror(errno));
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = RECORD_MAGIC;
+    header.version = RECORD_VERSION;
+    header.num_sites = num_sites;
+    header.num_epochs = num_epochs;
+    if (fwrite(&header, sizeof(header), 1, f) != 1) {
+        fatal_error("Error writing '%s': %s", path, strerror(errno));
+    }
+    return f;
+}
+
+/* Snapshots the builder state that the given epoch's matches will run
+ * against; the matches themselves only read the builder, so this captures
+ * everything a replay needs. */
 static void
-run_generate(const char *input_file, int verbose)
+record_snapshot(tree_sequence_builder_t *ts_builder, const char *record_prefix,
+        size_t epoch)
 {
-    size_t num_samples, num_sites, j, k, num_ancestors;
-    allele_t *haplotypes = NULL;
+    char path[1024];
+    int ret;
+
+    snprintf(path, sizeof(path), "%s.%d.snap", record_prefix, (int) epoch);
+    ret = tree_sequence_builder_dump_snapshot(ts_builder, path);
+    if (ret != 0) {
+        fatal_error("Error writing '%s'", path);
+    }
+}
+
+static void
+record_match(FILE *record_log, size_t epoch, node_id_t node, site_id_t start,
+        site_id_t end, const allele_t *haplotype)
+{
+    int32_t entry[4];
+
+    entry[0] = (int32_t) epoch;
+    entry[1] = node;
+    entry[2] = start;
+    entry[3] = end;
+    if (fwrite(entry, sizeof(entry), 1, record_log) != 1
+            || fwrite(haplotype + start, sizeof(allele_t),
+                (size_t) (end - start), record_log) != (size_t) (end - start)) {
+        fatal_error("Error writing record log: %s", strerror(errno));
+    }
+}
+
+/* Generates one epoch's ancestors on a separate thread, so that epoch f+1
+ * can be produced while epoch f is being matched. Generation only reads
+ * the ancestor builder's site data and so has no dependency on the
+ * matching results. */
+typedef struct {
+    ancestor_builder_t *builder;
+    size_t epoch_start;
+    size_t epoch_end;
+    size_t num_threads;
+    allele_t *ancestors;
+    site_id_t *starts;
+    site_id_t *ends;
+    int ret;
+} epoch_generator_t;
+
+static void *
+epoch_generator_worker(void *arg)
+{
+    epoch_generator_t *gen = (epoch_generator_t *) arg;
+
+    gen->ret = ancestor_builder_make_ancestors(gen->builder, gen->epoch_start,
+            gen->epoch_end, gen->num_threads, gen->ancestors, gen->starts,
+            gen->ends);
+    return NULL;
+}
+
+/* Runs the full inference pipeline over the given genotype matrix,
+ * leaving the result in ts_builder, which is allocated here and freed by
+ * the caller. site_genotypes optionally points at the same data in
+ * site-major order, saving a gather per site, and may be NULL. Returns
+ * the id of the first sample node. */
+static node_id_t
+infer_tree_sequence(tree_sequence_builder_t *ts_builder, allele_t *haplotypes,
+        allele_t *site_genotypes, size_t num_samples, size_t num_sites,
+        int verbose, int num_threads, int batch_size,
+        const char *record_prefix)
+{
+    size_t j, k, num_ancestors;
+    size_t epoch_start, epoch_end, max_epoch_size;
+    size_t frequency, num_mutations;
     allele_t *genotypes = NULL;
-    site_id_t *focal_sites = NULL;
-    double *positions = NULL;
-    double *recombination_rate = NULL;
+    allele_t *g;
     site_id_t l, start, end;
-    size_t num_focal_sites;
     ancestor_builder_t ancestor_builder;
-    tree_sequence_builder_t ts_builder;
-    ancestor_matcher_t matcher;
-    allele_t *a, *sample, *match;
-    size_t frequency, edge_offset, mutation_offset;
+    match_pool_t pool;
+    ancestor_descriptor_t *descriptor;
+    allele_t *a, *match;
+    allele_t *epoch_ancestors[2] = {NULL, NULL};
+    allele_t *epoch_matches = NULL;
+    allele_t *sample_matches = NULL;
+    allele_t *derived_state = NULL;
+    site_id_t *mutation_sites = NULL;
+    site_id_t *epoch_starts[2] = {NULL, NULL};
+    site_id_t *epoch_ends[2] = {NULL, NULL};
+    size_t *epoch_first = NULL;
+    size_t num_epochs, e, buf;
+    epoch_generator_t generator;
+    pthread_t generator_thread;
+    bool generator_running = false;
+    FILE *record_log = NULL;
+    node_id_t child, epoch_child, sample_child;
+    double root_time;
     int ret;
-    /* Buffers for edge output */
-    size_t total_edges;
-    size_t num_edges, *num_edges_buffer, *num_mutations_buffer;
-    size_t max_edges = 1024 * 1024;
-    site_id_t *left_buffer, *left_output;
-    site_id_t *right_buffer, *right_output;
-    node_id_t *parent_buffer, *parent_output;
-    node_id_t *child_buffer;
-    /* Buffers for mutation output */
-    size_t max_mutations = 8192;
-    size_t total_mutations;
-    site_id_t *site_buffer;
-    node_id_t *node_buffer;
-    allele_t *derived_state_buffer;
-    node_id_t child;
-    int flags = 0;
-    avl_node_t *avl_node;
-    pattern_map_t *map_elem;
-    site_list_t *s;
-
-    flags = 0;
-
-    read_input(input_file, &num_samples, &num_sites, &haplotypes, &positions,
-            &recombination_rate);
+
     ret = ancestor_builder_alloc(&ancestor_builder, num_samples, num_sites, 0);
     if (ret != 0) {
         fatal_error("Builder alloc error.");
     }
-    genotypes = malloc(num_sites * sizeof(allele_t));
-    focal_sites = malloc(num_sites * sizeof(site_id_t));
-    if (genotypes == NULL || focal_sites == NULL) {
+    genotypes = malloc(num_samples * sizeof(allele_t));
+    if (genotypes == NULL) {
         fatal_error("Error allocing genotypes");
     }
-
     for (l = 0; l < (site_id_t) num_sites; l++) {
-        /* Copy in the genotypes for this sites */
-        frequency = 0;
-        for (j = 0; j < num_samples; j++) {
-            genotypes[j] = haplotypes[j * num_samples + l];
-            frequency += genotypes[j];
+        if (site_genotypes == NULL) {
+            /* Copy in the genotypes for this site */
+            g = genotypes;
+            frequency = 0;
+            for (j = 0; j < num_samples; j++) {
+                g[j] = haplotypes[j * num_sites + l];
+                frequency += g[j];
+            }
+        } else {
+            /* Each site's genotypes are contiguous in the mapping, so they
+             * can be handed to the builder without copying. */
+            g = site_genotypes + (size_t) l * num_samples;
+            frequency = 0;
+            for (j = 0; j < num_samples; j++) {
+                frequency += g[j];
+            }
         }
-        ret = ancestor_builder_add_site(&ancestor_builder, l, frequency, genotypes);
+        ret = ancestor_builder_add_site(&ancestor_builder, l, frequency, g);
         if (ret != 0) {
             fatal_error("Add site error");
         }
@@ -366,297 +656,1366 @@ run_generate(const char *input_file, int verbose)
     if (ret != 0) {
         fatal_error("builder finalise");
     }
-    ancestor_builder_print_state(&ancestor_builder, stdout);
+    if (verbose > 0) {
+        ancestor_builder_print_state(&ancestor_builder, stdout);
+    }
+    num_ancestors = ancestor_builder.num_ancestors;
 
-    printf("EXITING because rest is broken\n");
-    exit(0);
+    /* The ancestors for a given frequency are independent of each other
+     * given the tree sequence for the older frequency classes, so we can
+     * match each epoch in parallel. */
+    epoch_first = malloc((num_ancestors + 2) * sizeof(size_t));
+    if (epoch_first == NULL) {
+        fatal_error("alloc");
+    }
+    num_epochs = 0;
+    max_epoch_size = 0;
+    epoch_start = 0;
+    while (epoch_start < num_ancestors) {
+        frequency = ancestor_builder.descriptors[epoch_start].frequency;
+        epoch_end = epoch_start;
+        while (epoch_end < num_ancestors
+                && ancestor_builder.descriptors[epoch_end].frequency == frequency) {
+            epoch_end++;
+        }
+        max_epoch_size = TSI_MAX(max_epoch_size, epoch_end - epoch_start);
+        epoch_first[num_epochs] = epoch_start;
+        num_epochs++;
+        epoch_start = epoch_end;
+    }
+    epoch_first[num_epochs] = num_ancestors;
 
-    num_ancestors = ancestor_builder.num_ancestors;
-    ret = tree_sequence_builder_alloc(&ts_builder, num_sites, 10, 10, flags);
+    ret = tree_sequence_builder_alloc(ts_builder, num_sites, 1024, 8192, 0);
     if (ret != 0) {
         fatal_error("alloc error");
     }
-    ret = ancestor_matcher_alloc(&matcher, &ts_builder, 0);
+    ret = match_pool_alloc(&pool, ts_builder, (size_t) num_threads,
+            TSI_MAX(max_epoch_size, num_samples), 0);
     if (ret != 0) {
-        fatal_error("alloc error");
+        fatal_error("match pool alloc error");
     }
-
-    if (verbose > 0) {
-        ancestor_builder_print_state(&ancestor_builder, stdout);
-        /* ancestor_matcher_print_state(&matcher, stdout); */
-    }
-    /* TODO This is all out of date now. Need to rewrite this inferface to
-     * follow the high-level approach of generating ancestors and matching
-     * samples and ancestors. Probably we'll need to map the input file
-     * formats to HDF5 so that we can read them in C
-     * */
-    a = malloc(num_sites * sizeof(allele_t));
-    match = malloc(num_sites * sizeof(allele_t));
-    left_buffer = malloc(max_edges * sizeof(site_id_t));
-    right_buffer = malloc(max_edges * sizeof(site_id_t));
-    parent_buffer = malloc(max_edges * sizeof(node_id_t));
-    child_buffer = malloc(max_edges * sizeof(node_id_t));
-    num_edges_buffer = malloc(max_edges * sizeof(size_t));
-    num_mutations_buffer = malloc(max_edges * sizeof(size_t));
-    node_buffer = malloc(max_mutations * sizeof(node_id_t));
-    derived_state_buffer = malloc(max_mutations * sizeof(allele_t));
-    site_buffer = malloc(max_mutations * sizeof(site_id_t));
-    if (a == NULL || match == NULL || left_buffer == NULL || right_buffer == NULL
-            || parent_buffer == NULL || child_buffer == NULL || node_buffer == NULL
-            || num_edges_buffer == NULL || site_buffer == NULL
-            || derived_state_buffer == NULL) {
+    if (record_prefix != NULL) {
+        /* The sample matching phase is recorded as the final epoch. */
+        record_log = record_open(record_prefix, num_sites, num_epochs + 1);
+    }
+    /* The epoch buffers are doubled so that the next epoch's ancestors can
+     * be generated into one while the other is being matched. */
+    for (buf = 0; buf < 2; buf++) {
+        epoch_ancestors[buf] = malloc(max_epoch_size * num_sites * sizeof(allele_t));
+        epoch_starts[buf] = malloc(max_epoch_size * sizeof(site_id_t));
+        epoch_ends[buf] = malloc(max_epoch_size * sizeof(site_id_t));
+        if (epoch_ancestors[buf] == NULL || epoch_starts[buf] == NULL
+                || epoch_ends[buf] == NULL) {
+            fatal_error("alloc");
+        }
+    }
+    epoch_matches = malloc(max_epoch_size * num_sites * sizeof(allele_t));
+    sample_matches = malloc(num_samples * num_sites * sizeof(allele_t));
+    derived_state = malloc(num_sites * sizeof(allele_t));
+    mutation_sites = malloc(num_sites * sizeof(site_id_t));
+    if (epoch_matches == NULL || sample_matches == NULL
+            || derived_state == NULL || mutation_sites == NULL) {
         fatal_error("alloc");
     }
-    /* Add the ancestor nodes */
-    for (frequency = num_samples; frequency > 0; frequency--) {
-        if (frequency == num_samples) {
-            num_ancestors = 1;
+    /* The derived state for ancestor focal mutations is always 1. */
+    memset(derived_state, 1, num_sites * sizeof(allele_t));
+
+    /* Node 0 is the ultimate ancestor and is never matched against directly;
+     * node 1 is the root ancestor, with zeros at every position, covering the
+     * whole sequence with a single edge to node 0. This mirrors the high-level
+     * matching pipeline and ensures node 0 always has exactly one child. */
+    root_time = num_ancestors == 0 ? 1 :
+            (double) ancestor_builder.descriptors[0].frequency + 1;
+    ret = tree_sequence_builder_add_node(ts_builder, root_time + 1, true);
+    if (ret < 0) {
+        fatal_error("add node");
+    }
+    ret = tree_sequence_builder_add_node(ts_builder, root_time, true);
+    if (ret < 0) {
+        fatal_error("add node");
+    }
+    start = 0;
+    end = (site_id_t) num_sites;
+    child = 0;
+    ret = tree_sequence_builder_add_path(ts_builder, 1, 1, &start, &end,
+            &child, 0);
+    if (ret != 0) {
+        fatal_error("add_path");
+    }
+
+    for (e = 0; e < num_epochs; e++) {
+        epoch_start = epoch_first[e];
+        epoch_end = epoch_first[e + 1];
+        frequency = ancestor_builder.descriptors[epoch_start].frequency;
+        buf = e % 2;
+        /* Collect this epoch's ancestors: the first epoch is generated
+         * here, the rest were generated while the previous epoch was
+         * being matched. They are pure reads of the site data. */
+        if (generator_running) {
+            pthread_join(generator_thread, NULL);
+            generator_running = false;
+            ret = generator.ret;
         } else {
-            num_ancestors =  avl_count(&ancestor_builder.frequency_map[frequency]);
+            ret = ancestor_builder_make_ancestors(&ancestor_builder,
+                    epoch_start, epoch_end, (size_t) num_threads,
+                    epoch_ancestors[buf], epoch_starts[buf], epoch_ends[buf]);
         }
-        for (j = 0; j < num_ancestors; j++) {
-            ret = tree_sequence_builder_add_node(&ts_builder, frequency, true);
-            if (ret < 0) {
-                fatal_error("add node");
+        if (ret != 0) {
+            fatal_error("Error in make ancestors");
+        }
+        /* Start generating the next epoch into the other buffer while this
+         * one is matched. */
+        if (e + 1 < num_epochs) {
+            generator.builder = &ancestor_builder;
+            generator.epoch_start = epoch_first[e + 1];
+            generator.epoch_end = epoch_first[e + 2];
+            generator.num_threads = (size_t) num_threads;
+            generator.ancestors = epoch_ancestors[1 - buf];
+            generator.starts = epoch_starts[1 - buf];
+            generator.ends = epoch_ends[1 - buf];
+            if (pthread_create(&generator_thread, NULL, epoch_generator_worker,
+                    &generator) != 0) {
+                fatal_error("pthread create");
             }
+            generator_running = true;
         }
-    }
-
-    child = 1;
-    for (frequency = num_samples - 1; frequency > 0; frequency--) {
-        num_ancestors =  avl_count(&ancestor_builder.frequency_map[frequency]);
         if (verbose > 0) {
-            printf("Generating for frequency class frequency = %d num_ancestors = %d\n",
-                    (int) frequency, (int) num_ancestors);
-        }
-        /* printf("AGE = %d\n", (int) frequency); */
-        total_edges = 0;
-        total_mutations = 0;
-        j = 0;
-        for (avl_node = ancestor_builder.frequency_map[frequency].head; avl_node != NULL;
-                avl_node = avl_node->next) {
-            map_elem = (pattern_map_t *) avl_node->item;
-            num_focal_sites = map_elem->num_sites;
-            /* The linked list is in reverse order, so insert backwards here */
-            k = num_focal_sites - 1;
-            for (s = map_elem->sites; s != NULL; s = s->next) {
-                focal_sites[k] = s->site;
-                k--;
+            printf("Epoch: frequency = %d num_ancestors = %d\n",
+                    (int) frequency, (int) (epoch_end - epoch_start));
+        }
+        epoch_child = NULL_NODE;
+        for (k = epoch_start; k < epoch_end; k++) {
+            child = tree_sequence_builder_add_node(ts_builder, frequency, true);
+            if (child < 0) {
+                fatal_error("add node");
             }
-            ret = ancestor_builder_make_ancestor(&ancestor_builder, num_focal_sites,
-                    focal_sites, &start, &end, a);
-            if (ret != 0) {
-                fatal_error("Error in make ancestor");
+            if (k == epoch_start) {
+                epoch_child = child;
             }
-            for (l = 0; l < (site_id_t) num_focal_sites; l++) {
-                assert(total_mutations < max_mutations);
-                node_buffer[total_mutations] = child;
-                site_buffer[total_mutations] = focal_sites[l];
-                derived_state_buffer[total_mutations] = 1;
-                total_mutations++;
-                assert(a[focal_sites[l]] == 1);
+        }
+        if (record_log != NULL) {
+            record_snapshot(ts_builder, record_prefix, e);
+        }
+        for (k = epoch_start; k < epoch_end; k++) {
+            a = epoch_ancestors[buf] + (k - epoch_start) * num_sites;
+            match = epoch_matches + (k - epoch_start) * num_sites;
+            if (record_log != NULL) {
+                record_match(record_log, e,
+                        epoch_child + (node_id_t) (k - epoch_start),
+                        epoch_starts[buf][k - epoch_start],
+                        epoch_ends[buf][k - epoch_start], a);
             }
-            ret = ancestor_matcher_find_path(&matcher, start, end, a, match,
-                    &num_edges, &left_output, &right_output, &parent_output);
+            ret = match_pool_submit(&pool, epoch_child + (node_id_t) (k - epoch_start),
+                    epoch_starts[buf][k - epoch_start],
+                    epoch_ends[buf][k - epoch_start],
+                    a, match);
             if (ret != 0) {
-                fatal_error("find_path error");
-            }
-            for (l = 0; l < (site_id_t) num_focal_sites; l++) {
-                a[focal_sites[l]] = 0;
-            }
-            for (l = 0; l < (site_id_t) num_sites; l++) {
-                assert(a[l] == match[l]);
-            }
-            if (total_edges + num_edges > max_edges) {
-                fatal_error("out of edge buffer space\n");
+                fatal_error("match pool submit");
             }
-            memcpy(left_buffer + total_edges, left_output, num_edges * sizeof(site_id_t));
-            memcpy(right_buffer + total_edges, right_output, num_edges * sizeof(site_id_t));
-            memcpy(parent_buffer + total_edges, parent_output, num_edges * sizeof(node_id_t));
-            child_buffer[j] = child;
-            num_edges_buffer[j] = num_edges;
-            num_mutations_buffer[j] = num_focal_sites;
-            total_edges += num_edges;
-
-            if (verbose > 0) {
-                printf("ancestor %d:\t", (int) child);
-                for (l = 0; l < (site_id_t) num_sites; l++) {
-                    if (a[l] == -1) {
-                        assert(l < start || l >= end);
-                        printf("*");
-                    } else {
-                        assert(l >= start && l < end);
-                        printf("%d", a[l]);
-                    }
-                }
-                printf("\n");
-                printf("\tnum_focal=%d, start=%d, end=%d", (int) num_focal_sites, start, end);
-                printf("\tedges = (%d):: \n", (int) num_edges);
-                for (l = 0; l < (int) num_edges; l++) {
-                    printf("\t(%d, %d, %d, %d)\n", left_output[l], right_output[l],
-                            parent_output[l], child);
-                }
-            }
-            j++;
-            child++;
-        }
-
-        edge_offset = 0;
-        mutation_offset = 0;
-        for (j = 0; j < num_ancestors; j++) {
-            /* tree_sequence_builder_print_state(&ts_builder, stdout); */
-            ret = tree_sequence_builder_add_path(&ts_builder, child_buffer[j],
-                    num_edges_buffer[j], left_buffer + edge_offset,
-                    right_buffer + edge_offset, parent_buffer + edge_offset,
-                    TSI_COMPRESS_PATH);
+        }
+        ret = match_pool_run(&pool, TSI_COMPRESS_PATH);
+        if (ret != 0) {
+            fatal_error("match pool run");
+        }
+        for (k = epoch_start; k < epoch_end; k++) {
+            descriptor = ancestor_builder.descriptors + k;
+            ret = tree_sequence_builder_add_mutations(ts_builder,
+                    epoch_child + (node_id_t) (k - epoch_start),
+                    descriptor->num_focal_sites, descriptor->focal_sites,
+                    derived_state);
             if (ret != 0) {
-                fatal_error("add_path");
+                fatal_error("add_mutations");
             }
-            edge_offset += num_edges_buffer[j];
-            ret = tree_sequence_builder_add_mutations(&ts_builder, child_buffer[j],
-                    num_mutations_buffer[j], site_buffer + mutation_offset,
-                    derived_state_buffer + mutation_offset);
-            if (ret != 0) {
-                fatal_error("add_path");
+        }
+    }
+
+    /* Now match the samples against the final tree sequence. */
+    sample_child = NULL_NODE;
+    for (j = 0; j < num_samples; j++) {
+        child = tree_sequence_builder_add_node(ts_builder, 0, true);
+        if (child < 0) {
+            fatal_error("add node");
+        }
+        if (j == 0) {
+            sample_child = child;
+        }
+    }
+    if (record_log != NULL) {
+        record_snapshot(ts_builder, record_prefix, num_epochs);
+    }
+    for (j = 0; j < num_samples; j++) {
+        if (record_log != NULL) {
+            record_match(record_log, num_epochs, sample_child + (node_id_t) j,
+                    0, (site_id_t) num_sites, haplotypes + j * num_sites);
+        }
+        ret = match_pool_submit(&pool, sample_child + (node_id_t) j,
+                0, num_sites, haplotypes + j * num_sites,
+                sample_matches + j * num_sites);
+        if (ret != 0) {
+            fatal_error("match pool submit");
+        }
+    }
+    /* The tree sequence is frozen during sample matching, so we can carry
+     * a batch of haplotypes through each tree sweep. */
+    ret = match_pool_run_batched(&pool, TSI_COMPRESS_PATH, (size_t) batch_size);
+    if (ret != 0) {
+        fatal_error("match pool run");
+    }
+    for (j = 0; j < num_samples; j++) {
+        a = haplotypes + j * num_sites;
+        match = sample_matches + j * num_sites;
+        num_mutations = 0;
+        for (l = 0; l < (site_id_t) num_sites; l++) {
+            if (a[l] != match[l]) {
+                mutation_sites[num_mutations] = l;
+                derived_state[num_mutations] = a[l];
+                num_mutations++;
+            }
+        }
+        ret = tree_sequence_builder_add_mutations(ts_builder,
+                sample_child + (node_id_t) j, num_mutations, mutation_sites,
+                derived_state);
+        if (ret != 0) {
+            fatal_error("add_mutations");
+        }
+        /* Restore the derived state buffer for the next sample. */
+        memset(derived_state, 1, num_mutations * sizeof(allele_t));
+    }
+
+    if (record_log != NULL && fclose(record_log) != 0) {
+        fatal_error("Error writing record log: %s", strerror(errno));
+    }
+
+    ancestor_builder_free(&ancestor_builder);
+    match_pool_free(&pool);
+    tsi_safe_free(genotypes);
+    for (buf = 0; buf < 2; buf++) {
+        tsi_safe_free(epoch_ancestors[buf]);
+        tsi_safe_free(epoch_starts[buf]);
+        tsi_safe_free(epoch_ends[buf]);
+    }
+    tsi_safe_free(epoch_matches);
+    tsi_safe_free(sample_matches);
+    tsi_safe_free(derived_state);
+    tsi_safe_free(mutation_sites);
+    tsi_safe_free(epoch_first);
+    return sample_child;
+}
+
+static void
+run_generate(const char *input_file, int verbose, int num_threads,
+        int batch_size, const char *output_file, const char *record_prefix)
+{
+    size_t num_samples, num_sites, j;
+    allele_t *haplotypes = NULL;
+    allele_t *site_genotypes = NULL;
+    void *mapping = NULL;
+    size_t mapping_size = 0;
+    double *positions = NULL;
+    double *recombination_rate = NULL;
+    site_id_t l;
+    tree_sequence_builder_t ts_builder;
+
+    if (is_native_file(input_file)) {
+        /* The genotype matrix is read directly from the page cache; no
+         * parsing or copying happens at startup. */
+        read_native_input(input_file, &num_samples, &num_sites, &site_genotypes,
+                &positions, &recombination_rate, &mapping, &mapping_size);
+        /* Sample matching needs the haplotypes in sample-major order. */
+        haplotypes = malloc(num_samples * num_sites * sizeof(allele_t));
+        if (haplotypes == NULL) {
+            fatal_error("malloc failure");
+        }
+        for (l = 0; l < (site_id_t) num_sites; l++) {
+            for (j = 0; j < num_samples; j++) {
+                haplotypes[j * num_sites + l] = site_genotypes[l * num_samples + j];
             }
-            mutation_offset += num_mutations_buffer[j];
         }
+    } else {
+        read_input(input_file, &num_samples, &num_sites, &haplotypes, &positions,
+                &recombination_rate);
+    }
+    infer_tree_sequence(&ts_builder, haplotypes, site_genotypes, num_samples,
+            num_sites, verbose, num_threads, batch_size, record_prefix);
+
+    if (output_file == NULL) {
+        output_ts(&ts_builder);
+    } else {
+        output_ts_binary(&ts_builder, output_file);
+    }
+
+    tree_sequence_builder_free(&ts_builder);
+    if (mapping != NULL) {
+        /* positions and recombination_rate point into the mapping. */
+        munmap(mapping, mapping_size);
+        positions = NULL;
+        recombination_rate = NULL;
+    }
+    tsi_safe_free(haplotypes);
+    tsi_safe_free(positions);
+    tsi_safe_free(recombination_rate);
+}
+
+static int
+cmp_stitched_edge(const void *a, const void *b)
+{
+    const indexed_edge_t *ea = (const indexed_edge_t *) a;
+    const indexed_edge_t *eb = (const indexed_edge_t *) b;
+    int ret = (ea->child > eb->child) - (ea->child < eb->child);
+    if (ret == 0) {
+        ret = (ea->left > eb->left) - (ea->left < eb->left);
+    }
+    return ret;
+}
+
+/* Partitions the site range into windows and runs an independent
+ * inference pipeline per window, so the matcher arrays and tracebacks
+ * are sized by the window rather than the chromosome. Each window is
+ * inferred over its core sites plus an overlap margin on either side, so
+ * the paths crossing a boundary are chosen with context from both sides;
+ * the resulting edges are then clipped back to the core. The per-window
+ * tables are stitched into one: ancestors stay private to their window,
+ * while the per-window sample nodes are merged onto a single set of
+ * global sample ids, whose clipped paths abut exactly at the window
+ * boundaries. The stitched tables are rebuilt through the restore
+ * pathway, which validates them and reuses the standard writers. */
+static void
+run_generate_windowed(const char *input_file, int verbose, int num_threads,
+        int batch_size, const char *output_file, int num_windows)
+{
+    size_t num_samples, num_sites, j;
+    allele_t *haplotypes = NULL;
+    allele_t *site_genotypes = NULL;
+    void *mapping = NULL;
+    size_t mapping_size = 0;
+    double *positions = NULL;
+    double *recombination_rate = NULL;
+    site_id_t l;
+    tree_sequence_builder_t ts_builder;
+    allele_t *window_haplotypes = NULL;
+    allele_t *window_site_genotypes;
+    size_t core_lo, core_hi, ext_lo, ext_hi, overlap, width, w;
+    size_t num_nodes, num_edges, num_mutations;
+    size_t total_nodes, total_edges, total_mutations;
+    size_t max_nodes, max_edges, max_mutations;
+    uint32_t *flags = NULL;
+    double *time = NULL;
+    site_id_t *left = NULL;
+    site_id_t *right = NULL;
+    node_id_t *parent = NULL;
+    node_id_t *children = NULL;
+    site_id_t *site = NULL;
+    node_id_t *node = NULL;
+    allele_t *derived_state = NULL;
+    mutation_id_t *mutation_parent = NULL;
+    uint32_t *all_flags = NULL;
+    double *all_time = NULL;
+    indexed_edge_t *all_edges = NULL;
+    site_id_t *all_site = NULL;
+    node_id_t *all_node = NULL;
+    allele_t *all_derived = NULL;
+    node_id_t node_base, sample_child, u, v;
+    site_id_t e_left, e_right;
+    int ret;
+
+    if (is_native_file(input_file)) {
+        read_native_input(input_file, &num_samples, &num_sites, &site_genotypes,
+                &positions, &recombination_rate, &mapping, &mapping_size);
+    } else {
+        read_input(input_file, &num_samples, &num_sites, &haplotypes, &positions,
+                &recombination_rate);
     }
+    num_windows = TSI_MIN(num_windows, (int) num_sites);
+    /* The overlap gives boundary-crossing paths some context from the
+     * neighbouring window before they are clipped back to the core. */
+    overlap = (num_sites / (size_t) num_windows) / 8;
 
+    max_nodes = 1024;
+    max_edges = 1024;
+    max_mutations = 1024;
+    all_flags = malloc(max_nodes * sizeof(uint32_t));
+    all_time = malloc(max_nodes * sizeof(double));
+    all_edges = malloc(max_edges * sizeof(indexed_edge_t));
+    all_site = malloc(max_mutations * sizeof(site_id_t));
+    all_node = malloc(max_mutations * sizeof(node_id_t));
+    all_derived = malloc(max_mutations * sizeof(allele_t));
+    window_haplotypes = malloc(num_samples * num_sites * sizeof(allele_t));
+    if (all_flags == NULL || all_time == NULL || all_edges == NULL
+            || all_site == NULL || all_node == NULL || all_derived == NULL
+            || window_haplotypes == NULL) {
+        fatal_error("alloc");
+    }
+    total_nodes = 0;
     total_edges = 0;
     total_mutations = 0;
-    /* Copy samples */
-    for (j = 0; j < num_samples; j++) {
-        sample = haplotypes + j * num_sites;
-        child = ts_builder.num_nodes + j;
-        ret = ancestor_matcher_find_path(&matcher, 0, num_sites, sample, match,
-                &num_edges, &left_output, &right_output, &parent_output);
+    node_base = 0;
+
+    for (w = 0; w < (size_t) num_windows; w++) {
+        core_lo = w * num_sites / (size_t) num_windows;
+        core_hi = (w + 1) * num_sites / (size_t) num_windows;
+        ext_lo = core_lo > overlap ? core_lo - overlap : 0;
+        ext_hi = TSI_MIN(core_hi + overlap, num_sites);
+        width = ext_hi - ext_lo;
+        if (verbose > 0) {
+            printf("Window %d: core [%d, %d) extended [%d, %d)\n", (int) w,
+                    (int) core_lo, (int) core_hi, (int) ext_lo, (int) ext_hi);
+        }
+        /* Gather the window's haplotypes into a compact sample-major
+         * matrix; the site-major genotypes can be sliced in place. */
+        for (j = 0; j < num_samples; j++) {
+            for (l = 0; l < (site_id_t) width; l++) {
+                window_haplotypes[j * width + (size_t) l] =
+                    site_genotypes != NULL
+                    ? site_genotypes[(ext_lo + (size_t) l) * num_samples + j]
+                    : haplotypes[j * num_sites + ext_lo + (size_t) l];
+            }
+        }
+        window_site_genotypes = site_genotypes == NULL ? NULL
+            : site_genotypes + ext_lo * num_samples;
+        sample_child = infer_tree_sequence(&ts_builder, window_haplotypes,
+                window_site_genotypes, num_samples, width, verbose,
+                num_threads, batch_size, NULL);
+
+        num_nodes = tree_sequence_builder_get_num_nodes(&ts_builder);
+        num_edges = tree_sequence_builder_get_num_edges(&ts_builder);
+        num_mutations = tree_sequence_builder_get_num_mutations(&ts_builder);
+        flags = malloc(num_nodes * sizeof(uint32_t));
+        time = malloc(num_nodes * sizeof(double));
+        left = malloc(num_edges * sizeof(site_id_t));
+        right = malloc(num_edges * sizeof(site_id_t));
+        parent = malloc(num_edges * sizeof(node_id_t));
+        children = malloc(num_edges * sizeof(node_id_t));
+        site = malloc(num_mutations * sizeof(site_id_t));
+        node = malloc(num_mutations * sizeof(node_id_t));
+        derived_state = malloc(num_mutations * sizeof(allele_t));
+        mutation_parent = malloc(num_mutations * sizeof(mutation_id_t));
+        if (flags == NULL || time == NULL || left == NULL || right == NULL
+                || parent == NULL || children == NULL || site == NULL
+                || node == NULL || derived_state == NULL
+                || mutation_parent == NULL) {
+            fatal_error("alloc");
+        }
+        ret = tree_sequence_builder_dump_nodes(&ts_builder, flags, time);
         if (ret != 0) {
-            fatal_error("find_path error");
+            fatal_error("dump error");
         }
-        if (verbose > 0) {
-            printf("sample %d:\t", (int) child);
-            for (l = 0; l < (site_id_t) num_sites; l++) {
-                printf("%d", sample[l]);
+        ret = tree_sequence_builder_dump_edges(&ts_builder, left, right,
+                parent, children);
+        if (ret != 0) {
+            fatal_error("dump error");
+        }
+        ret = tree_sequence_builder_dump_mutations(&ts_builder, site, node,
+                derived_state, mutation_parent);
+        if (ret != 0) {
+            fatal_error("dump error");
+        }
+        tree_sequence_builder_free(&ts_builder);
+
+        while (total_nodes + num_nodes > max_nodes) {
+            max_nodes *= 2;
+            all_flags = realloc(all_flags, max_nodes * sizeof(uint32_t));
+            all_time = realloc(all_time, max_nodes * sizeof(double));
+            if (all_flags == NULL || all_time == NULL) {
+                fatal_error("alloc");
             }
-            printf("\nmatch = \t");
-            for (l = 0; l < (site_id_t) num_sites; l++) {
-                printf("%d", match[l]);
+        }
+        while (total_edges + num_edges > max_edges) {
+            max_edges *= 2;
+            all_edges = realloc(all_edges, max_edges * sizeof(indexed_edge_t));
+            if (all_edges == NULL) {
+                fatal_error("alloc");
             }
-            printf("\n");
         }
-        num_mutations_buffer[j] = 0;
-        for (l = 0; l < (site_id_t) num_sites; l++) {
-            if (sample[l] != match[l]) {
-                assert(total_mutations < max_mutations);
-                node_buffer[total_mutations] = child;
-                site_buffer[total_mutations] = l;
-                derived_state_buffer[total_mutations] = sample[l];
-                total_mutations++;
-                num_mutations_buffer[j]++;
+        while (total_mutations + num_mutations > max_mutations) {
+            max_mutations *= 2;
+            all_site = realloc(all_site, max_mutations * sizeof(site_id_t));
+            all_node = realloc(all_node, max_mutations * sizeof(node_id_t));
+            all_derived = realloc(all_derived,
+                    max_mutations * sizeof(allele_t));
+            if (all_site == NULL || all_node == NULL || all_derived == NULL) {
+                fatal_error("alloc");
             }
         }
+        /* The window's sample nodes are merged onto the shared global
+         * sample ids, which are only known once every window's private
+         * nodes have been counted; they are marked with negative ids and
+         * patched afterwards. Private node ids are shifted to close the
+         * gap the samples leave behind. */
+        for (j = 0; j < num_nodes; j++) {
+            if ((node_id_t) j >= sample_child
+                    && (node_id_t) j < sample_child + (node_id_t) num_samples) {
+                continue;
+            }
+            u = (node_id_t) j < sample_child ? (node_id_t) j
+                : (node_id_t) j - (node_id_t) num_samples;
+            all_flags[total_nodes + (size_t) u] = flags[j];
+            all_time[total_nodes + (size_t) u] = time[j];
+        }
+        for (j = 0; j < num_edges; j++) {
+            e_left = left[j] + (site_id_t) ext_lo;
+            e_right = right[j] + (site_id_t) ext_lo;
+            if (e_left >= (site_id_t) core_hi || e_right <= (site_id_t) core_lo) {
+                continue;
+            }
+            e_left = TSI_MAX(e_left, (site_id_t) core_lo);
+            e_right = TSI_MIN(e_right, (site_id_t) core_hi);
+            u = children[j] >= sample_child
+                    && children[j] < sample_child + (node_id_t) num_samples
+                ? -(children[j] - sample_child) - 1
+                : node_base + (children[j] < sample_child ? children[j]
+                        : children[j] - (node_id_t) num_samples);
+            v = parent[j] >= sample_child
+                    && parent[j] < sample_child + (node_id_t) num_samples
+                ? -(parent[j] - sample_child) - 1
+                : node_base + (parent[j] < sample_child ? parent[j]
+                        : parent[j] - (node_id_t) num_samples);
+            all_edges[total_edges].left = e_left;
+            all_edges[total_edges].right = e_right;
+            all_edges[total_edges].parent = v;
+            all_edges[total_edges].child = u;
+            total_edges++;
+        }
+        for (j = 0; j < num_mutations; j++) {
+            if (site[j] + (site_id_t) ext_lo < (site_id_t) core_lo
+                    || site[j] + (site_id_t) ext_lo >= (site_id_t) core_hi) {
+                continue;
+            }
+            u = node[j] >= sample_child
+                    && node[j] < sample_child + (node_id_t) num_samples
+                ? -(node[j] - sample_child) - 1
+                : node_base + (node[j] < sample_child ? node[j]
+                        : node[j] - (node_id_t) num_samples);
+            all_site[total_mutations] = site[j] + (site_id_t) ext_lo;
+            all_node[total_mutations] = u;
+            all_derived[total_mutations] = derived_state[j];
+            total_mutations++;
+        }
+        total_nodes += num_nodes - num_samples;
+        node_base = (node_id_t) total_nodes;
+        free(flags);
+        free(time);
+        free(left);
+        free(right);
+        free(parent);
+        free(children);
+        free(site);
+        free(node);
+        free(derived_state);
+        free(mutation_parent);
+    }
 
-        if (total_edges + num_edges > max_edges) {
-            fatal_error("out of edge buffer space\n");
+    /* Patch the sample markers now that the private node count is known
+     * and append the shared sample nodes at the end of the table. */
+    for (j = 0; j < total_edges; j++) {
+        if (all_edges[j].child < 0) {
+            all_edges[j].child = node_base - all_edges[j].child - 1;
         }
-        memcpy(left_buffer + total_edges, left_output, num_edges * sizeof(site_id_t));
-        memcpy(right_buffer + total_edges, right_output, num_edges * sizeof(site_id_t));
-        memcpy(parent_buffer + total_edges, parent_output, num_edges * sizeof(site_id_t));
-        child_buffer[j] = child;
-        num_edges_buffer[j] = num_edges;
-        total_edges += num_edges;
+        if (all_edges[j].parent < 0) {
+            all_edges[j].parent = node_base - all_edges[j].parent - 1;
+        }
+    }
+    for (j = 0; j < total_mutations; j++) {
+        if (all_node[j] < 0) {
+            all_node[j] = node_base - all_node[j] - 1;
+        }
+    }
+    while (total_nodes + num_samples > max_nodes) {
+        max_nodes *= 2;
+        all_flags = realloc(all_flags, max_nodes * sizeof(uint32_t));
+        all_time = realloc(all_time, max_nodes * sizeof(double));
+        if (all_flags == NULL || all_time == NULL) {
+            fatal_error("alloc");
+        }
+    }
+    for (j = 0; j < num_samples; j++) {
+        all_flags[total_nodes + j] = 1;
+        all_time[total_nodes + j] = 0;
+    }
+    total_nodes += num_samples;
+    qsort(all_edges, total_edges, sizeof(indexed_edge_t), cmp_stitched_edge);
+
+    /* Rebuild the stitched tables through the restore pathway, which
+     * validates them and gives us the standard output writers. */
+    left = malloc(TSI_MAX(total_edges, 1) * sizeof(site_id_t));
+    right = malloc(TSI_MAX(total_edges, 1) * sizeof(site_id_t));
+    parent = malloc(TSI_MAX(total_edges, 1) * sizeof(node_id_t));
+    children = malloc(TSI_MAX(total_edges, 1) * sizeof(node_id_t));
+    if (left == NULL || right == NULL || parent == NULL || children == NULL) {
+        fatal_error("alloc");
+    }
+    for (j = 0; j < total_edges; j++) {
+        left[j] = all_edges[j].left;
+        right[j] = all_edges[j].right;
+        parent[j] = all_edges[j].parent;
+        children[j] = all_edges[j].child;
+    }
+    ret = tree_sequence_builder_alloc(&ts_builder, num_sites, 1024, 8192, 0);
+    if (ret != 0) {
+        fatal_error("alloc error");
+    }
+    ret = tree_sequence_builder_restore_nodes(&ts_builder, total_nodes,
+            all_flags, all_time);
+    if (ret != 0) {
+        fatal_error("restore nodes");
+    }
+    ret = tree_sequence_builder_restore_edges(&ts_builder, total_edges, left,
+            right, parent, children);
+    if (ret != 0) {
+        fatal_error("restore edges");
+    }
+    ret = tree_sequence_builder_restore_mutations(&ts_builder, total_mutations,
+            all_site, all_node, all_derived);
+    if (ret != 0) {
+        fatal_error("restore mutations");
+    }
+    if (output_file == NULL) {
+        output_ts(&ts_builder);
+    } else {
+        output_ts_binary(&ts_builder, output_file);
+    }
+
+    tree_sequence_builder_free(&ts_builder);
+    if (mapping != NULL) {
+        /* positions and recombination_rate point into the mapping. */
+        munmap(mapping, mapping_size);
+        positions = NULL;
+        recombination_rate = NULL;
+    }
+    tsi_safe_free(haplotypes);
+    tsi_safe_free(positions);
+    tsi_safe_free(recombination_rate);
+    tsi_safe_free(window_haplotypes);
+    free(all_flags);
+    free(all_time);
+    free(all_edges);
+    free(all_site);
+    free(all_node);
+    free(all_derived);
+    free(left);
+    free(right);
+    free(parent);
+    free(children);
+}
 
-        /* printf("COPIED SAMPLE %d->%d\n", (int) j, (int) sample_id); */
-        /* tree_sequence_builder_print_state(&ts_builder, stdout); */
+/* Loads a binary result file written by output_ts_binary back into a
+ * freshly allocated builder through the restore pathway. The dump
+ * functions emit edges grouped by child with each path left-to-right,
+ * which is exactly the order restore_edges requires. */
+static void
+restore_result(tree_sequence_builder_t *ts_builder, const char *result_file,
+        size_t num_sites)
+{
+    result_header_t header;
+    uint32_t *flags = NULL;
+    double *time = NULL;
+    site_id_t *left = NULL;
+    site_id_t *right = NULL;
+    ancestor_id_t *parent = NULL;
+    ancestor_id_t *children = NULL;
+    site_id_t *site = NULL;
+    ancestor_id_t *node = NULL;
+    allele_t *derived_state = NULL;
+    mutation_id_t *mutation_parent = NULL;
+    size_t num_nodes, num_edges, num_mutations, j;
+    FILE *f;
+    int ret;
+
+    f = fopen(result_file, "rb");
+    if (f == NULL) {
+        fatal_error("Error opening '%s': %s", result_file, strerror(errno));
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1) {
+        fatal_error("Error reading '%s': %s", result_file, strerror(errno));
+    }
+    if (header.magic != RESULT_MAGIC || header.version != RESULT_VERSION) {
+        fatal_error("'%s' is not a binary result file", result_file);
+    }
+    num_nodes = header.num_nodes;
+    num_edges = header.num_edges;
+    num_mutations = header.num_mutations;
+    flags = malloc(num_nodes * sizeof(uint32_t));
+    time = malloc(num_nodes * sizeof(double));
+    left = malloc(num_edges * sizeof(site_id_t));
+    right = malloc(num_edges * sizeof(site_id_t));
+    parent = malloc(num_edges * sizeof(ancestor_id_t));
+    children = malloc(num_edges * sizeof(ancestor_id_t));
+    site = malloc(num_mutations * sizeof(site_id_t));
+    node = malloc(num_mutations * sizeof(ancestor_id_t));
+    derived_state = malloc(num_mutations * sizeof(allele_t));
+    mutation_parent = malloc(num_mutations * sizeof(mutation_id_t));
+    if (flags == NULL || time == NULL
+            || left == NULL || right == NULL || parent == NULL
+            || children == NULL || site == NULL || node == NULL
+            || derived_state == NULL || mutation_parent == NULL) {
+        fatal_error("malloc error\n");
+    }
+    if (fread(flags, sizeof(uint32_t), num_nodes, f) != num_nodes
+            || fread(time, sizeof(double), num_nodes, f) != num_nodes
+            || fread(left, sizeof(site_id_t), num_edges, f) != num_edges
+            || fread(right, sizeof(site_id_t), num_edges, f) != num_edges
+            || fread(parent, sizeof(ancestor_id_t), num_edges, f) != num_edges
+            || fread(children, sizeof(ancestor_id_t), num_edges, f) != num_edges
+            || fread(site, sizeof(site_id_t), num_mutations, f) != num_mutations
+            || fread(node, sizeof(ancestor_id_t), num_mutations, f)
+                != num_mutations
+            || fread(derived_state, sizeof(allele_t), num_mutations, f)
+                != num_mutations
+            || fread(mutation_parent, sizeof(mutation_id_t), num_mutations, f)
+                != num_mutations) {
+        fatal_error("Error reading '%s': %s", result_file, strerror(errno));
+    }
+    fclose(f);
+    for (j = 0; j < num_edges; j++) {
+        if (right[j] > (site_id_t) num_sites) {
+            fatal_error("'%s' does not match the input: edge beyond the "
+                    "last site", result_file);
+        }
+    }
+    ret = tree_sequence_builder_restore_nodes(ts_builder, num_nodes, flags,
+            time);
+    if (ret != 0) {
+        fatal_error("restore nodes");
     }
+    ret = tree_sequence_builder_restore_edges(ts_builder, num_edges, left,
+            right, parent, children);
+    if (ret != 0) {
+        fatal_error("restore edges");
+    }
+    ret = tree_sequence_builder_restore_mutations(ts_builder, num_mutations,
+            site, node, derived_state);
+    if (ret != 0) {
+        fatal_error("restore mutations");
+    }
+    free(flags);
+    free(time);
+    free(left);
+    free(right);
+    free(parent);
+    free(children);
+    free(site);
+    free(node);
+    free(derived_state);
+    free(mutation_parent);
+}
+
+/* Restores a previously inferred tree sequence and matches a new batch of
+ * sample haplotypes against it, so a grown cohort can be updated
+ * incrementally instead of redoing the whole inference. The input file
+ * holds only the new samples and must share the sites of the original
+ * run; the ancestor set is unchanged. */
+static void
+run_append(const char *result_file, const char *input_file, int verbose,
+        int num_threads, int batch_size, const char *output_file)
+{
+    size_t num_samples, num_sites, j, num_mutations;
+    allele_t *haplotypes = NULL;
+    allele_t *site_genotypes = NULL;
+    void *mapping = NULL;
+    size_t mapping_size = 0;
+    double *positions = NULL;
+    double *recombination_rate = NULL;
+    site_id_t l;
+    tree_sequence_builder_t ts_builder;
+    match_pool_t pool;
+    allele_t *a, *match;
+    allele_t *sample_matches = NULL;
+    allele_t *derived_state = NULL;
+    site_id_t *mutation_sites = NULL;
+    node_id_t child, sample_child;
+    double sample_time;
+    int ret;
 
+    if (is_native_file(input_file)) {
+        read_native_input(input_file, &num_samples, &num_sites, &site_genotypes,
+                &positions, &recombination_rate, &mapping, &mapping_size);
+        /* Sample matching needs the haplotypes in sample-major order. */
+        haplotypes = malloc(num_samples * num_sites * sizeof(allele_t));
+        if (haplotypes == NULL) {
+            fatal_error("malloc failure");
+        }
+        for (l = 0; l < (site_id_t) num_sites; l++) {
+            for (j = 0; j < num_samples; j++) {
+                haplotypes[j * num_sites + l] = site_genotypes[l * num_samples + j];
+            }
+        }
+    } else {
+        read_input(input_file, &num_samples, &num_sites, &haplotypes, &positions,
+                &recombination_rate);
+    }
+    ret = tree_sequence_builder_alloc(&ts_builder, num_sites, 1024, 8192, 0);
+    if (ret != 0) {
+        fatal_error("alloc error");
+    }
+    restore_result(&ts_builder, result_file, num_sites);
+    if (verbose > 0) {
+        printf("Restored %d nodes %d edges %d mutations; appending %d samples\n",
+                (int) tree_sequence_builder_get_num_nodes(&ts_builder),
+                (int) tree_sequence_builder_get_num_edges(&ts_builder),
+                (int) tree_sequence_builder_get_num_mutations(&ts_builder),
+                (int) num_samples);
+    }
+    ret = match_pool_alloc(&pool, &ts_builder, (size_t) num_threads,
+            TSI_MAX(num_samples, 1), 0);
+    if (ret != 0) {
+        fatal_error("match pool alloc error");
+    }
+    sample_matches = malloc(TSI_MAX(num_samples, 1) * num_sites * sizeof(allele_t));
+    derived_state = malloc(num_sites * sizeof(allele_t));
+    mutation_sites = malloc(num_sites * sizeof(site_id_t));
+    if (sample_matches == NULL || derived_state == NULL
+            || mutation_sites == NULL) {
+        fatal_error("alloc");
+    }
+    memset(derived_state, 1, num_sites * sizeof(allele_t));
 
+    /* The new samples may copy from any restored node, including the
+     * previously inferred samples, so they must be strictly younger than
+     * everything in the restored tree sequence. */
+    sample_time = 0;
+    for (j = 0; j < tree_sequence_builder_get_num_nodes(&ts_builder); j++) {
+        sample_time = TSI_MIN(sample_time, ts_builder.time[j]);
+    }
+    sample_time -= 1;
+    sample_child = NULL_NODE;
     for (j = 0; j < num_samples; j++) {
-        ret = tree_sequence_builder_add_node(&ts_builder, 0, true);
-        if (ret < 0) {
+        child = tree_sequence_builder_add_node(&ts_builder, sample_time, true);
+        if (child < 0) {
             fatal_error("add node");
         }
+        if (j == 0) {
+            sample_child = child;
+        }
     }
-
-    edge_offset = 0;
-    mutation_offset = 0;
     for (j = 0; j < num_samples; j++) {
-        ret = tree_sequence_builder_add_path(&ts_builder, child_buffer[j],
-                num_edges_buffer[j], left_buffer + edge_offset,
-                right_buffer + edge_offset, parent_buffer + edge_offset,
-                TSI_COMPRESS_PATH);
+        ret = match_pool_submit(&pool, sample_child + (node_id_t) j,
+                0, num_sites, haplotypes + j * num_sites,
+                sample_matches + j * num_sites);
         if (ret != 0) {
-            fatal_error("add_path");
+            fatal_error("match pool submit");
         }
-        edge_offset += num_edges_buffer[j];
-        ret = tree_sequence_builder_add_mutations(&ts_builder, child_buffer[j],
-                num_mutations_buffer[j], site_buffer + mutation_offset,
-                derived_state_buffer + mutation_offset);
+    }
+    /* The restored tree sequence is frozen during matching, exactly as in
+     * the sample phase of a full run. */
+    ret = match_pool_run_batched(&pool, TSI_COMPRESS_PATH, (size_t) batch_size);
+    if (ret != 0) {
+        fatal_error("match pool run");
+    }
+    for (j = 0; j < num_samples; j++) {
+        a = haplotypes + j * num_sites;
+        match = sample_matches + j * num_sites;
+        num_mutations = 0;
+        for (l = 0; l < (site_id_t) num_sites; l++) {
+            if (a[l] != match[l]) {
+                mutation_sites[num_mutations] = l;
+                derived_state[num_mutations] = a[l];
+                num_mutations++;
+            }
+        }
+        ret = tree_sequence_builder_add_mutations(&ts_builder,
+                sample_child + (node_id_t) j, num_mutations, mutation_sites,
+                derived_state);
         if (ret != 0) {
-            fatal_error("add_path");
+            fatal_error("add_mutations");
         }
-        mutation_offset += num_mutations_buffer[j];
+        memset(derived_state, 1, num_mutations * sizeof(allele_t));
     }
 
-    if (1) {
+    if (output_file == NULL) {
         output_ts(&ts_builder);
+    } else {
+        output_ts_binary(&ts_builder, output_file);
     }
 
-
-    ancestor_builder_free(&ancestor_builder);
     tree_sequence_builder_free(&ts_builder);
-    ancestor_matcher_free(&matcher);
-    tsi_safe_free(genotypes);
-    tsi_safe_free(focal_sites);
+    match_pool_free(&pool);
+    if (mapping != NULL) {
+        /* positions and recombination_rate point into the mapping. */
+        munmap(mapping, mapping_size);
+        positions = NULL;
+        recombination_rate = NULL;
+    }
     tsi_safe_free(haplotypes);
     tsi_safe_free(positions);
     tsi_safe_free(recombination_rate);
-    tsi_safe_free(a);
-    tsi_safe_free(match);
-    tsi_safe_free(left_buffer);
-    tsi_safe_free(right_buffer);
-    tsi_safe_free(parent_buffer);
-    tsi_safe_free(child_buffer);
-    tsi_safe_free(num_edges_buffer);
-    tsi_safe_free(num_mutations_buffer);
-    tsi_safe_free(node_buffer);
-    tsi_safe_free(site_buffer);
-    tsi_safe_free(derived_state_buffer);
+    tsi_safe_free(sample_matches);
+    tsi_safe_free(derived_state);
+    tsi_safe_free(mutation_sites);
+}
+
+/* Schedules several chromosomes over one shared pool of worker slots.
+ * Inputs are claimed largest first, so a worker that finishes a small
+ * chromosome immediately packs the next one in alongside whatever large
+ * ones are still running, instead of every process sizing itself for the
+ * worst case. The optional memory budget is enforced by admission
+ * control: a claimed job waits until the estimated footprints of the
+ * running jobs leave room for it. A job larger than the whole budget
+ * runs alone, so progress is always guaranteed. */
+typedef struct {
+    int num_inputs;
+    const char **input_files;
+    size_t *estimates;
+    int *order;
+    int next;
+    size_t memory_budget;
+    size_t memory_used;
+    int verbose;
+    int job_threads;
+    int batch_size;
+    const char *output_file;
+    const char *record_prefix;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} chromosome_scheduler_t;
+
+static void *
+chromosome_scheduler_worker(void *arg)
+{
+    chromosome_scheduler_t *sched = (chromosome_scheduler_t *) arg;
+    char output_file[1024], record_prefix[1024];
+    const char *output = NULL;
+    const char *record = NULL;
+    size_t estimate;
+    int j;
+
+    while (true) {
+        pthread_mutex_lock(&sched->mutex);
+        if (sched->next == sched->num_inputs) {
+            pthread_mutex_unlock(&sched->mutex);
+            break;
+        }
+        j = sched->order[sched->next];
+        sched->next++;
+        estimate = sched->estimates[j];
+        while (sched->memory_budget != 0 && sched->memory_used > 0
+                && sched->memory_used + estimate > sched->memory_budget) {
+            pthread_cond_wait(&sched->cond, &sched->mutex);
+        }
+        sched->memory_used += estimate;
+        pthread_mutex_unlock(&sched->mutex);
+
+        if (sched->output_file != NULL) {
+            snprintf(output_file, sizeof(output_file), "%s.%d",
+                    sched->output_file, j);
+            output = output_file;
+        }
+        if (sched->record_prefix != NULL) {
+            snprintf(record_prefix, sizeof(record_prefix), "%s.%d",
+                    sched->record_prefix, j);
+            record = record_prefix;
+        }
+        if (sched->verbose > 0) {
+            printf("Starting '%s'\n", sched->input_files[j]);
+        }
+        run_generate(sched->input_files[j], sched->verbose,
+                sched->job_threads, sched->batch_size, output, record);
+
+        pthread_mutex_lock(&sched->mutex);
+        sched->memory_used -= estimate;
+        pthread_cond_broadcast(&sched->cond);
+        pthread_mutex_unlock(&sched->mutex);
+    }
+    return NULL;
+}
+
+static int
+cmp_chromosome_estimate(const void *a, const void *b, void *arg)
+{
+    const size_t *estimates = (const size_t *) arg;
+    size_t ea = estimates[*(const int *) a];
+    size_t eb = estimates[*(const int *) b];
+
+    return (ea < eb) - (ea > eb);
 }
 
+static void
+run_generate_multi(int num_inputs, const char **input_files, int verbose,
+        int num_threads, int batch_size, const char *output_file,
+        const char *record_prefix, int memory_budget_mib)
+{
+    chromosome_scheduler_t sched;
+    pthread_t *workers = NULL;
+    struct stat st;
+    int j, num_workers;
+
+    if (num_inputs == 1) {
+        /* A single chromosome keeps the plain pipeline and output paths. */
+        run_generate(input_files[0], verbose, num_threads, batch_size,
+                output_file, record_prefix);
+        return;
+    }
+    if (output_file == NULL) {
+        fatal_error("multiple input files require -o; the results are "
+                "written to <output-file>.<k> for the k-th input");
+    }
+    memset(&sched, 0, sizeof(sched));
+    sched.num_inputs = num_inputs;
+    sched.input_files = input_files;
+    sched.estimates = malloc((size_t) num_inputs * sizeof(size_t));
+    sched.order = malloc((size_t) num_inputs * sizeof(int));
+    if (sched.estimates == NULL || sched.order == NULL) {
+        fatal_error("alloc");
+    }
+    for (j = 0; j < num_inputs; j++) {
+        if (stat(input_files[j], &st) != 0) {
+            fatal_error("Cannot stat '%s': %s", input_files[j],
+                    strerror(errno));
+        }
+        /* The working set is dominated by the haplotype and genotype
+         * matrices, which scale with the input; the multiplier covers the
+         * match buffers and the builder on top of them. */
+        sched.estimates[j] = 4 * (size_t) st.st_size;
+        sched.order[j] = j;
+    }
+    qsort_r(sched.order, (size_t) num_inputs, sizeof(int),
+            cmp_chromosome_estimate, sched.estimates);
+    sched.memory_budget = (size_t) memory_budget_mib << 20;
+    sched.verbose = verbose;
+    sched.batch_size = batch_size;
+    sched.output_file = output_file;
+    sched.record_prefix = record_prefix;
+    num_workers = TSI_MIN(num_inputs, TSI_MAX(num_threads, 1));
+    sched.job_threads = TSI_MAX(num_threads / num_workers, 1);
+    pthread_mutex_init(&sched.mutex, NULL);
+    pthread_cond_init(&sched.cond, NULL);
+    workers = malloc((size_t) num_workers * sizeof(pthread_t));
+    if (workers == NULL) {
+        fatal_error("alloc");
+    }
+    for (j = 0; j < num_workers; j++) {
+        if (pthread_create(&workers[j], NULL, chromosome_scheduler_worker,
+                &sched) != 0) {
+            fatal_error("pthread create");
+        }
+    }
+    for (j = 0; j < num_workers; j++) {
+        pthread_join(workers[j], NULL);
+    }
+    pthread_mutex_destroy(&sched.mutex);
+    pthread_cond_destroy(&sched.cond);
+    free(workers);
+    free(sched.estimates);
+    free(sched.order);
+}
+
+/* Re-executes one recorded epoch's matches against the builder state they
+ * originally ran against, in isolation from ancestor generation and I/O.
+ * Within an epoch the paths are only applied after all of its matches have
+ * completed, so restoring the snapshot and replaying the logged entries
+ * reproduces the production matcher workload exactly. */
+static void
+run_replay(const char *record_prefix, int epoch, int verbose, int num_threads,
+        int batch_size)
+{
+    char path[1024];
+    record_header_t header;
+    FILE *f;
+    tree_sequence_builder_t ts_builder;
+    match_pool_t pool;
+    allele_t *haplotypes = NULL;
+    allele_t *matches = NULL;
+    node_id_t *nodes = NULL;
+    site_id_t *starts = NULL;
+    site_id_t *ends = NULL;
+    size_t num_matches, max_matches, num_sites, length, j;
+    int32_t entry[4];
+    int ret;
+
+    snprintf(path, sizeof(path), "%s.log", record_prefix);
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        fatal_error("Error opening '%s': %s", path, strerror(errno));
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1) {
+        fatal_error("Error reading '%s': %s", path, strerror(errno));
+    }
+    if (header.magic != RECORD_MAGIC || header.version != RECORD_VERSION) {
+        fatal_error("'%s' is not a match record log", path);
+    }
+    if (epoch < 0 || (uint64_t) epoch >= header.num_epochs) {
+        fatal_error("epoch %d out of range: %d epochs recorded", epoch,
+                (int) header.num_epochs);
+    }
+    num_sites = header.num_sites;
+    /* Collect the target epoch's entries. The log is in submission order,
+     * so replaying them in file order reproduces the original workload. */
+    num_matches = 0;
+    max_matches = 1024;
+    haplotypes = malloc(max_matches * num_sites * sizeof(allele_t));
+    nodes = malloc(max_matches * sizeof(node_id_t));
+    starts = malloc(max_matches * sizeof(site_id_t));
+    ends = malloc(max_matches * sizeof(site_id_t));
+    if (haplotypes == NULL || nodes == NULL || starts == NULL || ends == NULL) {
+        fatal_error("alloc");
+    }
+    while (fread(entry, sizeof(entry), 1, f) == 1) {
+        length = (size_t) (entry[3] - entry[2]);
+        if (entry[0] != epoch) {
+            if (fseek(f, (long) length, SEEK_CUR) != 0) {
+                fatal_error("Error reading '%s': %s", path, strerror(errno));
+            }
+            continue;
+        }
+        if (num_matches == max_matches) {
+            max_matches *= 2;
+            haplotypes = realloc(haplotypes,
+                    max_matches * num_sites * sizeof(allele_t));
+            nodes = realloc(nodes, max_matches * sizeof(node_id_t));
+            starts = realloc(starts, max_matches * sizeof(site_id_t));
+            ends = realloc(ends, max_matches * sizeof(site_id_t));
+            if (haplotypes == NULL || nodes == NULL || starts == NULL
+                    || ends == NULL) {
+                fatal_error("alloc");
+            }
+        }
+        nodes[num_matches] = entry[1];
+        starts[num_matches] = entry[2];
+        ends[num_matches] = entry[3];
+        memset(haplotypes + num_matches * num_sites, 0,
+                num_sites * sizeof(allele_t));
+        if (fread(haplotypes + num_matches * num_sites + entry[2],
+                sizeof(allele_t), length, f) != length) {
+            fatal_error("Error reading '%s': %s", path, strerror(errno));
+        }
+        num_matches++;
+    }
+    if (ferror(f)) {
+        fatal_error("Error reading '%s': %s", path, strerror(errno));
+    }
+    fclose(f);
+
+    ret = tree_sequence_builder_alloc(&ts_builder, num_sites, 1024, 8192, 0);
+    if (ret != 0) {
+        fatal_error("alloc error");
+    }
+    snprintf(path, sizeof(path), "%s.%d.snap", record_prefix, epoch);
+    ret = tree_sequence_builder_restore_snapshot(&ts_builder, path);
+    if (ret != 0) {
+        fatal_error("Error reading '%s'", path);
+    }
+    ret = match_pool_alloc(&pool, &ts_builder, (size_t) num_threads,
+            TSI_MAX(num_matches, 1), 0);
+    if (ret != 0) {
+        fatal_error("match pool alloc error");
+    }
+    matches = malloc(TSI_MAX(num_matches, 1) * num_sites * sizeof(allele_t));
+    if (matches == NULL) {
+        fatal_error("alloc");
+    }
+    for (j = 0; j < num_matches; j++) {
+        ret = match_pool_submit(&pool, nodes[j], starts[j], ends[j],
+                haplotypes + j * num_sites, matches + j * num_sites);
+        if (ret != 0) {
+            fatal_error("match pool submit");
+        }
+    }
+    if (batch_size > 1) {
+        ret = match_pool_run_batched(&pool, TSI_COMPRESS_PATH,
+                (size_t) batch_size);
+    } else {
+        ret = match_pool_run(&pool, TSI_COMPRESS_PATH);
+    }
+    if (ret != 0) {
+        fatal_error("match pool run");
+    }
+    printf("Replayed %d matches for epoch %d: %d nodes %d edges\n",
+            (int) num_matches, epoch,
+            (int) tree_sequence_builder_get_num_nodes(&ts_builder),
+            (int) tree_sequence_builder_get_num_edges(&ts_builder));
+    if (verbose > 0) {
+        match_pool_print_state(&pool, stdout);
+    }
+
+    match_pool_free(&pool);
+    tree_sequence_builder_free(&ts_builder);
+    tsi_safe_free(haplotypes);
+    tsi_safe_free(matches);
+    tsi_safe_free(nodes);
+    tsi_safe_free(starts);
+    tsi_safe_free(ends);
+}
+
+static void
+run_convert(const char *input_file, const char *output_file)
+{
+    size_t num_samples, num_sites, j;
+    site_id_t l;
+    allele_t *haplotypes = NULL;
+    allele_t *genotypes = NULL;
+    double *position = NULL;
+    double *recombination_rate = NULL;
+    native_header_t header;
+    FILE *f;
+
+    read_input(input_file, &num_samples, &num_sites, &haplotypes, &position,
+            &recombination_rate);
+    /* Transpose to site-major order so that each site's genotypes are
+     * contiguous in the output. */
+    genotypes = malloc(num_samples * num_sites * sizeof(allele_t));
+    if (genotypes == NULL) {
+        fatal_error("malloc failure");
+    }
+    for (l = 0; l < (site_id_t) num_sites; l++) {
+        for (j = 0; j < num_samples; j++) {
+            genotypes[(size_t) l * num_samples + j] = haplotypes[j * num_sites + l];
+        }
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = NATIVE_MAGIC;
+    header.version = NATIVE_VERSION;
+    header.num_samples = num_samples;
+    header.num_sites = num_sites;
+    f = fopen(output_file, "wb");
+    if (f == NULL) {
+        fatal_error("Cannot open '%s': %s", output_file, strerror(errno));
+    }
+    if (fwrite(&header, sizeof(header), 1, f) != 1
+            || fwrite(position, sizeof(double), num_sites, f) != num_sites
+            || fwrite(recombination_rate, sizeof(double), num_sites, f) != num_sites
+            || fwrite(genotypes, sizeof(allele_t), num_samples * num_sites, f)
+                != num_samples * num_sites) {
+        fatal_error("Error writing '%s': %s", output_file, strerror(errno));
+    }
+    if (fclose(f) != 0) {
+        fatal_error("Error writing '%s': %s", output_file, strerror(errno));
+    }
+    free(genotypes);
+    free(haplotypes);
+    free(position);
+    free(recombination_rate);
+}
 
 int
 main(int argc, char** argv)
 {
-    /* SYNTAX 1: generate [-v] <input-file> <output-file> */
+    /* SYNTAX 1: generate [-v] [-t <threads>] [-b <batch-size>]
+     *     [-o <output-file>] [-r <record-prefix>] [-m <MiB>] <input-file>... */
     struct arg_rex *cmd1 = arg_rex1(NULL, NULL, "generate", NULL, REG_ICASE, NULL);
     struct arg_lit *verbose1 = arg_lit0("v", "verbose", NULL);
-    struct arg_file *sample_file1 = arg_file1(NULL, NULL, NULL, NULL);
+    struct arg_int *num_threads1 = arg_int0("t", "threads", "<num-threads>", NULL);
+    struct arg_int *batch_size1 = arg_int0("b", "batch-size", "<batch-size>", NULL);
+    struct arg_file *output_file1 = arg_file0("o", "output", "<output-file>",
+            "write binary result tables to this file instead of text to stdout");
+    struct arg_file *record_file1 = arg_file0("r", "record", "<record-prefix>",
+            "record the matcher workload to <record-prefix>.log and "
+            "per-epoch snapshots for later replay");
+    struct arg_int *memory_budget1 = arg_int0("m", "memory-budget", "<MiB>",
+            "cap the estimated footprint of concurrently running inputs");
+    struct arg_int *num_windows1 = arg_int0("w", "windows", "<num-windows>",
+            "partition the sites into this many windows, infer them "
+            "independently and stitch the results");
+    struct arg_file *sample_file1 = arg_filen(NULL, NULL, NULL, 1, 64, NULL);
     struct arg_end *end1 = arg_end(20);
-    void* argtable1[] = {cmd1, verbose1, sample_file1, end1};
+    void* argtable1[] = {cmd1, verbose1, num_threads1, batch_size1,
+        output_file1, record_file1, memory_budget1, num_windows1,
+        sample_file1, end1};
     int nerrors1;
 
+    /* SYNTAX 2: convert <input-hdf5> <output-native> */
+    struct arg_rex *cmd2 = arg_rex1(NULL, NULL, "convert", NULL, REG_ICASE, NULL);
+    struct arg_file *input_file2 = arg_file1(NULL, NULL, NULL, NULL);
+    struct arg_file *output_file2 = arg_file1(NULL, NULL, NULL, NULL);
+    struct arg_end *end2 = arg_end(20);
+    void* argtable2[] = {cmd2, input_file2, output_file2, end2};
+    int nerrors2;
+
+    /* SYNTAX 3: replay [-v] [-t <threads>] [-b <batch-size>] <record-prefix> <epoch> */
+    struct arg_rex *cmd3 = arg_rex1(NULL, NULL, "replay", NULL, REG_ICASE, NULL);
+    struct arg_lit *verbose3 = arg_lit0("v", "verbose", NULL);
+    struct arg_int *num_threads3 = arg_int0("t", "threads", "<num-threads>", NULL);
+    struct arg_int *batch_size3 = arg_int0("b", "batch-size", "<batch-size>", NULL);
+    struct arg_file *record_file3 = arg_file1(NULL, NULL, NULL, NULL);
+    struct arg_int *epoch3 = arg_int1(NULL, NULL, "<epoch>", NULL);
+    struct arg_end *end3 = arg_end(20);
+    void* argtable3[] = {cmd3, verbose3, num_threads3, batch_size3,
+        record_file3, epoch3, end3};
+    int nerrors3;
+
+    /* SYNTAX 4: append [-v] [-t <threads>] [-b <batch-size>]
+     *     [-o <output-file>] <result-file> <input-file> */
+    struct arg_rex *cmd4 = arg_rex1(NULL, NULL, "append", NULL, REG_ICASE, NULL);
+    struct arg_lit *verbose4 = arg_lit0("v", "verbose", NULL);
+    struct arg_int *num_threads4 = arg_int0("t", "threads", "<num-threads>", NULL);
+    struct arg_int *batch_size4 = arg_int0("b", "batch-size", "<batch-size>", NULL);
+    struct arg_file *output_file4 = arg_file0("o", "output", "<output-file>",
+            "write binary result tables to this file instead of text to stdout");
+    struct arg_file *result_file4 = arg_file1(NULL, NULL, NULL, NULL);
+    struct arg_file *sample_file4 = arg_file1(NULL, NULL, NULL, NULL);
+    struct arg_end *end4 = arg_end(20);
+    void* argtable4[] = {cmd4, verbose4, num_threads4, batch_size4,
+        output_file4, result_file4, sample_file4, end4};
+    int nerrors4;
+
     int exitcode = EXIT_SUCCESS;
     const char *progname = "main";
 
+    num_threads1->ival[0] = 1;
+    batch_size1->ival[0] = 1;
+    memory_budget1->ival[0] = 0;
+    num_windows1->ival[0] = 1;
+    num_threads3->ival[0] = 1;
+    batch_size3->ival[0] = 1;
+    num_threads4->ival[0] = 1;
+    batch_size4->ival[0] = 1;
     nerrors1 = arg_parse(argc, argv, argtable1);
+    nerrors2 = arg_parse(argc, argv, argtable2);
+    nerrors3 = arg_parse(argc, argv, argtable3);
+    nerrors4 = arg_parse(argc, argv, argtable4);
 
-    if (nerrors1 == 0) {
-        run_generate(sample_file1->filename[0], verbose1->count);
+    if (nerrors1 == 0 && num_windows1->ival[0] > 1) {
+        if (sample_file1->count > 1 || record_file1->count > 0) {
+            fatal_error("windowed inference takes a single input and does "
+                    "not support recording");
+        }
+        run_generate_windowed(sample_file1->filename[0], verbose1->count,
+                num_threads1->ival[0], batch_size1->ival[0],
+                output_file1->count > 0 ? output_file1->filename[0] : NULL,
+                num_windows1->ival[0]);
+    } else if (nerrors1 == 0) {
+        run_generate_multi(sample_file1->count, sample_file1->filename,
+                verbose1->count, num_threads1->ival[0], batch_size1->ival[0],
+                output_file1->count > 0 ? output_file1->filename[0] : NULL,
+                record_file1->count > 0 ? record_file1->filename[0] : NULL,
+                memory_budget1->ival[0]);
+    } else if (nerrors2 == 0) {
+        run_convert(input_file2->filename[0], output_file2->filename[0]);
+    } else if (nerrors3 == 0) {
+        run_replay(record_file3->filename[0], epoch3->ival[0],
+                verbose3->count, num_threads3->ival[0], batch_size3->ival[0]);
+    } else if (nerrors4 == 0) {
+        run_append(result_file4->filename[0], sample_file4->filename[0],
+                verbose4->count, num_threads4->ival[0], batch_size4->ival[0],
+                output_file4->count > 0 ? output_file4->filename[0] : NULL);
     } else {
         /* We get here if the command line matched none of the possible syntaxes */
         if (cmd1->count > 0) {
             arg_print_errors(stdout, end1, progname);
             printf("usage: %s ", progname);
             arg_print_syntax(stdout, argtable1, "\n");
+        } else if (cmd2->count > 0) {
+            arg_print_errors(stdout, end2, progname);
+            printf("usage: %s ", progname);
+            arg_print_syntax(stdout, argtable2, "\n");
+        } else if (cmd3->count > 0) {
+            arg_print_errors(stdout, end3, progname);
+            printf("usage: %s ", progname);
+            arg_print_syntax(stdout, argtable3, "\n");
+        } else if (cmd4->count > 0) {
+            arg_print_errors(stdout, end4, progname);
+            printf("usage: %s ", progname);
+            arg_print_syntax(stdout, argtable4, "\n");
         } else {
             /* no correct cmd literals were given, so we cant presume which syntax was intended */
             printf("%s: missing command.\n",progname);
             printf("usage 1: %s ", progname);  arg_print_syntax(stdout, argtable1, "\n");
+            printf("usage 2: %s ", progname);  arg_print_syntax(stdout, argtable2, "\n");
+            printf("usage 3: %s ", progname);  arg_print_syntax(stdout, argtable3, "\n");
+            printf("usage 4: %s ", progname);  arg_print_syntax(stdout, argtable4, "\n");
         }
     }
     arg_freetable(argtable1, sizeof(argtable1) / sizeof(argtable1[0]));
+    arg_freetable(argtable2, sizeof(argtable2) / sizeof(argtable2[0]));
+    arg_freetable(argtable3, sizeof(argtable3) / sizeof(argtable3[0]));
+    arg_freetable(argtable4, sizeof(argtable4) / sizeof(argtable4[0]));
 
     return exitcode;
 }
@@ -0,0 +1,461 @@
+/*
+** Copyright (C) 2018 University of Oxford
+**
+** This file is part of tsinfer.
+**
+** tsinfer is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** tsinfer is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with tsinfer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* A simple parallel matching engine. Haplotypes within an epoch are
+ * independent of each other given the tree sequence built from older
+ * epochs, so we can match them concurrently against a read-only
+ * tree_sequence_builder_t using one ancestor_matcher_t per thread.
+ * The resulting paths are applied serially, in submission order, at
+ * the epoch barrier in match_pool_run(). This keeps the output
+ * identical to the serial algorithm.
+ */
+
+#define _GNU_SOURCE
+
+#include "tsinfer.h"
+#include "err.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+typedef struct {
+    match_pool_t *pool;
+    size_t thread_index;
+} match_pool_thread_t;
+
+int
+match_pool_print_state(match_pool_t *self, FILE *out)
+{
+    size_t j;
+
+    fprintf(out, "Match pool state\n");
+    fprintf(out, "num_threads = %d\n", (int) self->num_threads);
+    fprintf(out, "num_work = %d\n", (int) self->num_work);
+    fprintf(out, "max_work = %d\n", (int) self->max_work);
+    for (j = 0; j < self->num_work; j++) {
+        fprintf(out, "\t%d\t[%d, %d)\t%d edges\n", self->work[j].child,
+                self->work[j].start, self->work[j].end,
+                (int) self->work[j].num_edges);
+    }
+    return 0;
+}
+
+int
+match_pool_alloc(match_pool_t *self, tree_sequence_builder_t *tree_sequence_builder,
+        size_t num_threads, size_t max_work, int flags)
+{
+    int ret = 0;
+    size_t j;
+
+    memset(self, 0, sizeof(match_pool_t));
+    self->flags = flags;
+    self->tree_sequence_builder = tree_sequence_builder;
+    /* Zero threads means matching synchronously in the calling thread. */
+    self->num_threads = TSI_MAX(num_threads, 1);
+    self->max_work = max_work;
+    self->num_work = 0;
+    self->work = calloc(self->max_work, sizeof(match_work_t));
+    self->matchers = calloc(self->num_threads, sizeof(ancestor_matcher_t));
+    if (self->work == NULL || self->matchers == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    for (j = 0; j < self->num_threads; j++) {
+        ret = ancestor_matcher_alloc(self->matchers + j, tree_sequence_builder,
+                0, flags);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+    if (pthread_mutex_init(&self->mutex, NULL) != 0) {
+        ret = TSI_ERR_GENERIC;
+        goto out;
+    }
+out:
+    return ret;
+}
+
+/* Applies a per-matcher traceback budget (see
+ * ancestor_matcher_set_traceback_budget), so the pool's total traceback
+ * memory is bounded by num_threads (times the batch size when matching
+ * in batches) times the budget, however the work is scheduled. */
+int
+match_pool_set_traceback_budget(match_pool_t *self, size_t traceback_budget)
+{
+    size_t j;
+
+    self->traceback_budget = traceback_budget;
+    for (j = 0; j < self->num_threads; j++) {
+        ancestor_matcher_set_traceback_budget(self->matchers + j,
+                traceback_budget);
+    }
+    for (j = 0; j < self->num_threads * self->batch_size; j++) {
+        ancestor_matcher_set_traceback_budget(self->batch_matchers + j,
+                traceback_budget);
+    }
+    return 0;
+}
+
+int
+match_pool_free(match_pool_t *self)
+{
+    size_t j;
+
+    for (j = 0; j < self->num_work; j++) {
+        tsi_safe_free(self->work[j].left);
+        tsi_safe_free(self->work[j].right);
+        tsi_safe_free(self->work[j].parent);
+    }
+    if (self->matchers != NULL) {
+        for (j = 0; j < self->num_threads; j++) {
+            ancestor_matcher_free(self->matchers + j);
+        }
+    }
+    if (self->batch_matchers != NULL) {
+        for (j = 0; j < self->num_threads * self->batch_size; j++) {
+            ancestor_matcher_free(self->batch_matchers + j);
+        }
+    }
+    tsi_safe_free(self->matchers);
+    tsi_safe_free(self->batch_matchers);
+    tsi_safe_free(self->work);
+    pthread_mutex_destroy(&self->mutex);
+    return 0;
+}
+
+/* Makes sure we have num_threads * batch_size matchers available for
+ * batched matching. */
+static int WARN_UNUSED
+match_pool_expand_batch_matchers(match_pool_t *self, size_t batch_size)
+{
+    int ret = 0;
+    size_t j;
+
+    if (batch_size > self->batch_size) {
+        if (self->batch_matchers != NULL) {
+            for (j = 0; j < self->num_threads * self->batch_size; j++) {
+                ancestor_matcher_free(self->batch_matchers + j);
+            }
+            tsi_safe_free(self->batch_matchers);
+        }
+        self->batch_size = batch_size;
+        self->batch_matchers = calloc(self->num_threads * batch_size,
+                sizeof(ancestor_matcher_t));
+        if (self->batch_matchers == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        for (j = 0; j < self->num_threads * batch_size; j++) {
+            ret = ancestor_matcher_alloc(self->batch_matchers + j,
+                    self->tree_sequence_builder, 0, self->flags);
+            if (ret != 0) {
+                goto out;
+            }
+            ancestor_matcher_set_traceback_budget(self->batch_matchers + j,
+                    self->traceback_budget);
+        }
+    }
+out:
+    return ret;
+}
+
+/* Queue the specified haplotype for matching. The haplotype and match
+ * buffers are borrowed from the caller and must remain valid until the
+ * next call to match_pool_run(). */
+int WARN_UNUSED
+match_pool_submit(match_pool_t *self, node_id_t child, site_id_t start,
+        site_id_t end, allele_t *haplotype, allele_t *match)
+{
+    int ret = 0;
+    match_work_t *work;
+
+    if (self->num_work == self->max_work) {
+        ret = TSI_ERR_GENERIC;
+        goto out;
+    }
+    work = self->work + self->num_work;
+    work->child = child;
+    work->start = start;
+    work->end = end;
+    work->haplotype = haplotype;
+    work->match = match;
+    work->num_edges = 0;
+    work->left = NULL;
+    work->right = NULL;
+    work->parent = NULL;
+    self->num_work++;
+out:
+    return ret;
+}
+
+static int WARN_UNUSED
+match_pool_run_match(match_pool_t *self, ancestor_matcher_t *matcher,
+        match_work_t *work)
+{
+    int ret = 0;
+    size_t num_edges;
+    site_id_t *left, *right;
+    node_id_t *parent;
+
+    ret = ancestor_matcher_find_path(matcher, work->start, work->end,
+            work->haplotype, work->match, &num_edges, &left, &right, &parent);
+    if (ret != 0) {
+        goto out;
+    }
+    /* The matcher's output buffers are reused on the next call, so take
+     * a copy for the apply phase. */
+    work->num_edges = num_edges;
+    work->left = malloc(num_edges * sizeof(site_id_t));
+    work->right = malloc(num_edges * sizeof(site_id_t));
+    work->parent = malloc(num_edges * sizeof(node_id_t));
+    if (work->left == NULL || work->right == NULL || work->parent == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    memcpy(work->left, left, num_edges * sizeof(site_id_t));
+    memcpy(work->right, right, num_edges * sizeof(site_id_t));
+    memcpy(work->parent, parent, num_edges * sizeof(node_id_t));
+out:
+    return ret;
+}
+
+/* Matches the block of work items [block_start, block_end) using the
+ * specified group of matchers. Blocks of more than one item sharing the
+ * same match interval are carried through a single tree sweep; mixed
+ * blocks fall back to one match per item. */
+static int WARN_UNUSED
+match_pool_match_block(match_pool_t *self, ancestor_matcher_t *matchers,
+        size_t block_start, size_t block_end)
+{
+    int ret = 0;
+    size_t j, num_edges;
+    size_t num_items = block_end - block_start;
+    match_work_t *work = self->work + block_start;
+    ancestor_matcher_t **matcher_ptrs = NULL;
+    allele_t **haplotypes = NULL;
+    allele_t **matches = NULL;
+    site_id_t **left = NULL;
+    site_id_t **right = NULL;
+    node_id_t **parent = NULL;
+    size_t *num_edges_array = NULL;
+    bool mixed = false;
+
+    for (j = 1; j < num_items; j++) {
+        if (work[j].start != work[0].start || work[j].end != work[0].end) {
+            mixed = true;
+        }
+    }
+    if (num_items == 1 || mixed) {
+        for (j = 0; j < num_items; j++) {
+            ret = match_pool_run_match(self, matchers, work + j);
+            if (ret != 0) {
+                goto out;
+            }
+        }
+        goto out;
+    }
+    matcher_ptrs = malloc(num_items * sizeof(*matcher_ptrs));
+    haplotypes = malloc(num_items * sizeof(*haplotypes));
+    matches = malloc(num_items * sizeof(*matches));
+    left = malloc(num_items * sizeof(*left));
+    right = malloc(num_items * sizeof(*right));
+    parent = malloc(num_items * sizeof(*parent));
+    num_edges_array = malloc(num_items * sizeof(*num_edges_array));
+    if (matcher_ptrs == NULL || haplotypes == NULL || matches == NULL
+            || left == NULL || right == NULL || parent == NULL
+            || num_edges_array == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    for (j = 0; j < num_items; j++) {
+        matcher_ptrs[j] = matchers + j;
+        haplotypes[j] = work[j].haplotype;
+        matches[j] = work[j].match;
+    }
+    ret = ancestor_matcher_find_paths_batch(matcher_ptrs, num_items,
+            work[0].start, work[0].end, haplotypes, matches,
+            num_edges_array, left, right, parent);
+    if (ret != 0) {
+        goto out;
+    }
+    for (j = 0; j < num_items; j++) {
+        num_edges = num_edges_array[j];
+        work[j].num_edges = num_edges;
+        work[j].left = malloc(num_edges * sizeof(site_id_t));
+        work[j].right = malloc(num_edges * sizeof(site_id_t));
+        work[j].parent = malloc(num_edges * sizeof(node_id_t));
+        if (work[j].left == NULL || work[j].right == NULL
+                || work[j].parent == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        memcpy(work[j].left, left[j], num_edges * sizeof(site_id_t));
+        memcpy(work[j].right, right[j], num_edges * sizeof(site_id_t));
+        memcpy(work[j].parent, parent[j], num_edges * sizeof(node_id_t));
+    }
+out:
+    tsi_safe_free(matcher_ptrs);
+    tsi_safe_free(haplotypes);
+    tsi_safe_free(matches);
+    tsi_safe_free(left);
+    tsi_safe_free(right);
+    tsi_safe_free(parent);
+    tsi_safe_free(num_edges_array);
+    return ret;
+}
+
+static void *
+match_pool_worker(void *arg)
+{
+    match_pool_thread_t *thread = (match_pool_thread_t *) arg;
+    match_pool_t *self = thread->pool;
+    size_t batch_size = self->run_batch_size;
+    ancestor_matcher_t *matchers;
+    size_t j, block_end;
+    int ret;
+    bool done = false;
+
+    if (batch_size == 1) {
+        matchers = self->matchers + thread->thread_index;
+    } else {
+        matchers = self->batch_matchers + thread->thread_index * self->batch_size;
+    }
+    while (!done) {
+        pthread_mutex_lock(&self->mutex);
+        j = self->next_work;
+        self->next_work += batch_size;
+        done = self->error != 0 || j >= self->num_work;
+        pthread_mutex_unlock(&self->mutex);
+        if (!done) {
+            block_end = TSI_MIN(j + batch_size, self->num_work);
+            ret = match_pool_match_block(self, matchers, j, block_end);
+            if (ret != 0) {
+                pthread_mutex_lock(&self->mutex);
+                if (self->error == 0) {
+                    self->error = ret;
+                }
+                pthread_mutex_unlock(&self->mutex);
+                done = true;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Match all queued haplotypes concurrently in blocks of batch_size, then
+ * apply the resulting paths in submission order. The queue is cleared
+ * afterwards; mutations must be added by the caller. */
+int WARN_UNUSED
+match_pool_run_batched(match_pool_t *self, int path_flags, size_t batch_size)
+{
+    int ret = 0;
+    size_t j, num_threads, num_blocks;
+    pthread_t *threads = NULL;
+    match_pool_thread_t *thread_args = NULL;
+    match_work_t *work;
+    ancestor_matcher_t *matchers;
+
+    batch_size = TSI_MAX(batch_size, 1);
+    /* Rebuild the flat edge indexes up front so that worker threads only
+     * ever read them. */
+    ret = tree_sequence_builder_freeze_indexes(self->tree_sequence_builder);
+    if (ret != 0) {
+        goto out;
+    }
+    if (batch_size > 1) {
+        ret = match_pool_expand_batch_matchers(self, batch_size);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+    self->run_batch_size = batch_size;
+    self->next_work = 0;
+    self->error = 0;
+    num_blocks = (self->num_work + batch_size - 1) / batch_size;
+    num_threads = TSI_MIN(self->num_threads, num_blocks);
+    if (num_threads <= 1) {
+        /* Synchronous case: run everything in the calling thread. */
+        matchers = batch_size == 1 ? self->matchers : self->batch_matchers;
+        for (j = 0; j < self->num_work; j += batch_size) {
+            ret = match_pool_match_block(self, matchers, j,
+                    TSI_MIN(j + batch_size, self->num_work));
+            if (ret != 0) {
+                goto out;
+            }
+        }
+    } else {
+        threads = malloc(num_threads * sizeof(pthread_t));
+        thread_args = malloc(num_threads * sizeof(match_pool_thread_t));
+        if (threads == NULL || thread_args == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        for (j = 0; j < num_threads; j++) {
+            thread_args[j].pool = self;
+            thread_args[j].thread_index = j;
+            if (pthread_create(threads + j, NULL, match_pool_worker,
+                    thread_args + j) != 0) {
+                /* Join what we've started and give up. */
+                num_threads = j;
+                self->error = TSI_ERR_GENERIC;
+                break;
+            }
+        }
+        for (j = 0; j < num_threads; j++) {
+            pthread_join(threads[j], NULL);
+        }
+        if (self->error != 0) {
+            ret = self->error;
+            goto out;
+        }
+    }
+    /* Epoch barrier: apply the paths serially in submission order. */
+    for (j = 0; j < self->num_work; j++) {
+        work = self->work + j;
+        ret = tree_sequence_builder_add_path(self->tree_sequence_builder,
+                work->child, work->num_edges, work->left, work->right,
+                work->parent, path_flags);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+out:
+    for (j = 0; j < self->num_work; j++) {
+        work = self->work + j;
+        tsi_safe_free(work->left);
+        tsi_safe_free(work->right);
+        tsi_safe_free(work->parent);
+        work->left = NULL;
+        work->right = NULL;
+        work->parent = NULL;
+    }
+    self->num_work = 0;
+    tsi_safe_free(threads);
+    tsi_safe_free(thread_args);
+    return ret;
+}
+
+int WARN_UNUSED
+match_pool_run(match_pool_t *self, int path_flags)
+{
+    return match_pool_run_batched(self, path_flags, 1);
+}
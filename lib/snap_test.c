@@ -0,0 +1,266 @@
+/*
+** Copyright (C) 2018 University of Oxford
+**
+** This file is part of tsinfer.
+**
+** tsinfer is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** tsinfer is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with tsinfer.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Round-trip test for the tree sequence builder snapshot format. A
+ * builder is filled with random paths and mutations, dumped, restored
+ * into a second builder and the two are compared: the node, edge and
+ * mutation tables must match exactly, the left and right index
+ * traversal orders must be identical, and further path insertions must
+ * behave the same against the bulk-built indexes as against the
+ * incrementally built ones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "tsinfer.h"
+
+#define SNAPSHOT_FILE "snap_test.snap"
+
+/* The dumped tables for one builder, in the order the dump functions
+ * produce them. */
+typedef struct {
+    size_t num_nodes;
+    size_t num_edges;
+    size_t num_mutations;
+    uint32_t *flags;
+    double *time;
+    site_id_t *left;
+    site_id_t *right;
+    node_id_t *parent;
+    node_id_t *child;
+    site_id_t *mutation_site;
+    node_id_t *mutation_node;
+    allele_t *derived_state;
+    mutation_id_t *mutation_parent;
+} builder_tables_t;
+
+static void
+dump_tables(tree_sequence_builder_t *tsb, builder_tables_t *tables)
+{
+    int ret;
+
+    tables->num_nodes = tree_sequence_builder_get_num_nodes(tsb);
+    tables->num_edges = tree_sequence_builder_get_num_edges(tsb);
+    tables->num_mutations = tree_sequence_builder_get_num_mutations(tsb);
+    tables->flags = malloc(tables->num_nodes * sizeof(uint32_t));
+    tables->time = malloc(tables->num_nodes * sizeof(double));
+    tables->left = malloc(tables->num_edges * sizeof(site_id_t));
+    tables->right = malloc(tables->num_edges * sizeof(site_id_t));
+    tables->parent = malloc(tables->num_edges * sizeof(node_id_t));
+    tables->child = malloc(tables->num_edges * sizeof(node_id_t));
+    tables->mutation_site = malloc(tables->num_mutations * sizeof(site_id_t));
+    tables->mutation_node = malloc(tables->num_mutations * sizeof(node_id_t));
+    tables->derived_state = malloc(tables->num_mutations * sizeof(allele_t));
+    tables->mutation_parent = malloc(tables->num_mutations * sizeof(mutation_id_t));
+    assert(tables->flags != NULL && tables->time != NULL
+            && tables->left != NULL && tables->right != NULL
+            && tables->parent != NULL && tables->child != NULL
+            && tables->mutation_site != NULL && tables->mutation_node != NULL
+            && tables->derived_state != NULL && tables->mutation_parent != NULL);
+    ret = tree_sequence_builder_dump_nodes(tsb, tables->flags, tables->time);
+    assert(ret == 0);
+    ret = tree_sequence_builder_dump_edges(tsb, tables->left, tables->right,
+            tables->parent, tables->child);
+    assert(ret == 0);
+    ret = tree_sequence_builder_dump_mutations(tsb, tables->mutation_site,
+            tables->mutation_node, tables->derived_state,
+            tables->mutation_parent);
+    assert(ret == 0);
+}
+
+static void
+free_tables(builder_tables_t *tables)
+{
+    free(tables->flags);
+    free(tables->time);
+    free(tables->left);
+    free(tables->right);
+    free(tables->parent);
+    free(tables->child);
+    free(tables->mutation_site);
+    free(tables->mutation_node);
+    free(tables->derived_state);
+    free(tables->mutation_parent);
+}
+
+static void
+verify_tables_equal(tree_sequence_builder_t *tsb_a, tree_sequence_builder_t *tsb_b)
+{
+    builder_tables_t a, b;
+
+    dump_tables(tsb_a, &a);
+    dump_tables(tsb_b, &b);
+    assert(a.num_nodes == b.num_nodes);
+    assert(a.num_edges == b.num_edges);
+    assert(a.num_mutations == b.num_mutations);
+    assert(memcmp(a.flags, b.flags, a.num_nodes * sizeof(uint32_t)) == 0);
+    assert(memcmp(a.time, b.time, a.num_nodes * sizeof(double)) == 0);
+    assert(memcmp(a.left, b.left, a.num_edges * sizeof(site_id_t)) == 0);
+    assert(memcmp(a.right, b.right, a.num_edges * sizeof(site_id_t)) == 0);
+    assert(memcmp(a.parent, b.parent, a.num_edges * sizeof(node_id_t)) == 0);
+    assert(memcmp(a.child, b.child, a.num_edges * sizeof(node_id_t)) == 0);
+    assert(memcmp(a.mutation_site, b.mutation_site,
+            a.num_mutations * sizeof(site_id_t)) == 0);
+    assert(memcmp(a.mutation_node, b.mutation_node,
+            a.num_mutations * sizeof(node_id_t)) == 0);
+    assert(memcmp(a.derived_state, b.derived_state,
+            a.num_mutations * sizeof(allele_t)) == 0);
+    assert(memcmp(a.mutation_parent, b.mutation_parent,
+            a.num_mutations * sizeof(mutation_id_t)) == 0);
+    free_tables(&a);
+    free_tables(&b);
+}
+
+/* The restored indexes are bulk-built rather than produced by repeated
+ * insertion, so the traversal order must be checked explicitly. */
+static void
+verify_index_order_equal(avl_tree_t *index_a, avl_tree_t *index_b)
+{
+    avl_node_t *a, *b;
+    edge_t *ea, *eb;
+
+    for (a = index_a->head, b = index_b->head; a != NULL && b != NULL;
+            a = a->next, b = b->next) {
+        ea = (edge_t *) a->item;
+        eb = (edge_t *) b->item;
+        assert(ea->left == eb->left);
+        assert(ea->right == eb->right);
+        assert(ea->parent == eb->parent);
+        assert(ea->child == eb->child);
+    }
+    assert(a == NULL && b == NULL);
+}
+
+/* Adds a random path of a few edges from the new node back to earlier
+ * nodes, with a handful of mutations on top. */
+static void
+add_random_path(tree_sequence_builder_t *tsb, node_id_t node, size_t num_sites,
+        int flags)
+{
+    site_id_t left[8], right[8];
+    node_id_t parent[8];
+    allele_t derived[1];
+    site_id_t cut, prev, tmp_site, site;
+    node_id_t tmp_node;
+    size_t num_path_edges, num_muts, k, o;
+    int ret;
+
+    num_path_edges = 1 + (size_t) (rand() % 4);
+    prev = 0;
+    for (k = 0; k < num_path_edges; k++) {
+        cut = (k == num_path_edges - 1) ? (site_id_t) num_sites
+            : prev + 1 + rand() % 20;
+        if (cut > (site_id_t) num_sites) {
+            cut = (site_id_t) num_sites;
+        }
+        left[k] = prev;
+        right[k] = cut;
+        parent[k] = (node_id_t) (rand() % node);
+        prev = cut;
+        if (cut == (site_id_t) num_sites) {
+            num_path_edges = k + 1;
+            break;
+        }
+    }
+    /* The edges must be provided in reverse order. */
+    for (k = 0; k < num_path_edges / 2; k++) {
+        o = num_path_edges - 1 - k;
+        tmp_site = left[k]; left[k] = left[o]; left[o] = tmp_site;
+        tmp_site = right[k]; right[k] = right[o]; right[o] = tmp_site;
+        tmp_node = parent[k]; parent[k] = parent[o]; parent[o] = tmp_node;
+    }
+    ret = tree_sequence_builder_add_path(tsb, node, num_path_edges, left,
+            right, parent, flags);
+    assert(ret == 0);
+    num_muts = (size_t) (rand() % 3);
+    for (k = 0; k < num_muts; k++) {
+        site = (site_id_t) (rand() % (int) num_sites);
+        derived[0] = 1;
+        ret = tree_sequence_builder_add_mutations(tsb, node, 1, &site, derived);
+        assert(ret == 0);
+    }
+}
+
+int
+main(void)
+{
+    tree_sequence_builder_t tsb, tsb2;
+    size_t num_sites = 100;
+    node_id_t node, node2;
+    double t, t2;
+    size_t j;
+    unsigned int seed;
+    int ret;
+
+    srand(42);
+    ret = tree_sequence_builder_alloc(&tsb, num_sites, 16, 16, 0);
+    assert(ret == 0);
+    ret = tree_sequence_builder_alloc(&tsb2, num_sites, 16, 16, 0);
+    assert(ret == 0);
+
+    node = tree_sequence_builder_add_node(&tsb, 1000.0, true);
+    assert(node == 0);
+    t = 999.0;
+    for (j = 1; j < 200; j++) {
+        node = tree_sequence_builder_add_node(&tsb, t, true);
+        assert(node == (node_id_t) j);
+        t -= 0.5;
+        add_random_path(&tsb, node, num_sites, 0);
+    }
+
+    ret = tree_sequence_builder_dump_snapshot(&tsb, SNAPSHOT_FILE);
+    assert(ret == 0);
+    ret = tree_sequence_builder_restore_snapshot(&tsb2, SNAPSHOT_FILE);
+    assert(ret == 0);
+    unlink(SNAPSHOT_FILE);
+
+    verify_tables_equal(&tsb, &tsb2);
+    verify_index_order_equal(&tsb.left_index, &tsb2.left_index);
+    verify_index_order_equal(&tsb.right_index, &tsb2.right_index);
+
+    /* Exercise further inserts against the bulk-built indexes: the same
+     * paths must leave both builders in the same state, including the
+     * path-compression matches found through the path hash. */
+    seed = (unsigned int) rand();
+    t2 = t;
+    srand(seed);
+    for (j = 200; j < 260; j++) {
+        node = tree_sequence_builder_add_node(&tsb, t, true);
+        t -= 0.5;
+        add_random_path(&tsb, node, num_sites, TSI_COMPRESS_PATH);
+    }
+    srand(seed);
+    for (j = 200; j < 260; j++) {
+        node2 = tree_sequence_builder_add_node(&tsb2, t2, true);
+        assert(node2 == (node_id_t) j);
+        t2 -= 0.5;
+        add_random_path(&tsb2, node2, num_sites, TSI_COMPRESS_PATH);
+    }
+    verify_tables_equal(&tsb, &tsb2);
+    verify_index_order_equal(&tsb.left_index, &tsb2.left_index);
+    verify_index_order_equal(&tsb.right_index, &tsb2.right_index);
+
+    tree_sequence_builder_free(&tsb);
+    tree_sequence_builder_free(&tsb2);
+    printf("snap_test: all checks passed\n");
+    return EXIT_SUCCESS;
+}
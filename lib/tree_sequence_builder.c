@@ -27,11 +27,11 @@
 
 #include "avl.h"
 
+/* The maximum number of tree checkpoints we store along the sequence. */
+#define MAX_TREE_CHECKPOINTS 64
 
-static int
-cmp_edge_left_increasing_time(const void *a, const void *b) {
-    const edge_t *ca = (const edge_t *) a;
-    const edge_t *cb = (const edge_t *) b;
+static inline int
+cmp_edge_left_increasing_time_inline(const edge_t *ca, const edge_t *cb) {
     int ret = (ca->left > cb->left) - (ca->left < cb->left);
     if (ret == 0) {
         ret = (ca->time > cb->time) - (ca->time < cb->time);
@@ -42,10 +42,8 @@ cmp_edge_left_increasing_time(const void *a, const void *b) {
     return ret;
 }
 
-static int
-cmp_edge_right_decreasing_time(const void *a, const void *b) {
-    const edge_t *ca = (const edge_t *) a;
-    const edge_t *cb = (const edge_t *) b;
+static inline int
+cmp_edge_right_decreasing_time_inline(const edge_t *ca, const edge_t *cb) {
     int ret = (ca->right > cb->right) - (ca->right < cb->right);
     if (ret == 0) {
         ret = (ca->time < cb->time) - (ca->time > cb->time);
@@ -57,22 +55,66 @@ cmp_edge_right_decreasing_time(const void *a, const void *b) {
 }
 
 static int
-cmp_edge_path(const void *a, const void *b) {
-    const edge_t *ca = (const edge_t *) a;
-    const edge_t *cb = (const edge_t *) b;
-    int ret = (ca->left > cb->left) - (ca->left < cb->left);
-    if (ret == 0) {
-        ret = (ca->right > cb->right) - (ca->right < cb->right);
-        if (ret == 0) {
-            ret = (ca->parent > cb->parent) - (ca->parent < cb->parent);
-            if (ret == 0) {
-                ret = (ca->child > cb->child) - (ca->child < cb->child);
-            }
-        }
-    }
-    return ret;
+cmp_edge_left_increasing_time(const void *a, const void *b) {
+    return cmp_edge_left_increasing_time_inline(
+            (const edge_t *) a, (const edge_t *) b);
+}
+
+static int
+cmp_edge_right_decreasing_time(const void *a, const void *b) {
+    return cmp_edge_right_decreasing_time_inline(
+            (const edge_t *) a, (const edge_t *) b);
 }
 
+/* Specialized insert and search for the two edge indexes with the
+ * comparators expanded inline, so that the hot index operations don't
+ * pay an indirect call per tree level. Rebalancing is left to the
+ * generic avl code, which makes no comparator calls. The comparators
+ * are total orders (ties broken on child), so keys are never equal. */
+#define TSI_SPECIALIZE_AVL(name, cmp)                                        \
+static avl_node_t *                                                          \
+name##_insert(avl_tree_t *tree, avl_node_t *newnode)                         \
+{                                                                            \
+    avl_node_t *node = tree->top;                                            \
+    const edge_t *key = (const edge_t *) newnode->item;                      \
+                                                                             \
+    if (node == NULL) {                                                      \
+        return avl_insert_top(tree, newnode);                                \
+    }                                                                        \
+    for (;;) {                                                               \
+        if (cmp(key, (const edge_t *) node->item) < 0) {                     \
+            if (node->left == NULL) {                                        \
+                return avl_insert_before(tree, node, newnode);               \
+            }                                                                \
+            node = node->left;                                               \
+        } else {                                                             \
+            if (node->right == NULL) {                                       \
+                return avl_insert_after(tree, node, newnode);                \
+            }                                                                \
+            node = node->right;                                              \
+        }                                                                    \
+    }                                                                        \
+}                                                                            \
+                                                                             \
+static avl_node_t *                                                         \
+name##_search(avl_tree_t *tree, const edge_t *key)                           \
+{                                                                            \
+    avl_node_t *node = tree->top;                                            \
+    int c;                                                                   \
+                                                                             \
+    while (node != NULL) {                                                   \
+        c = cmp(key, (const edge_t *) node->item);                           \
+        if (c == 0) {                                                        \
+            break;                                                           \
+        }                                                                    \
+        node = c < 0 ? node->left : node->right;                             \
+    }                                                                        \
+    return node;                                                             \
+}
+
+TSI_SPECIALIZE_AVL(left_index, cmp_edge_left_increasing_time_inline)
+TSI_SPECIALIZE_AVL(right_index, cmp_edge_right_decreasing_time_inline)
+
 static void
 print_edge_path(edge_t *head, FILE *out)
 {
@@ -88,46 +130,6 @@ print_edge_path(edge_t *head, FILE *out)
     fprintf(out, "\n");
 }
 
-#if 0
-/* Sorts edges by (left, right, parent, child) order. */
-static int
-cmp_edge_lrpc(const void *a, const void *b) {
-    const edge_t *ca = (const edge_t *) a;
-    const edge_t *cb = (const edge_t *) b;
-
-    int ret = (ca->left > cb->left) - (ca->left < cb->left);
-    if (ret == 0) {
-        ret = (ca->right > cb->right) - (ca->right < cb->right);
-        if (ret == 0) {
-            ret = (ca->parent > cb->parent) - (ca->parent < cb->parent);
-            if (ret == 0) {
-                ret = (ca->child > cb->child) - (ca->child < cb->child);
-            }
-        }
-    }
-    return ret;
-}
-
-/* Sorts edges by (child, left, right, parent) order. */
-static int
-cmp_edge_clrp(const void *a, const void *b) {
-    const edge_t *ca = (const edge_t *) a;
-    const edge_t *cb = (const edge_t *) b;
-
-    int ret = (ca->child > cb->child) - (ca->child < cb->child);
-    if (ret == 0) {
-        ret = (ca->left > cb->left) - (ca->left < cb->left);
-        if (ret == 0) {
-            ret = (ca->right > cb->right) - (ca->right < cb->right);
-            if (ret == 0) {
-                ret = (ca->parent > cb->parent) - (ca->parent < cb->parent);
-            }
-        }
-    }
-    return ret;
-}
-#endif
-
 
 static void
 tree_sequence_builder_check_state(tree_sequence_builder_t *self)
@@ -150,9 +152,10 @@ tree_sequence_builder_check_state(tree_sequence_builder_t *self)
     }
     assert(avl_count(&self->left_index) == total_edges);
     assert(avl_count(&self->right_index) == total_edges);
-    assert(avl_count(&self->path_index) == total_edges);
+    assert(self->num_path_hash_entries == total_edges);
     assert(total_edges == object_heap_get_num_allocated(&self->edge_heap));
-    assert(3 * total_edges == object_heap_get_num_allocated(&self->avl_node_heap));
+    assert(2 * total_edges == object_heap_get_num_allocated(&self->avl_node_heap));
+    assert(total_edges == object_heap_get_num_allocated(&self->path_hash_entry_heap));
 }
 
 int
@@ -160,7 +163,7 @@ tree_sequence_builder_print_state(tree_sequence_builder_t *self, FILE *out)
 {
     size_t j;
     mutation_list_node_t *u;
-    avl_node_t *a;
+    path_hash_entry_t *h;
     edge_t *edge;
 
     fprintf(out, "Tree sequence builder state\n");
@@ -191,11 +194,14 @@ tree_sequence_builder_print_state(tree_sequence_builder_t *self, FILE *out)
             fprintf(out, "\n");
         }
     }
-    fprintf(out, "path index \n");
-    for (a = self->path_index.head; a != NULL; a = a->next) {
-        edge = (edge_t *) a->item;
-        fprintf(out, "%d\t%d\t%d\t%d\n", edge->left, edge->right,
-                edge->parent, edge->child);
+    fprintf(out, "path hash: size=%d entries=%d\n", (int) self->path_hash_size,
+            (int) self->num_path_hash_entries);
+    for (j = 0; j < self->path_hash_size; j++) {
+        for (h = self->path_hash[j]; h != NULL; h = h->next) {
+            edge = h->edge;
+            fprintf(out, "%d\t%d\t%d\t%d\n", edge->left, edge->right,
+                    edge->parent, edge->child);
+        }
     }
 
     fprintf(out, "block_allocator = \n");
@@ -229,7 +235,10 @@ tree_sequence_builder_alloc(tree_sequence_builder_t *self,
     self->node_flags = malloc(self->max_nodes * sizeof(uint32_t));
     self->path = calloc(self->max_nodes, sizeof(edge_t *));
     self->sites.mutations = calloc(self->num_sites, sizeof(mutation_list_node_t));
+    self->mutation_offset = malloc((self->num_sites + 1) * sizeof(size_t));
+    self->flat_mutations_dirty = true;
     if (self->time == NULL || self->node_flags == NULL || self->path == NULL
+            || self->mutation_offset == NULL
             || self->sites.mutations == NULL)  {
         ret = TSI_ERR_NO_MEMORY;
         goto out;
@@ -249,10 +258,277 @@ tree_sequence_builder_alloc(tree_sequence_builder_t *self,
     if (ret != 0) {
         goto out;
     }
+    ret = object_heap_init(&self->path_hash_entry_heap, sizeof(path_hash_entry_t),
+            self->edges_chunk_size, NULL);
+    if (ret != 0) {
+        goto out;
+    }
+    self->path_hash_size = 1024;
+    self->num_path_hash_entries = 0;
+    self->path_hash = calloc(self->path_hash_size, sizeof(path_hash_entry_t *));
+    if (self->path_hash == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
     avl_init_tree(&self->left_index, cmp_edge_left_increasing_time, NULL);
     avl_init_tree(&self->right_index, cmp_edge_right_decreasing_time, NULL);
-    avl_init_tree(&self->path_index, cmp_edge_path, NULL);
+    self->flat_indexes_dirty = true;
+
+out:
+    return ret;
+}
+
+/* Rebuilds the flat site-indexed mutation columns from the per-site
+ * lists if any mutations have been added since the last call. */
+static int WARN_UNUSED
+tree_sequence_builder_freeze_mutations(tree_sequence_builder_t *self)
+{
+    int ret = 0;
+    size_t j;
+    site_id_t l;
+    mutation_list_node_t *u;
+    void *tmp;
+
+    if (!self->flat_mutations_dirty) {
+        goto out;
+    }
+    if (self->num_mutations > self->max_flat_mutations) {
+        self->max_flat_mutations = TSI_MAX(self->num_mutations,
+                self->max_flat_mutations + self->max_flat_mutations / 2);
+        tmp = realloc(self->flat_mutation_node,
+                self->max_flat_mutations * sizeof(node_id_t));
+        if (tmp == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        self->flat_mutation_node = tmp;
+        tmp = realloc(self->flat_mutation_derived_state,
+                self->max_flat_mutations * sizeof(allele_t));
+        if (tmp == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        self->flat_mutation_derived_state = tmp;
+    }
+    j = 0;
+    for (l = 0; l < (site_id_t) self->num_sites; l++) {
+        self->mutation_offset[l] = j;
+        for (u = self->sites.mutations[l]; u != NULL; u = u->next) {
+            self->flat_mutation_node[j] = u->node;
+            self->flat_mutation_derived_state[j] = u->derived_state;
+            j++;
+        }
+    }
+    self->mutation_offset[self->num_sites] = j;
+    assert(j == self->num_mutations);
+    self->flat_mutations_dirty = false;
+out:
+    return ret;
+}
+
+/* Rebuilds the flat left/right index arrays from the AVL indexes if any
+ * edges have been added or removed since the last call. The cost is
+ * linear in the number of edges, which is amortized by the matcher
+ * sweeps that consume the arrays. */
+static int WARN_UNUSED
+tree_sequence_builder_build_checkpoints(tree_sequence_builder_t *self)
+{
+    int ret = 0;
+    const indexed_edge_t *restrict in_edges = self->left_index_edges;
+    const indexed_edge_t *restrict out_edges = self->right_index_edges;
+    const size_t num_edges = self->num_index_edges;
+    const size_t n = self->num_nodes;
+    size_t in_index, out_index;
+    site_id_t left, pos, right, next_position, interval;
+    node_id_t p, c, lsib, rsib, u;
+    node_id_t *restrict parent = NULL;
+    node_id_t *restrict left_child = NULL;
+    node_id_t *restrict right_child = NULL;
+    node_id_t *restrict left_sib = NULL;
+    node_id_t *restrict right_sib = NULL;
+    node_id_t *mem;
+    tree_checkpoint_t *cp;
+    indexed_edge_t edge;
+
+    tsi_safe_free(self->checkpoints);
+    tsi_safe_free(self->checkpoint_mem);
+    self->checkpoints = NULL;
+    self->checkpoint_mem = NULL;
+    self->num_checkpoints = 0;
+    self->num_checkpoint_nodes = n;
+    if (num_edges == 0 || n == 0) {
+        goto out;
+    }
+    interval = TSI_MAX(1, (site_id_t) (self->num_sites / MAX_TREE_CHECKPOINTS));
+    self->checkpoints = malloc(MAX_TREE_CHECKPOINTS * sizeof(tree_checkpoint_t));
+    self->checkpoint_mem = malloc(MAX_TREE_CHECKPOINTS * 5 * n * sizeof(node_id_t));
+    parent = malloc(n * sizeof(node_id_t));
+    left_child = malloc(n * sizeof(node_id_t));
+    right_child = malloc(n * sizeof(node_id_t));
+    left_sib = malloc(n * sizeof(node_id_t));
+    right_sib = malloc(n * sizeof(node_id_t));
+    if (self->checkpoints == NULL || self->checkpoint_mem == NULL
+            || parent == NULL || left_child == NULL || right_child == NULL
+            || left_sib == NULL || right_sib == NULL) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    memset(parent, 0xff, n * sizeof(node_id_t));
+    memset(left_child, 0xff, n * sizeof(node_id_t));
+    memset(right_child, 0xff, n * sizeof(node_id_t));
+    memset(left_sib, 0xff, n * sizeof(node_id_t));
+    memset(right_sib, 0xff, n * sizeof(node_id_t));
+
+    /* Replay the full edge sweep, snapshotting the state at the top of the
+     * loop each time we cross a checkpoint boundary. The edge insertion and
+     * removal operations must be kept in sync with the matcher's, so that
+     * a matcher resuming from a snapshot sees exactly the state it would
+     * have built by sweeping from site 0. */
+    in_index = 0;
+    out_index = 0;
+    left = 0;
+    pos = 0;
+    next_position = interval;
+    while (in_index < num_edges || out_index < num_edges) {
+        if (pos >= next_position && self->num_checkpoints < MAX_TREE_CHECKPOINTS) {
+            cp = self->checkpoints + self->num_checkpoints;
+            mem = self->checkpoint_mem + self->num_checkpoints * 5 * n;
+            cp->left = left;
+            cp->position = pos;
+            cp->in_index = in_index;
+            cp->out_index = out_index;
+            cp->parent = mem;
+            cp->left_child = mem + n;
+            cp->right_child = mem + 2 * n;
+            cp->left_sib = mem + 3 * n;
+            cp->right_sib = mem + 4 * n;
+            memcpy(cp->parent, parent, n * sizeof(node_id_t));
+            memcpy(cp->left_child, left_child, n * sizeof(node_id_t));
+            memcpy(cp->right_child, right_child, n * sizeof(node_id_t));
+            memcpy(cp->left_sib, left_sib, n * sizeof(node_id_t));
+            memcpy(cp->right_sib, right_sib, n * sizeof(node_id_t));
+            self->num_checkpoints++;
+            while (next_position <= pos) {
+                next_position += interval;
+            }
+        }
+        while (out_index < num_edges && (edge = out_edges[out_index]).right == pos) {
+            p = edge.parent;
+            c = edge.child;
+            lsib = left_sib[c];
+            rsib = right_sib[c];
+            if (lsib == NULL_NODE) {
+                left_child[p] = rsib;
+            } else {
+                right_sib[lsib] = rsib;
+            }
+            if (rsib == NULL_NODE) {
+                right_child[p] = lsib;
+            } else {
+                left_sib[rsib] = lsib;
+            }
+            parent[c] = NULL_NODE;
+            left_sib[c] = NULL_NODE;
+            right_sib[c] = NULL_NODE;
+            out_index++;
+        }
+        while (in_index < num_edges && (edge = in_edges[in_index]).left == pos) {
+            p = edge.parent;
+            c = edge.child;
+            u = right_child[p];
+            if (u == NULL_NODE) {
+                left_child[p] = c;
+                left_sib[c] = NULL_NODE;
+                right_sib[c] = NULL_NODE;
+            } else {
+                right_sib[u] = c;
+                left_sib[c] = u;
+                right_sib[c] = NULL_NODE;
+            }
+            parent[c] = p;
+            right_child[p] = c;
+            in_index++;
+        }
+        left = pos;
+        right = (site_id_t) self->num_sites;
+        if (in_index < num_edges) {
+            right = TSI_MIN(right, in_edges[in_index].left);
+        }
+        if (out_index < num_edges) {
+            right = TSI_MIN(right, out_edges[out_index].right);
+        }
+        pos = right;
+    }
+out:
+    tsi_safe_free(parent);
+    tsi_safe_free(left_child);
+    tsi_safe_free(right_child);
+    tsi_safe_free(left_sib);
+    tsi_safe_free(right_sib);
+    return ret;
+}
+
+int WARN_UNUSED
+tree_sequence_builder_freeze_indexes(tree_sequence_builder_t *self)
+{
+    int ret = 0;
+    size_t j, num_edges;
+    avl_node_t *a;
+    edge_t *e;
+    void *tmp;
 
+    ret = tree_sequence_builder_freeze_mutations(self);
+    if (ret != 0) {
+        goto out;
+    }
+    if (!self->flat_indexes_dirty) {
+        goto out;
+    }
+    num_edges = avl_count(&self->left_index);
+    if (num_edges > self->max_index_edges) {
+        self->max_index_edges = TSI_MAX(num_edges,
+                self->max_index_edges + self->max_index_edges / 2);
+        tmp = realloc(self->left_index_edges,
+                self->max_index_edges * sizeof(indexed_edge_t));
+        if (tmp == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        self->left_index_edges = tmp;
+        tmp = realloc(self->right_index_edges,
+                self->max_index_edges * sizeof(indexed_edge_t));
+        if (tmp == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        self->right_index_edges = tmp;
+    }
+    j = 0;
+    for (a = self->left_index.head; a != NULL; a = a->next) {
+        e = (edge_t *) a->item;
+        self->left_index_edges[j].left = e->left;
+        self->left_index_edges[j].right = e->right;
+        self->left_index_edges[j].parent = e->parent;
+        self->left_index_edges[j].child = e->child;
+        j++;
+    }
+    assert(j == num_edges);
+    j = 0;
+    for (a = self->right_index.head; a != NULL; a = a->next) {
+        e = (edge_t *) a->item;
+        self->right_index_edges[j].left = e->left;
+        self->right_index_edges[j].right = e->right;
+        self->right_index_edges[j].parent = e->parent;
+        self->right_index_edges[j].child = e->child;
+        j++;
+    }
+    assert(j == num_edges);
+    self->num_index_edges = num_edges;
+    ret = tree_sequence_builder_build_checkpoints(self);
+    if (ret != 0) {
+        goto out;
+    }
+    self->flat_indexes_dirty = false;
 out:
     return ret;
 }
@@ -264,9 +540,18 @@ tree_sequence_builder_free(tree_sequence_builder_t *self)
     tsi_safe_free(self->path);
     tsi_safe_free(self->node_flags);
     tsi_safe_free(self->sites.mutations);
+    tsi_safe_free(self->mutation_offset);
+    tsi_safe_free(self->flat_mutation_node);
+    tsi_safe_free(self->flat_mutation_derived_state);
+    tsi_safe_free(self->left_index_edges);
+    tsi_safe_free(self->right_index_edges);
+    tsi_safe_free(self->checkpoints);
+    tsi_safe_free(self->checkpoint_mem);
+    tsi_safe_free(self->path_hash);
     block_allocator_free(&self->block_allocator);
     object_heap_free(&self->avl_node_heap);
     object_heap_free(&self->edge_heap);
+    object_heap_free(&self->path_hash_entry_heap);
     return 0;
 }
 
@@ -324,6 +609,84 @@ tree_sequence_builder_free_edge(tree_sequence_builder_t *self, edge_t *edge)
     object_heap_free_object(&self->edge_heap, edge);
 }
 
+static inline size_t
+tree_sequence_builder_path_hash_bucket(tree_sequence_builder_t *self,
+        site_id_t left, site_id_t right, node_id_t parent)
+{
+    uint64_t h = ((uint64_t) left << 42) ^ ((uint64_t) right << 21)
+            ^ (uint64_t) parent;
+
+    /* Fibonacci hashing; the table size is always a power of two. */
+    h *= 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 32;
+    return (size_t) h & (self->path_hash_size - 1);
+}
+
+static int WARN_UNUSED
+tree_sequence_builder_path_hash_insert(tree_sequence_builder_t *self, edge_t *edge)
+{
+    int ret = 0;
+    size_t j, bucket, old_size;
+    path_hash_entry_t **old_hash, *entry, *next;
+
+    if (self->num_path_hash_entries == self->path_hash_size) {
+        /* Rehash into a table twice the size to keep the load factor
+         * below one. */
+        old_hash = self->path_hash;
+        old_size = self->path_hash_size;
+        self->path_hash = calloc(2 * old_size, sizeof(path_hash_entry_t *));
+        if (self->path_hash == NULL) {
+            self->path_hash = old_hash;
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        self->path_hash_size = 2 * old_size;
+        for (j = 0; j < old_size; j++) {
+            for (entry = old_hash[j]; entry != NULL; entry = next) {
+                next = entry->next;
+                bucket = tree_sequence_builder_path_hash_bucket(self,
+                        entry->edge->left, entry->edge->right, entry->edge->parent);
+                entry->next = self->path_hash[bucket];
+                self->path_hash[bucket] = entry;
+            }
+        }
+        free(old_hash);
+    }
+    if (object_heap_empty(&self->path_hash_entry_heap)) {
+        if (object_heap_expand(&self->path_hash_entry_heap) != 0) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+    }
+    entry = (path_hash_entry_t *) object_heap_alloc_object(
+            &self->path_hash_entry_heap);
+    bucket = tree_sequence_builder_path_hash_bucket(self, edge->left,
+            edge->right, edge->parent);
+    entry->edge = edge;
+    entry->next = self->path_hash[bucket];
+    self->path_hash[bucket] = entry;
+    self->num_path_hash_entries++;
+out:
+    return ret;
+}
+
+static void
+tree_sequence_builder_path_hash_remove(tree_sequence_builder_t *self, edge_t *edge)
+{
+    size_t bucket = tree_sequence_builder_path_hash_bucket(self, edge->left,
+            edge->right, edge->parent);
+    path_hash_entry_t **p = &self->path_hash[bucket];
+    path_hash_entry_t *entry;
+
+    while ((*p)->edge != edge) {
+        p = &(*p)->next;
+    }
+    entry = *p;
+    *p = entry->next;
+    object_heap_free_object(&self->path_hash_entry_heap, entry);
+    self->num_path_hash_entries--;
+}
+
 static int WARN_UNUSED
 tree_sequence_builder_expand_nodes(tree_sequence_builder_t *self)
 {
@@ -412,475 +775,30 @@ tree_sequence_builder_add_mutation(tree_sequence_builder_t *self, site_id_t site
         tail->next = list_node;
     }
     self->num_mutations++;
+    self->flat_mutations_dirty = true;
 out:
     return ret;
 }
 
 
-#if 0
-
-typedef struct {
-    site_id_t start;
-    site_id_t end;
-} edge_group_t;
-
-/* Returns true if the specified pair of paths through the specified set
- * of edges are considered equal. */
-static bool
-paths_equal(edge_t *edges, edge_group_t p1, edge_group_t p2)
-{
-    bool ret = false;
-    site_id_t len = p1.end - p1.start;
-    site_id_t j;
-    edge_t edge1, edge2;
-
-    if (len == (p2.end - p2.start)) {
-        ret = true;
-        for (j = 0; j < len; j++) {
-            edge1 = edges[p1.start + j];
-            edge2 = edges[p2.start + j];
-            if (edge1.left != edge2.left || edge1.right != edge2.right
-                    || edge1.parent != edge2.parent) {
-                ret = false;
-                break;
-            }
-        }
-    }
-    return ret;
-}
-
-
-static int
-tree_sequence_builder_resolve_shared_recombs(tree_sequence_builder_t *self)
-{
-    int ret = 0;
-    /* These are both probably way too much, but should be safe upper bounds */
-    size_t max_edges = 2 * self->num_edges;
-    size_t max_paths = self->num_edges;
-    size_t j, k, num_output, num_active, num_filtered, num_paths, num_matches;
-    size_t num_shared_recombinations = 0;
-    site_id_t l;
-    edge_t *active = NULL;
-    edge_t *filtered = NULL;
-    edge_t *output = NULL;
-    edge_group_t *paths = NULL;
-    edge_group_t path;
-    bool *match_found = NULL;
-    bool *marked = NULL;
-    size_t *matches = NULL;
-    size_t **shared_recombinations = NULL;
-    edge_t *tmp;
-    bool prev_cond, next_cond;
-    double parent_time, children_time, new_time;
-    site_id_t left, right;
-    node_id_t new_node;
-
-    active = malloc(max_edges * sizeof(edge_t));
-    filtered = malloc(max_edges * sizeof(edge_t));
-    output = malloc(max_edges * sizeof(edge_t));
-    paths = malloc(max_paths * sizeof(edge_group_t));
-    if (active == NULL || filtered == NULL || output == NULL || paths == NULL) {
-        ret = TSI_ERR_NO_MEMORY;
-        goto out;
-    }
-
-    /* Take a copy of all the extant edges and put them into the active buffer */
-    for (j = 0; j < self->num_edges; j++) {
-        active[j] = self->edges[j];
-        assert(self->time[active[j].child] < self->time[active[j].parent]);
-    }
-
-    num_active = self->num_edges;
-    num_filtered = 0;
-    num_output = 0;
-    num_paths = 0;
-    /* First filter out all edges covering the full interval */
-    for (j = 0; j < num_active; j++) {
-        if (! (active[j].left == 0 && active[j].right == (site_id_t) self->num_sites)) {
-            filtered[num_filtered] = active[j];
-            num_filtered++;
-        } else {
-            output[num_output] = active[j];
-            num_output++;
-        }
-    }
-    tmp = active;
-    active = filtered;
-    filtered = tmp;
-    num_active = num_filtered;
-    num_filtered = 0;
-
-    if (num_active > 0) {
-        /* Sort by (l, r, p, c) to group together all identical (l, r, p) values. */
-        qsort(active, num_active, sizeof(edge_t), cmp_edge_lrpc);
-        prev_cond = false;
-        for (j = 0; j < num_active - 1; j++) {
-            next_cond = (
-                active[j].left == active[j + 1].left &&
-                active[j].right == active[j + 1].right &&
-                active[j].parent == active[j + 1].parent);
-            if (prev_cond || next_cond) {
-                filtered[num_filtered] = active[j];
-                num_filtered++;
-            } else {
-                output[num_output] = active[j];
-                num_output++;
-            }
-            prev_cond = next_cond;
-        }
-        j = num_active - 1;
-        if (prev_cond) {
-            filtered[num_filtered] = active[j];
-            num_filtered++;
-        } else {
-            output[num_output] = active[j];
-            num_output++;
-        }
-
-        tmp = active;
-        active = filtered;
-        filtered = tmp;
-        num_active = num_filtered;
-        num_filtered = 0;
-    }
-
-    if (num_active > 0) {
-        /* sort by (child, left, right) to group together all contiguous */
-        /* TODO comparing by right and parent is probably redundant given the
-         * previous filtering step */
-        qsort(active, num_active, sizeof(edge_t), cmp_edge_clrp);
-        prev_cond = false;
-        for (j = 0; j < num_active - 1; j++) {
-            next_cond = (
-                active[j].right == active[j + 1].left &&
-                active[j].child == active[j + 1].child);
-            if (prev_cond || next_cond) {
-                filtered[num_filtered] = active[j];
-                num_filtered++;
-            } else {
-                output[num_output] = active[j];
-                num_output++;
-            }
-            prev_cond = next_cond;
-        }
-        j = num_active - 1;
-        if (prev_cond) {
-            filtered[num_filtered] = active[j];
-            num_filtered++;
-        } else {
-            output[num_output] = active[j];
-            num_output++;
-        }
-
-        tmp = active;
-        active = filtered;
-        filtered = tmp;
-        num_active = num_filtered;
-        num_filtered = 0;
-    }
-
-    if (num_active > 0) {
-        /* TODO is this step really necessary?? */
-        /* In any case, this block is identical to the one above so it should
-         * be abstracted out .*/
-
-        /* We sort by left, right, parent again to find identical edges.
-         * Remove any that there is only one of. */
-        qsort(active, num_active, sizeof(edge_t), cmp_edge_lrpc);
-        prev_cond = false;
-        for (j = 0; j < num_active - 1; j++) {
-            next_cond = (
-                active[j].left == active[j + 1].left &&
-                active[j].right == active[j + 1].right &&
-                active[j].parent == active[j + 1].parent);
-            if (prev_cond || next_cond) {
-                filtered[num_filtered] = active[j];
-                num_filtered++;
-            } else {
-                output[num_output] = active[j];
-                num_output++;
-            }
-            prev_cond = next_cond;
-        }
-        j = num_active - 1;
-        if (prev_cond) {
-            filtered[num_filtered] = active[j];
-            num_filtered++;
-        } else {
-            output[num_output] = active[j];
-            num_output++;
-        }
-
-        tmp = active;
-        active = filtered;
-        filtered = tmp;
-        num_active = num_filtered;
-        num_filtered = 0;
-    }
-
-    if (num_active > 0) {
-        assert(num_active + num_output == self->num_edges);
-        /* Sort by the child, left again so that we can find the contiguous paths */
-        qsort(active, num_active, sizeof(edge_t), cmp_edge_clrp);
-        paths[0].start = 0;
-        for (j = 1; j < num_active; j++) {
-            if (active[j - 1].right != active[j].left ||
-                    active[j - 1].child != active[j].child) {
-                if (j - paths[num_paths].start > 1) {
-                    paths[num_paths].end = j;
-                    num_paths++;
-                    assert(num_paths < max_paths);
-                }
-                paths[num_paths].start = j;
-            }
-        }
-        j = num_active;
-        if (j - paths[num_paths].start > 1) {
-            paths[num_paths].end = j;
-            num_paths++;
-            assert(num_paths < max_paths);
-        }
-    }
-
-    if (num_paths > 0) {
-        match_found = calloc(num_paths, sizeof(bool));
-        matches = malloc(num_paths * sizeof(size_t));
-        shared_recombinations = calloc(num_paths, sizeof(size_t *));
-        if (match_found == NULL || matches == NULL || shared_recombinations == NULL) {
-            ret = TSI_ERR_NO_MEMORY;
-            goto out;
-        }
-        for (j = 0; j < num_paths; j++) {
-            num_matches = 0;
-            if (! match_found[j]) {
-                for (k = j + 1; k < num_paths; k++) {
-                    if ((!match_found[k])
-                            && paths_equal(active, paths[j], paths[k])) {
-                        match_found[k] = true;
-                        matches[num_matches] = k;
-                        num_matches++;
-                    }
-                }
-            }
-            if (num_matches > 0) {
-                shared_recombinations[num_shared_recombinations] = malloc(
-                        (num_matches + 2) * sizeof(size_t));
-                if (shared_recombinations[num_shared_recombinations] == NULL) {
-                    ret = TSI_ERR_NO_MEMORY;
-                    goto out;
-                }
-                shared_recombinations[num_shared_recombinations][0] = j;
-                for (k = 0; k < num_matches; k++) {
-                    shared_recombinations[num_shared_recombinations][k + 1] = matches[k];
-                }
-                /* Insert the sentinel */
-                shared_recombinations[num_shared_recombinations][num_matches + 1] = -1;
-                num_shared_recombinations++;
-            }
-        }
-    }
-
-    if (num_shared_recombinations > 0) {
-
-        /* printf("Active  = \n"); */
-        /* for (j = 0; j < num_active; j++) { */
-        /*     printf("\t%d\t%d\t%d\t%d\n", active[j].left, active[j].right, */
-        /*             active[j].parent, active[j].child); */
-        /* } */
-        /* printf("Paths:\n"); */
-        /* for (j = 0; j < num_paths; j++) { */
-        /*     printf("Path %d (%d, %d)\n", (int) j, paths[j].start, paths[j].end); */
-        /*     for (k = paths[j].start; k < paths[j].end; k++) { */
-        /*         printf("\t\t%d\t%d\t%d\t%d\n", active[k].left, active[k].right, */
-        /*                 active[k].parent, active[k].child); */
-        /*         assert(self->time[active[k].child] < self->time[active[k].parent]); */
-        /*     } */
-        /* } */
-        /* printf("%d shared recombinations \n", (int) num_shared_recombinations); */
-        /* for (j = 0; j < num_shared_recombinations; j++) { */
-        /*     for (k = 0; shared_recombinations[j][k] != (size_t) (-1); k++) { */
-        /*         printf("%d, ", (int) shared_recombinations[j][k]); */
-        /*     } */
-        /*     printf("\n"); */
-        /* } */
-
-        marked = calloc(num_active, sizeof(bool));
-        if (marked == NULL) {
-            ret = TSI_ERR_NO_MEMORY;
-            goto out;
-        }
-        for (j = 0; j < num_shared_recombinations; j++) {
-            /* printf("SHARED RECOMBINATION\n"); */
-            /* for (k = 0; shared_recombinations[j][k] != (size_t) (-1); k++) { */
-            /*     path = paths[shared_recombinations[j][k]]; */
-            /*     printf("%d: (%d, %d)\n", (int) shared_recombinations[j][k], */
-            /*             path.start, path.end); */
-            /*     for (l = path.start; l < path.end; l++) { */
-            /*         printf("\t%d\t%d\t%d\t%d\t:%.14f %.14f:%d %d\n", active[l].left, active[l].right, */
-            /*                 active[l].parent, active[l].child, */
-            /*                 self->time[active[l].parent], self->time[active[l].child], */
-            /*                 self->node_flags[active[l].parent], self->node_flags[active[l].child]); */
-            /*         assert(self->time[active[l].child] < self->time[active[l].parent]); */
-            /*     } */
-            /* } */
-            /* check if we have a synthetic child on any of the paths */
-            node_id_t synthetic_child = -1;
-            for (k = 0; shared_recombinations[j][k] != (size_t) (-1); k++) {
-                path = paths[shared_recombinations[j][k]];
-                if (self->node_flags[active[path.start].child] == 0) {
-                    synthetic_child = active[path.start].child;
-                }
-            }
-            if (synthetic_child != -1) {
-                /* If we have a synthetic child, the we already have a path covering
-                 * the region. Update all other paths to use this existing path.
-                 */
-                /* printf("synthetic child = %d\n", synthetic_child); */
-
-                for (k = 0; shared_recombinations[j][k] != (size_t) (-1); k++) {
-                    path = paths[shared_recombinations[j][k]];
-                    left = active[path.start].left;
-                    right = active[path.end - 1].right;
-                    parent_time = self->time[synthetic_child];
-                    node_id_t child = active[path.start].child;
-                    /* We can have situations where multiple paths occur at the same
-                     * time. Easiest to just skip these */
-                    double child_time = self->time[child];
-                    if (child != synthetic_child && parent_time > child_time) {
-                        /* Mark these edges as unused */
-                        for (l = path.start; l < path.end; l++) {
-                            assert(!marked[l]);
-                            marked[l] = true;
-                        }
-                        l = path.start;
-                        assert(num_output < max_edges);
-                        output[num_output].left = left;
-                        output[num_output].right = right;
-                        output[num_output].parent = synthetic_child;
-                        output[num_output].child = child;
-                        /* printf("\tADD y %d\t%d\t%d\t%d\n", output[num_output].left, */
-                        /*         output[num_output].right, */
-                        /*         output[num_output].parent, output[num_output].child); */
-                        num_output++;
-                    }
-                }
-            } else {
-
-                /* Mark these edges as used */
-                for (k = 0; shared_recombinations[j][k] != (size_t) (-1); k++) {
-                    path = paths[shared_recombinations[j][k]];
-                    for (l = path.start; l < path.end; l++) {
-                        assert(!marked[l]);
-                        marked[l] = true;
-                    }
-                }
-                path = paths[shared_recombinations[j][0]];
-                left = active[path.start].left;
-                right = active[path.end - 1].right;
-                /* The parents from the first path */
-                parent_time = self->time[0] + 1;
-                for (l = path.start; l < path.end; l++) {
-                     parent_time = TSI_MIN(parent_time, self->time[active[l].parent]);
-                }
-                /* Get the chilren time from the first edge in each path. */
-                children_time = -1;
-                for (k = 0; shared_recombinations[j][k] != (size_t) (-1); k++) {
-                    path = paths[shared_recombinations[j][k]];
-                    children_time = TSI_MAX(children_time, self->time[active[path.start].child]);
-                }
-                new_time = children_time + (parent_time - children_time) / 2;
-                new_node = tree_sequence_builder_add_node(self, new_time, false);
-                if (new_node < 0) {
-                    ret = new_node;
-                    goto out;
-                }
-                /* printf("parent_time = %f, children_time = %f node_time=%.14f node=%d\n", */
-                /*         parent_time, children_time, new_time, new_node); */
-                /* For each edge in the path, add a new edge with the new node as the
-                 * child. */
-                path = paths[shared_recombinations[j][0]];
-                for (l = path.start; l < path.end; l++) {
-                    assert(num_output < max_edges);
-                    output[num_output].left = active[l].left;
-                    output[num_output].right = active[l].right;
-                    output[num_output].parent = active[l].parent;
-                    output[num_output].child = new_node;
-                    /* printf("\tADD x %d\t%d\t%d\t%d\n", output[num_output].left, */
-                    /*         output[num_output].right, */
-                    /*         output[num_output].parent, output[num_output].child); */
-                    num_output++;
-                }
-                /* For each child add a new edge covering the whole interval */
-                for (k = 0; shared_recombinations[j][k] != (size_t) (-1); k++) {
-                    path = paths[shared_recombinations[j][k]];
-                    l = path.start;
-                    assert(num_output < max_edges);
-                    output[num_output].left = left;
-                    output[num_output].right = right;
-                    output[num_output].parent = new_node;
-                    output[num_output].child = active[l].child;
-                    /* printf("\tADD y %d\t%d\t%d\t%d\n", output[num_output].left, */
-                    /*         output[num_output].right, */
-                    /*         output[num_output].parent, output[num_output].child); */
-                    num_output++;
-                }
-            }
-        }
-
-        /* Finally append any unmarked edges to the output and save */
-        for (j = 0; j < num_active; j++) {
-            if (! marked[j]) {
-                assert(num_output < max_edges);
-                output[num_output] = active[j];
-                num_output++;
-            }
-        }
-        /* printf("OUTPUT\n"); */
-        /* for (j = 0; j < num_output; j++) { */
-        /*     printf("%d\t%d\t%d\t%d\n", output[j].left, output[j].right, */
-        /*             output[j].parent, output[j].child); */
-
-        /* } */
-        memcpy(self->edges, output, num_output * sizeof(edge_t));
-        self->num_edges = num_output;
-    }
-
-out:
-    tsi_safe_free(active);
-    tsi_safe_free(filtered);
-    tsi_safe_free(output);
-    tsi_safe_free(paths);
-    tsi_safe_free(match_found);
-    tsi_safe_free(matches);
-    tsi_safe_free(marked);
-    for (j = 0; j < num_shared_recombinations; j++) {
-        tsi_safe_free(shared_recombinations[j]);
-    }
-    tsi_safe_free(shared_recombinations);
-    return ret;
-}
-#endif
-
 static int WARN_UNUSED
 tree_sequence_builder_unindex_edge(tree_sequence_builder_t *self, edge_t *edge)
 {
     int ret = 0;
     avl_node_t *avl_node;
 
-    avl_node = avl_search(&self->left_index, edge);
+    avl_node = left_index_search(&self->left_index, edge);
     assert(avl_node != NULL);
     avl_unlink_node(&self->left_index, avl_node);
     tree_sequence_builder_free_avl_node(self, avl_node);
 
-    avl_node = avl_search(&self->right_index, edge);
+    avl_node = right_index_search(&self->right_index, edge);
     assert(avl_node != NULL);
     avl_unlink_node(&self->right_index, avl_node);
     tree_sequence_builder_free_avl_node(self, avl_node);
 
-    avl_node = avl_search(&self->path_index, edge);
-    assert(avl_node != NULL);
-    avl_unlink_node(&self->path_index, avl_node);
-    tree_sequence_builder_free_avl_node(self, avl_node);
+    tree_sequence_builder_path_hash_remove(self, edge);
+    self->flat_indexes_dirty = true;
     return ret;
 }
 
@@ -895,7 +813,7 @@ tree_sequence_builder_index_edge(tree_sequence_builder_t *self, edge_t *edge)
         ret = TSI_ERR_NO_MEMORY;
         goto out;
     }
-    avl_node = avl_insert_node(&self->left_index, avl_node);
+    avl_node = left_index_insert(&self->left_index, avl_node);
     assert(avl_node != NULL);
 
     avl_node = tree_sequence_builder_alloc_avl_node(self, edge);
@@ -903,28 +821,26 @@ tree_sequence_builder_index_edge(tree_sequence_builder_t *self, edge_t *edge)
         ret = TSI_ERR_NO_MEMORY;
         goto out;
     }
-    avl_node = avl_insert_node(&self->right_index, avl_node);
+    avl_node = right_index_insert(&self->right_index, avl_node);
     assert(avl_node != NULL);
 
-    avl_node = tree_sequence_builder_alloc_avl_node(self, edge);
-    if (avl_node == NULL) {
-        ret = TSI_ERR_NO_MEMORY;
+    ret = tree_sequence_builder_path_hash_insert(self, edge);
+    if (ret != 0) {
         goto out;
     }
-    avl_node = avl_insert_node(&self->path_index, avl_node);
-    assert(avl_node != NULL);
+    self->flat_indexes_dirty = true;
 out:
     return ret;
 }
 
 static int WARN_UNUSED
-tree_sequence_builder_unindex_edges(tree_sequence_builder_t *self, node_id_t node)
+tree_sequence_builder_index_edges(tree_sequence_builder_t *self, node_id_t node)
 {
     int ret = 0;
     edge_t *edge;
 
     for (edge = self->path[node]; edge != NULL; edge = edge->next) {
-        ret = tree_sequence_builder_unindex_edge(self, edge);
+        ret = tree_sequence_builder_index_edge(self, edge);
         if (ret != 0) {
             goto out;
         }
@@ -933,58 +849,24 @@ out:
     return ret;
 }
 
-static int WARN_UNUSED
-tree_sequence_builder_index_edges(tree_sequence_builder_t *self, node_id_t node)
-{
-    int ret = 0;
-    edge_t *edge;
-
-    for (edge = self->path[node]; edge != NULL; edge = edge->next) {
-        ret = tree_sequence_builder_index_edge(self, edge);
-        if (ret != 0) {
-            goto out;
-        }
-    }
-out:
-    return ret;
-}
-
-/* Looks up the path index to find a matching edge, and returns it.
- */
-static edge_t *
-tree_sequence_builder_find_match(tree_sequence_builder_t *self, edge_t *query)
+/* Looks up the path index to find a matching edge, and returns it. If
+ * several indexed edges carry the segment, the one with the smallest
+ * child id is returned so the choice is deterministic. */
+static edge_t *
+tree_sequence_builder_find_match(tree_sequence_builder_t *self, edge_t *query)
 {
     edge_t *ret = NULL;
-    edge_t search, *found;
-    avl_node_t *avl_node;
-
-    search.left = query->left;
-    search.right = query->right;
-    search.parent = query->parent;
-    search.child = 0;
+    edge_t *found;
+    path_hash_entry_t *entry;
+    size_t bucket = tree_sequence_builder_path_hash_bucket(self, query->left,
+            query->right, query->parent);
 
-    avl_search_closest(&self->path_index, &search, &avl_node);
-    if (avl_node != NULL) {
-        found = (edge_t *) avl_node->item;
+    for (entry = self->path_hash[bucket]; entry != NULL; entry = entry->next) {
+        found = entry->edge;
         if (found->left == query->left && found->right == query->right
-                && found->parent == query->parent) {
+                && found->parent == query->parent
+                && (ret == NULL || found->child < ret->child)) {
             ret = found;
-        } else {
-            /* Check the adjacent nodes. */
-            if (avl_node->prev != NULL) {
-                found = (edge_t *) avl_node->prev->item;
-                if (found->left == query->left && found->right == query->right
-                        && found->parent == query->parent) {
-                    ret = found;
-                }
-            }
-            if (ret == NULL && avl_node->next != NULL) {
-                found = (edge_t *) avl_node->next->item;
-                if (found->left == query->left && found->right == query->right
-                        && found->parent == query->parent) {
-                    ret = found;
-                }
-            }
         }
     }
     return ret;
@@ -1040,6 +922,53 @@ tree_sequence_builder_squash_edges(tree_sequence_builder_t *self, node_id_t node
     }
 }
 
+/* The equivalent of squash_edges for a node whose edges are currently
+ * indexed: when two edges are merged, only their own index entries are
+ * updated, rather than the whole path being unindexed and reindexed. */
+static int WARN_UNUSED
+tree_sequence_builder_squash_indexed_edges(tree_sequence_builder_t *self,
+        node_id_t node)
+{
+    int ret = 0;
+    edge_t *x, *prev, *next;
+    avl_node_t *avl_node;
+
+    prev = self->path[node];
+    assert(prev != NULL);
+    x = prev->next;
+    while (x != NULL) {
+        next = x->next;
+        if (prev->right == x->left && prev->child == x->child
+                && prev->parent == x->parent) {
+            ret = tree_sequence_builder_unindex_edge(self, x);
+            if (ret != 0) {
+                goto out;
+            }
+            /* Extending prev's right coordinate moves it in the right
+             * index and changes its path hash key. */
+            avl_node = right_index_search(&self->right_index, prev);
+            assert(avl_node != NULL);
+            avl_unlink_node(&self->right_index, avl_node);
+            tree_sequence_builder_path_hash_remove(self, prev);
+            prev->right = x->right;
+            avl_init_node(avl_node, prev);
+            avl_node = right_index_insert(&self->right_index, avl_node);
+            assert(avl_node != NULL);
+            ret = tree_sequence_builder_path_hash_insert(self, prev);
+            if (ret != 0) {
+                goto out;
+            }
+            prev->next = next;
+            tree_sequence_builder_free_edge(self, x);
+        } else {
+            prev = x;
+        }
+        x = next;
+    }
+out:
+    return ret;
+}
+
 /* Create a new synthetic ancestor which consists of the shared path
  * segments of existing ancestors. */
 static int
@@ -1054,11 +983,6 @@ tree_sequence_builder_make_synthetic_node(tree_sequence_builder_t *self,
     double min_parent_time;
     int j;
 
-    ret = tree_sequence_builder_unindex_edges(self, mapped_child);
-    if (ret != 0) {
-        goto out;
-    }
-
     min_parent_time = self->time[0] + 1;
     for (j = 0; j < num_mapped; j++) {
         if (mapped[j].dest->child == mapped_child) {
@@ -1089,19 +1013,29 @@ tree_sequence_builder_make_synthetic_node(tree_sequence_builder_t *self,
                 prev->next = edge;
             }
             prev = edge;
+            /* Re-parenting the mapped edge changes its path hash key but
+             * not its position in the left and right indexes, which are
+             * keyed on the child's coordinates and time, so only the hash
+             * entry needs updating. */
+            tree_sequence_builder_path_hash_remove(self, mapped[j].dest);
             mapped[j].source->parent = synthetic_node;
             mapped[j].dest->parent = synthetic_node;
+            ret = tree_sequence_builder_path_hash_insert(self, mapped[j].dest);
+            if (ret != 0) {
+                goto out;
+            }
         }
     }
     self->path[synthetic_node] = head;
     tree_sequence_builder_squash_edges(self, synthetic_node);
-    tree_sequence_builder_squash_edges(self, mapped_child);
-
-    ret = tree_sequence_builder_index_edges(self, synthetic_node);
+    ret = tree_sequence_builder_squash_indexed_edges(self, mapped_child);
     if (ret != 0) {
         goto out;
     }
-    ret = tree_sequence_builder_index_edges(self, mapped_child);
+    /* The parents stored in the flat index copies are now stale. */
+    self->flat_indexes_dirty = true;
+
+    ret = tree_sequence_builder_index_edges(self, synthetic_node);
     if (ret != 0) {
         goto out;
     }
@@ -1373,23 +1307,504 @@ tree_sequence_builder_dump_mutations(tree_sequence_builder_t *self,
 {
     int ret = 0;
     site_id_t l;
-    mutation_list_node_t *u;
     mutation_id_t p;
-    mutation_id_t j = 0;
+    mutation_id_t j;
+    size_t k;
 
+    ret = tree_sequence_builder_freeze_mutations(self);
+    if (ret != 0) {
+        goto out;
+    }
+    if (self->num_mutations > 0) {
+        memcpy(node, self->flat_mutation_node,
+                self->num_mutations * sizeof(node_id_t));
+        memcpy(derived_state, self->flat_mutation_derived_state,
+                self->num_mutations * sizeof(allele_t));
+    }
+    j = 0;
     for (l = 0; l < (site_id_t) self->num_sites; l++) {
         p = j;
-        for (u = self->sites.mutations[l]; u != NULL; u = u->next) {
+        for (k = self->mutation_offset[l]; k < self->mutation_offset[l + 1]; k++) {
             site[j] = l;
-            node[j] = u->node;
-            derived_state[j] = u->derived_state;
-            parent[j] = -1;
-            if (u->derived_state == 0) {
-                parent[j] = p;
-            }
+            parent[j] = self->flat_mutation_derived_state[k] == 0 ? p : -1;
+            j++;
+        }
+    }
+out:
+    return ret;
+}
+
+/* Single-file binary snapshot format. The edges are written in path
+ * order together with the left and right index orderings as index
+ * permutations, so that a restore can rebuild the AVL indexes by
+ * bulk-loading perfectly balanced trees from presorted input instead of
+ * inserting and rebalancing edge by edge. */
+
+#define TSI_SNAPSHOT_MAGIC 0x0050414e53495354ULL /* "TSISNAP\0" */
+#define TSI_SNAPSHOT_VERSION 1
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint64_t num_sites;
+    uint64_t num_nodes;
+    uint64_t num_edges;
+    uint64_t num_mutations;
+} snapshot_header_t;
+
+typedef struct {
+    edge_t *edge;
+    uint64_t index;
+} edge_pointer_map_t;
+
+static int
+cmp_edge_pointer(const void *a, const void *b)
+{
+    const edge_pointer_map_t *ca = (const edge_pointer_map_t *) a;
+    const edge_pointer_map_t *cb = (const edge_pointer_map_t *) b;
+
+    return (ca->edge > cb->edge) - (ca->edge < cb->edge);
+}
+
+/* Returns the path-order index of the specified edge from the pointer
+ * map, which is sorted on the edge addresses. */
+static uint64_t
+edge_pointer_map_find(const edge_pointer_map_t *map, size_t n, const edge_t *edge)
+{
+    size_t lo = 0;
+    size_t hi = n;
+    size_t mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (map[mid].edge < edge) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    assert(lo < n && map[lo].edge == edge);
+    return map[lo].index;
+}
+
+static int WARN_UNUSED
+snapshot_write(FILE *f, const void *buf, size_t size, size_t count)
+{
+    int ret = 0;
+
+    if (count > 0 && fwrite(buf, size, count, f) != count) {
+        ret = TSI_ERR_IO;
+    }
+    return ret;
+}
+
+static int WARN_UNUSED
+snapshot_read(FILE *f, void *buf, size_t size, size_t count)
+{
+    int ret = 0;
+
+    if (count > 0 && fread(buf, size, count, f) != count) {
+        ret = TSI_ERR_IO;
+    }
+    return ret;
+}
+
+int
+tree_sequence_builder_dump_snapshot(tree_sequence_builder_t *self, const char *path)
+{
+    int ret = 0;
+    FILE *f = NULL;
+    const size_t num_edges = avl_count(&self->left_index);
+    size_t j, u;
+    edge_t *e;
+    avl_node_t *a;
+    mutation_list_node_t *m;
+    site_id_t l;
+    snapshot_header_t header;
+    site_id_t *left = NULL;
+    site_id_t *right = NULL;
+    node_id_t *parent = NULL;
+    node_id_t *child = NULL;
+    uint64_t *order = NULL;
+    edge_pointer_map_t *map = NULL;
+    site_id_t *mutation_site = NULL;
+    node_id_t *mutation_node = NULL;
+    allele_t *mutation_derived_state = NULL;
+
+    left = malloc(num_edges * sizeof(site_id_t));
+    right = malloc(num_edges * sizeof(site_id_t));
+    parent = malloc(num_edges * sizeof(node_id_t));
+    child = malloc(num_edges * sizeof(node_id_t));
+    order = malloc(num_edges * sizeof(uint64_t));
+    map = malloc(num_edges * sizeof(edge_pointer_map_t));
+    mutation_site = malloc(self->num_mutations * sizeof(site_id_t));
+    mutation_node = malloc(self->num_mutations * sizeof(node_id_t));
+    mutation_derived_state = malloc(self->num_mutations * sizeof(allele_t));
+    if ((num_edges > 0 && (left == NULL || right == NULL || parent == NULL
+                || child == NULL || order == NULL || map == NULL))
+            || (self->num_mutations > 0 && (mutation_site == NULL
+                || mutation_node == NULL || mutation_derived_state == NULL))) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    /* Flatten the edges in path order and build the pointer -> index map
+     * used to serialize the index orderings. */
+    j = 0;
+    for (u = 0; u < self->num_nodes; u++) {
+        for (e = self->path[u]; e != NULL; e = e->next) {
+            left[j] = e->left;
+            right[j] = e->right;
+            parent[j] = e->parent;
+            child[j] = e->child;
+            map[j].edge = e;
+            map[j].index = j;
             j++;
         }
     }
+    assert(j == num_edges);
+    qsort(map, num_edges, sizeof(edge_pointer_map_t), cmp_edge_pointer);
+
+    j = 0;
+    for (l = 0; l < (site_id_t) self->num_sites; l++) {
+        for (m = self->sites.mutations[l]; m != NULL; m = m->next) {
+            mutation_site[j] = l;
+            mutation_node[j] = m->node;
+            mutation_derived_state[j] = m->derived_state;
+            j++;
+        }
+    }
+    assert(j == self->num_mutations);
+
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        ret = TSI_ERR_IO;
+        goto out;
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = TSI_SNAPSHOT_MAGIC;
+    header.version = TSI_SNAPSHOT_VERSION;
+    header.flags = (uint32_t) self->flags;
+    header.num_sites = self->num_sites;
+    header.num_nodes = self->num_nodes;
+    header.num_edges = num_edges;
+    header.num_mutations = self->num_mutations;
+    ret = snapshot_write(f, &header, sizeof(header), 1);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = snapshot_write(f, self->node_flags, sizeof(uint32_t), self->num_nodes);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = snapshot_write(f, self->time, sizeof(double), self->num_nodes);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = snapshot_write(f, left, sizeof(site_id_t), num_edges);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = snapshot_write(f, right, sizeof(site_id_t), num_edges);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = snapshot_write(f, parent, sizeof(node_id_t), num_edges);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = snapshot_write(f, child, sizeof(node_id_t), num_edges);
+    if (ret != 0) {
+        goto out;
+    }
+    j = 0;
+    for (a = self->left_index.head; a != NULL; a = a->next) {
+        order[j] = edge_pointer_map_find(map, num_edges, (edge_t *) a->item);
+        j++;
+    }
+    ret = snapshot_write(f, order, sizeof(uint64_t), num_edges);
+    if (ret != 0) {
+        goto out;
+    }
+    j = 0;
+    for (a = self->right_index.head; a != NULL; a = a->next) {
+        order[j] = edge_pointer_map_find(map, num_edges, (edge_t *) a->item);
+        j++;
+    }
+    ret = snapshot_write(f, order, sizeof(uint64_t), num_edges);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = snapshot_write(f, mutation_site, sizeof(site_id_t), self->num_mutations);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = snapshot_write(f, mutation_node, sizeof(node_id_t), self->num_mutations);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = snapshot_write(f, mutation_derived_state, sizeof(allele_t),
+            self->num_mutations);
+    if (ret != 0) {
+        goto out;
+    }
+    if (fclose(f) != 0) {
+        ret = TSI_ERR_IO;
+    }
+    f = NULL;
+out:
+    if (f != NULL) {
+        fclose(f);
+    }
+    tsi_safe_free(left);
+    tsi_safe_free(right);
+    tsi_safe_free(parent);
+    tsi_safe_free(child);
+    tsi_safe_free(order);
+    tsi_safe_free(map);
+    tsi_safe_free(mutation_site);
+    tsi_safe_free(mutation_node);
+    tsi_safe_free(mutation_derived_state);
+    return ret;
+}
+
+/* Builds a perfectly balanced AVL subtree over nodes[0, n), which are
+ * already in sorted order, and returns its root. No comparisons or
+ * rebalancing are performed. */
+static avl_node_t *
+tree_sequence_builder_build_balanced_avl(avl_node_t **nodes, size_t n,
+        avl_node_t *parent)
+{
+    size_t mid;
+    avl_node_t *root;
+    unsigned char left_depth, right_depth;
+
+    if (n == 0) {
+        return NULL;
+    }
+    mid = n / 2;
+    root = nodes[mid];
+    root->parent = parent;
+    root->left = tree_sequence_builder_build_balanced_avl(nodes, mid, root);
+    root->right = tree_sequence_builder_build_balanced_avl(nodes + mid + 1,
+            n - mid - 1, root);
+    root->count = (unsigned int) n;
+    left_depth = root->left == NULL ? 0 : root->left->depth;
+    right_depth = root->right == NULL ? 0 : root->right->depth;
+    root->depth = (unsigned char) (1 + TSI_MAX(left_depth, right_depth));
+    return root;
+}
+
+static void
+tree_sequence_builder_bulk_load_index(avl_tree_t *tree, avl_node_t **nodes,
+        size_t n)
+{
+    size_t j;
+
+    for (j = 0; j < n; j++) {
+        nodes[j]->prev = j == 0 ? NULL : nodes[j - 1];
+        nodes[j]->next = j == n - 1 ? NULL : nodes[j + 1];
+    }
+    tree->head = n == 0 ? NULL : nodes[0];
+    tree->tail = n == 0 ? NULL : nodes[n - 1];
+    tree->top = tree_sequence_builder_build_balanced_avl(nodes, n, NULL);
+}
+
+int
+tree_sequence_builder_restore_snapshot(tree_sequence_builder_t *self,
+        const char *path)
+{
+    int ret = 0;
+    FILE *f = NULL;
+    size_t num_edges, num_mutations, j;
+    edge_t *edge, *prev;
+    snapshot_header_t header;
+    uint32_t *node_flags = NULL;
+    double *time = NULL;
+    site_id_t *left = NULL;
+    site_id_t *right = NULL;
+    node_id_t *parent = NULL;
+    node_id_t *child = NULL;
+    uint64_t *order = NULL;
+    edge_t **edges = NULL;
+    avl_node_t **avl_nodes = NULL;
+    site_id_t *mutation_site = NULL;
+    node_id_t *mutation_node = NULL;
+    allele_t *mutation_derived_state = NULL;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        ret = TSI_ERR_IO;
+        goto out;
+    }
+    ret = snapshot_read(f, &header, sizeof(header), 1);
+    if (ret != 0) {
+        goto out;
+    }
+    if (header.magic != TSI_SNAPSHOT_MAGIC
+            || header.version != TSI_SNAPSHOT_VERSION
+            || header.num_sites != self->num_sites
+            || self->num_nodes != 0) {
+        ret = TSI_ERR_FILE_FORMAT;
+        goto out;
+    }
+    num_edges = header.num_edges;
+    num_mutations = header.num_mutations;
+
+    node_flags = malloc(header.num_nodes * sizeof(uint32_t));
+    time = malloc(header.num_nodes * sizeof(double));
+    left = malloc(num_edges * sizeof(site_id_t));
+    right = malloc(num_edges * sizeof(site_id_t));
+    parent = malloc(num_edges * sizeof(node_id_t));
+    child = malloc(num_edges * sizeof(node_id_t));
+    order = malloc(num_edges * sizeof(uint64_t));
+    edges = malloc(num_edges * sizeof(edge_t *));
+    avl_nodes = malloc(num_edges * sizeof(avl_node_t *));
+    mutation_site = malloc(num_mutations * sizeof(site_id_t));
+    mutation_node = malloc(num_mutations * sizeof(node_id_t));
+    mutation_derived_state = malloc(num_mutations * sizeof(allele_t));
+    if ((header.num_nodes > 0 && (node_flags == NULL || time == NULL))
+            || (num_edges > 0 && (left == NULL || right == NULL
+                || parent == NULL || child == NULL || order == NULL
+                || edges == NULL || avl_nodes == NULL))
+            || (num_mutations > 0 && (mutation_site == NULL
+                || mutation_node == NULL || mutation_derived_state == NULL))) {
+        ret = TSI_ERR_NO_MEMORY;
+        goto out;
+    }
+    ret = snapshot_read(f, node_flags, sizeof(uint32_t), header.num_nodes);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = snapshot_read(f, time, sizeof(double), header.num_nodes);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = tree_sequence_builder_restore_nodes(self, header.num_nodes,
+            node_flags, time);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = snapshot_read(f, left, sizeof(site_id_t), num_edges);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = snapshot_read(f, right, sizeof(site_id_t), num_edges);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = snapshot_read(f, parent, sizeof(node_id_t), num_edges);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = snapshot_read(f, child, sizeof(node_id_t), num_edges);
+    if (ret != 0) {
+        goto out;
+    }
+    /* Recreate the edges and path lists; the edges are stored in path
+     * order, exactly as restore_edges expects. */
+    prev = NULL;
+    for (j = 0; j < num_edges; j++) {
+        if (j > 0 && child[j - 1] > child[j]) {
+            ret = TSI_ERR_UNSORTED_EDGES;
+            goto out;
+        }
+        edge = tree_sequence_builder_alloc_edge(self, left[j], right[j],
+                parent[j], child[j], NULL);
+        if (edge == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+        if (self->path[child[j]] == NULL) {
+            self->path[child[j]] = edge;
+        } else {
+            if (prev->right > edge->left) {
+                ret = TSI_ERR_UNSORTED_EDGES;
+                goto out;
+            }
+            prev->next = edge;
+        }
+        edges[j] = edge;
+        prev = edge;
+    }
+    /* Bulk-load the two ordered indexes from the serialized orderings. */
+    ret = snapshot_read(f, order, sizeof(uint64_t), num_edges);
+    if (ret != 0) {
+        goto out;
+    }
+    for (j = 0; j < num_edges; j++) {
+        if (order[j] >= num_edges) {
+            ret = TSI_ERR_FILE_FORMAT;
+            goto out;
+        }
+        avl_nodes[j] = tree_sequence_builder_alloc_avl_node(self,
+                edges[order[j]]);
+        if (avl_nodes[j] == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+    }
+    tree_sequence_builder_bulk_load_index(&self->left_index, avl_nodes,
+            num_edges);
+    ret = snapshot_read(f, order, sizeof(uint64_t), num_edges);
+    if (ret != 0) {
+        goto out;
+    }
+    for (j = 0; j < num_edges; j++) {
+        if (order[j] >= num_edges) {
+            ret = TSI_ERR_FILE_FORMAT;
+            goto out;
+        }
+        avl_nodes[j] = tree_sequence_builder_alloc_avl_node(self,
+                edges[order[j]]);
+        if (avl_nodes[j] == NULL) {
+            ret = TSI_ERR_NO_MEMORY;
+            goto out;
+        }
+    }
+    tree_sequence_builder_bulk_load_index(&self->right_index, avl_nodes,
+            num_edges);
+    /* The path hash has no ordering, so the edges are simply inserted. */
+    for (j = 0; j < num_edges; j++) {
+        ret = tree_sequence_builder_path_hash_insert(self, edges[j]);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+    ret = snapshot_read(f, mutation_site, sizeof(site_id_t), num_mutations);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = snapshot_read(f, mutation_node, sizeof(node_id_t), num_mutations);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = snapshot_read(f, mutation_derived_state, sizeof(allele_t), num_mutations);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = tree_sequence_builder_restore_mutations(self, num_mutations,
+            mutation_site, mutation_node, mutation_derived_state);
+    if (ret != 0) {
+        goto out;
+    }
+    self->flat_indexes_dirty = true;
+out:
+    if (f != NULL) {
+        fclose(f);
+    }
+    tsi_safe_free(node_flags);
+    tsi_safe_free(time);
+    tsi_safe_free(left);
+    tsi_safe_free(right);
+    tsi_safe_free(parent);
+    tsi_safe_free(child);
+    tsi_safe_free(order);
+    tsi_safe_free(edges);
+    tsi_safe_free(avl_nodes);
+    tsi_safe_free(mutation_site);
+    tsi_safe_free(mutation_node);
+    tsi_safe_free(mutation_derived_state);
     return ret;
 }
 
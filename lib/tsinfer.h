@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #include "block_allocator.h"
 #include "object_heap.h"
@@ -41,6 +42,9 @@
 #define TSI_COMPRESS_PATH 1
 
 #define TSI_EXTENDED_CHECKS 1
+/* Back the matcher's traceback store with 2MB hugepages; see
+ * BLOCK_ALLOCATOR_HUGEPAGE. */
+#define TSI_HUGEPAGES 2
 
 /* TODO change all instances of this to node_id_t */
 typedef int32_t ancestor_id_t;
@@ -52,13 +56,21 @@ typedef int32_t mutation_id_t;
 typedef struct _edge_t {
     site_id_t left;
     site_id_t right;
-    site_id_t end;
     node_id_t parent;
     node_id_t child;
     double time;
     struct _edge_t *next;
 } edge_t;
 
+/* Compact copy of an edge holding only the fields read by the matcher
+ * sweeps, so that the flat index arrays stream 16 bytes per edge. */
+typedef struct {
+    site_id_t left;
+    site_id_t right;
+    node_id_t parent;
+    node_id_t child;
+} indexed_edge_t;
+
 typedef struct _node_segment_list_node_t {
     ancestor_id_t start;
     ancestor_id_t end;
@@ -73,9 +85,17 @@ typedef struct _segment_t {
     struct _segment_t *next;
 } segment_t;
 
+/* Genotypes in the ancestor builder are stored bit-packed, one bit per
+ * sample. Sample 0 occupies the most significant bit of word 0, so that
+ * comparing words numerically is equivalent to comparing the unpacked
+ * genotypes lexicographically. */
+#define PACKED_GENOTYPE_WORDS(num_samples) (((num_samples) + 63) / 64)
+#define PACKED_GENOTYPE_GET(genotypes, j) \
+    (((genotypes)[(j) >> 6] >> (63 - ((j) & 63))) & 1)
+
 typedef struct {
     size_t frequency;
-    allele_t *genotypes;
+    uint64_t *genotypes;
 } site_t;
 
 typedef struct {
@@ -90,11 +110,13 @@ typedef struct _site_list_t {
     struct _site_list_t *next;
 } site_list_t;
 
-typedef struct {
-    allele_t *genotypes;
-    size_t num_samples;
+typedef struct _pattern_map_t {
+    uint64_t *genotypes;
+    size_t num_words;
+    size_t frequency;
     size_t num_sites;
     site_list_t *sites;
+    struct _pattern_map_t *next;
 } pattern_map_t;
 
 typedef struct {
@@ -107,11 +129,18 @@ typedef struct {
     size_t num_sites;
     size_t num_samples;
     size_t num_ancestors;
+    /* The number of words in each bit-packed genotype array. */
+    size_t num_genotype_words;
     int flags;
     site_t *sites;
-    /* frequency_map[f] is an AVL tree mapping unique genotypes to the sites that
-     * the occur at. Each of these sites has frequency f. */
-    avl_tree_t *frequency_map;
+    /* Scratch space for packing one site's genotypes. */
+    uint64_t *genotype_scratch;
+    /* Hash table mapping unique genotype patterns to the sites that they
+     * occur at, chained within each bucket. Lookups hash the packed
+     * genotypes and only compare them on collision. */
+    pattern_map_t **pattern_hash;
+    size_t pattern_hash_size;
+    size_t num_patterns;
     block_allocator_t allocator;
     ancestor_descriptor_t *descriptors;
 } ancestor_builder_t;
@@ -122,18 +151,71 @@ typedef struct _mutation_list_node_t {
     struct _mutation_list_node_t *next;
 } mutation_list_node_t;
 
-typedef struct {
+/* The traceback state for one site. Lists are stored either literally
+ * (base == NULL) or as a delta against an earlier literal list: the full
+ * list is then base's list with the removed nodes cleared and this
+ * list's (node, recombination_required) entries applied on top. Most
+ * sites differ from their neighbours in a handful of entries, so deltas
+ * keep traceback memory proportional to the rate of change rather than
+ * the number of likelihood nodes. */
+typedef struct _node_state_list_t {
     int32_t size;
     node_id_t *node;
     int8_t *recombination_required;
+    struct _node_state_list_t *base;
+    int32_t num_removed;
+    node_id_t *removed;
 } node_state_list_t;
 
+/* One spilled run of per-site traceback lists, stored contiguously in
+ * the matcher's spill file. Delta bases never cross a segment boundary,
+ * so a segment can be paged back in on its own. */
+typedef struct {
+    site_id_t lo;
+    site_id_t hi;
+    long offset;
+    size_t num_bytes;
+} traceback_segment_t;
+
+/* A snapshot of the left-to-right edge sweep taken at the tree starting at
+ * position: the cursor offsets into the flat edge indexes together with a
+ * copy of the quintuply linked tree valid over [left, position). The
+ * matcher resumes its seek loop from here instead of replaying all edge
+ * events from site 0. */
+typedef struct {
+    site_id_t left;
+    site_id_t position;
+    size_t in_index;
+    size_t out_index;
+    node_id_t *parent;
+    node_id_t *left_child;
+    node_id_t *right_child;
+    node_id_t *left_sib;
+    node_id_t *right_sib;
+} tree_checkpoint_t;
+
+/* Entry in the path hash, which indexes the edges on their
+ * (left, right, parent) segment for path compression. */
+typedef struct _path_hash_entry_t {
+    edge_t *edge;
+    struct _path_hash_entry_t *next;
+} path_hash_entry_t;
+
 typedef struct {
     int flags;
     size_t num_sites;
     struct {
         mutation_list_node_t **mutations;
     } sites;
+    /* Flat site-indexed copy of the mutation lists: the mutations at
+     * site l occupy [mutation_offset[l], mutation_offset[l + 1]) of the
+     * node and derived state columns. Rebuilt lazily with the flat
+     * indexes, so the matcher's per-site lookup is an array load. */
+    size_t *mutation_offset;
+    node_id_t *flat_mutation_node;
+    allele_t *flat_mutation_derived_state;
+    size_t max_flat_mutations;
+    bool flat_mutations_dirty;
     /* TODO add nodes struct */
     double *time;
     uint32_t *node_flags;
@@ -148,16 +230,63 @@ typedef struct {
     object_heap_t edge_heap;
     avl_tree_t left_index;
     avl_tree_t right_index;
-    avl_tree_t path_index;
+    /* Hash index on (left, right, parent) giving constant time lookup of
+     * shared path segments during path compression. */
+    path_hash_entry_t **path_hash;
+    size_t path_hash_size;
+    size_t num_path_hash_entries;
+    object_heap_t path_hash_entry_heap;
+    /* Flat copies of the left/right indexes in sorted order, used by the
+     * matcher's sweeps so that edges are read from contiguous memory
+     * rather than chased through AVL nodes. Rebuilt lazily by
+     * tree_sequence_builder_freeze_indexes() after edges change. */
+    indexed_edge_t *left_index_edges;
+    indexed_edge_t *right_index_edges;
+    size_t num_index_edges;
+    size_t max_index_edges;
+    bool flat_indexes_dirty;
+    /* Periodic tree checkpoints along the sequence, rebuilt with the flat
+     * indexes, so that matches starting in the middle of the sequence can
+     * seek rather than sweep from the left end. */
+    tree_checkpoint_t *checkpoints;
+    size_t num_checkpoints;
+    size_t num_checkpoint_nodes;
+    node_id_t *checkpoint_mem;
 } tree_sequence_builder_t;
 
+/* Counters describing the work done by a matcher over its lifetime.
+ * Updated on the hot paths, so everything here is a plain accumulator. */
+typedef struct {
+    /* Number of haplotypes matched. */
+    size_t num_matches;
+    /* Number of distinct trees swept during forwards matching. */
+    size_t num_tree_transitions;
+    /* Total likelihood node updates across all sites. */
+    size_t num_likelihood_nodes_updated;
+    /* Descendant tests performed, and preorder label rebuilds needed to
+     * serve them. */
+    size_t num_descendant_tests;
+    size_t num_preorder_builds;
+    /* Likelihood cache outcomes when coalescing likelihoods up the tree. */
+    size_t num_likelihood_cache_hits;
+    size_t num_likelihood_cache_misses;
+    /* Total memory held by the traceback allocator. */
+    size_t total_traceback_bytes;
+    /* Wall clock seconds spent in the forwards and traceback phases. */
+    double forwards_time;
+    double traceback_time;
+} ancestor_matcher_stats_t;
+
 typedef struct {
     int flags;
     tree_sequence_builder_t *tree_sequence_builder;
     size_t num_nodes;
     size_t num_sites;
     size_t max_nodes;
-    /* The quintuply linked tree */
+    /* The quintuply linked tree. The five arrays live in one contiguous
+     * block so that a node's topology entries stay in adjacent cache
+     * lines; the pointers below index into it. */
+    node_id_t *tree_arrays;
     node_id_t *parent;
     node_id_t *left_child;
     node_id_t *right_child;
@@ -165,8 +294,20 @@ typedef struct {
     node_id_t *right_sib;
     int8_t *likelihood;
     int8_t *likelihood_cache;
-    int8_t *path_cache;
+    /* Scratch buffers for the vectorized likelihood kernel: gathered
+     * likelihood values and recombination flags for the node list. */
+    int8_t *likelihood_gather;
+    int8_t *recomb_gather;
     int num_likelihood_nodes;
+    /* Preorder interval labels for the current tree, rebuilt lazily when
+     * the tree changes. Descendant tests are then a constant time range
+     * comparison; a label is valid only when its stamp is current. */
+    node_id_t *preorder_enter;
+    node_id_t *preorder_leave;
+    uint32_t *preorder_stamp;
+    node_id_t *preorder_stack;
+    uint32_t preorder_current_stamp;
+    bool preorder_valid;
     /* At each site, record a node with the maximum likelihood. */
     node_id_t *max_likelihood_node;
     /* Used during traceback to map nodes where recombination is required. */
@@ -174,8 +315,39 @@ typedef struct {
     node_id_t *likelihood_nodes_tmp;
     node_id_t *likelihood_nodes;
     node_state_list_t *traceback;
+    /* The literal list that delta-encoded traceback lists are currently
+     * expressed against, and the per-node values it stores. */
+    node_state_list_t *traceback_base;
+    int8_t *traceback_base_value;
+    /* Nodes whose tree entries were written during the current match, so
+     * that reset can restore the null state incrementally instead of
+     * memsetting the O(num_nodes) arrays. When the tree was loaded from a
+     * checkpoint the dirty set is unknown and a full reset is done. */
+    node_id_t *dirty_nodes;
+    size_t num_dirty_nodes;
+    size_t max_dirty_nodes;
+    bool tree_fully_dirty;
+    /* The interval matched by the previous match, whose per-site state
+     * must be cleared before the next one. */
+    site_id_t last_match_start;
+    site_id_t last_match_end;
     block_allocator_t traceback_allocator;
+    size_t traceback_block_size;
+    /* Hard cap in bytes on the traceback store; zero means unlimited.
+     * When the allocator grows past it, the finished left portion of the
+     * traceback is spilled to a temporary file and paged back in one
+     * segment at a time during the traceback. */
+    size_t traceback_budget;
+    FILE *traceback_file;
+    traceback_segment_t *traceback_segments;
+    size_t num_traceback_segments;
+    size_t max_traceback_segments;
+    int64_t traceback_next_segment;
+    /* The leftmost site whose traceback list is currently in memory. */
+    site_id_t traceback_resident_lo;
+    void *traceback_segment_buffer;
     size_t total_traceback_size;
+    ancestor_matcher_stats_t stats;
     struct {
         site_id_t *left;
         site_id_t *right;
@@ -185,6 +357,47 @@ typedef struct {
     } output;
 } ancestor_matcher_t;
 
+/* A single haplotype queued for matching. The haplotype and match buffers
+ * are owned by the caller; the output edges are copies of the matcher's
+ * buffers made so that they survive until the apply phase. */
+typedef struct {
+    node_id_t child;
+    site_id_t start;
+    site_id_t end;
+    allele_t *haplotype;
+    allele_t *match;
+    size_t num_edges;
+    site_id_t *left;
+    site_id_t *right;
+    node_id_t *parent;
+} match_work_t;
+
+/* Matches batches of independent haplotypes concurrently using a pool
+ * of per-thread matchers, applying the resulting paths serially at an
+ * epoch barrier. */
+typedef struct {
+    int flags;
+    size_t num_threads;
+    tree_sequence_builder_t *tree_sequence_builder;
+    ancestor_matcher_t *matchers;
+    /* Extra matchers used for batched matching; there are
+     * num_threads * batch_size of these, allocated on first use. */
+    ancestor_matcher_t *batch_matchers;
+    size_t batch_size;
+    match_work_t *work;
+    size_t num_work;
+    size_t max_work;
+    /* The next work item to be claimed; protected by mutex. */
+    size_t next_work;
+    /* The block size for the current run. */
+    size_t run_batch_size;
+    /* Traceback budget applied to every matcher, including the batch
+     * matchers allocated lazily later; zero means unlimited. */
+    size_t traceback_budget;
+    int error;
+    pthread_mutex_t mutex;
+} match_pool_t;
+
 int ancestor_builder_alloc(ancestor_builder_t *self,
         size_t num_samples, size_t num_sites, int flags);
 int ancestor_builder_free(ancestor_builder_t *self);
@@ -194,18 +407,42 @@ int ancestor_builder_add_site(ancestor_builder_t *self, site_id_t site,
 int ancestor_builder_make_ancestor(ancestor_builder_t *self,
         size_t num_focal_sites, site_id_t *focal_sites,
         site_id_t *start, site_id_t *end, allele_t *haplotype);
+int ancestor_builder_make_ancestors(ancestor_builder_t *self,
+        size_t start, size_t end, size_t num_threads,
+        allele_t *ancestors, site_id_t *starts, site_id_t *ends);
 int ancestor_builder_finalise(ancestor_builder_t *self);
 
 int ancestor_matcher_alloc(ancestor_matcher_t *self,
-        tree_sequence_builder_t *tree_sequence_builder, int flags);
+        tree_sequence_builder_t *tree_sequence_builder,
+        size_t traceback_block_size, int flags);
 int ancestor_matcher_free(ancestor_matcher_t *self);
+int ancestor_matcher_set_traceback_budget(ancestor_matcher_t *self,
+        size_t traceback_budget);
 int ancestor_matcher_find_path(ancestor_matcher_t *self,
         site_id_t start, site_id_t end, allele_t *haplotype,
         allele_t *matched_haplotype, size_t *num_output_edges,
         site_id_t **left_output, site_id_t **right_output, node_id_t **parent_output);
+int ancestor_matcher_find_paths_batch(ancestor_matcher_t **matchers,
+        size_t num_matchers, site_id_t start, site_id_t end,
+        allele_t **haplotypes, allele_t **matched_haplotypes,
+        size_t *num_output_edges, site_id_t **left_output,
+        site_id_t **right_output, node_id_t **parent_output);
 int ancestor_matcher_print_state(ancestor_matcher_t *self, FILE *out);
 double ancestor_matcher_get_mean_traceback_size(ancestor_matcher_t *self);
 size_t ancestor_matcher_get_total_memory(ancestor_matcher_t *self);
+int ancestor_matcher_get_stats(ancestor_matcher_t *self,
+        ancestor_matcher_stats_t *stats);
+
+int match_pool_alloc(match_pool_t *self,
+        tree_sequence_builder_t *tree_sequence_builder, size_t num_threads,
+        size_t max_work, int flags);
+int match_pool_free(match_pool_t *self);
+int match_pool_set_traceback_budget(match_pool_t *self, size_t traceback_budget);
+int match_pool_print_state(match_pool_t *self, FILE *out);
+int match_pool_submit(match_pool_t *self, node_id_t child, site_id_t start,
+        site_id_t end, allele_t *haplotype, allele_t *match);
+int match_pool_run(match_pool_t *self, int path_flags);
+int match_pool_run_batched(match_pool_t *self, int path_flags, size_t batch_size);
 
 int tree_sequence_builder_alloc(tree_sequence_builder_t *self,
         size_t num_sites, size_t nodes_chunk_size, size_t edges_chunk_size, int flags);
@@ -218,6 +455,7 @@ int tree_sequence_builder_add_path(tree_sequence_builder_t *self,
         node_id_t *parent, int flags);
 int tree_sequence_builder_add_mutations(tree_sequence_builder_t *self,
         node_id_t node, size_t num_mutations, site_id_t *site, allele_t *derived_state);
+int tree_sequence_builder_freeze_indexes(tree_sequence_builder_t *self);
 size_t tree_sequence_builder_get_num_nodes(tree_sequence_builder_t *self);
 size_t tree_sequence_builder_get_num_edges(tree_sequence_builder_t *self);
 size_t tree_sequence_builder_get_num_mutations(tree_sequence_builder_t *self);
@@ -239,6 +477,13 @@ int tree_sequence_builder_dump_edges(tree_sequence_builder_t *self,
 int tree_sequence_builder_dump_mutations(tree_sequence_builder_t *self,
         site_id_t *site, ancestor_id_t *node, allele_t *derived_state,
         mutation_id_t *parent);
+/* Single-file binary snapshot of the complete builder state, including
+ * the edge index orderings so that a restore bulk-loads the indexes
+ * without per-edge rebalancing. */
+int tree_sequence_builder_dump_snapshot(tree_sequence_builder_t *self,
+        const char *path);
+int tree_sequence_builder_restore_snapshot(tree_sequence_builder_t *self,
+        const char *path);
 
 #define tsi_safe_free(pointer) \
 do {\